@@ -0,0 +1,43 @@
+// Copyright (c) 2019, FlightAware LLC.
+// All rights reserved.
+// Licensed under the 2-clause BSD license; see the LICENSE file
+
+#include "alloc_counter.h"
+
+#include <cstdlib>
+#include <new>
+
+static thread_local std::uint64_t thread_allocations = 0;
+
+std::uint64_t flightaware::uat::ThreadAllocationCount() { return thread_allocations; }
+
+static void *CountedAllocate(std::size_t size) {
+    ++thread_allocations;
+    return std::malloc(size ? size : 1);
+}
+
+void *operator new(std::size_t size) {
+    void *p = CountedAllocate(size);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void *operator new[](std::size_t size) {
+    void *p = CountedAllocate(size);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept { return CountedAllocate(size); }
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept { return CountedAllocate(size); }
+
+void operator delete(void *p) noexcept { std::free(p); }
+
+void operator delete[](void *p) noexcept { std::free(p); }
+
+void operator delete(void *p, const std::nothrow_t &) noexcept { std::free(p); }
+
+void operator delete[](void *p, const std::nothrow_t &) noexcept { std::free(p); }
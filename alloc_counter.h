@@ -0,0 +1,22 @@
+// -*- c++ -*-
+
+// Copyright (c) 2019, FlightAware LLC.
+// All rights reserved.
+// Licensed under the 2-clause BSD license; see the LICENSE file
+
+#ifndef DUMP978_ALLOC_COUNTER_H
+#define DUMP978_ALLOC_COUNTER_H
+
+#include <cstdint>
+
+namespace flightaware::uat {
+    // Linking alloc_counter.o replaces the global operator new / delete with
+    // versions that count allocations per thread. Sampling the count before
+    // and after a piece of work shows how many heap allocations that work
+    // made on the current thread; other threads do not disturb the count.
+
+    // Return the number of allocations made so far by the calling thread
+    std::uint64_t ThreadAllocationCount();
+}; // namespace flightaware::uat
+
+#endif
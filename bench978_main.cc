@@ -0,0 +1,496 @@
+// Copyright (c) 2019, FlightAware LLC.
+// All rights reserved.
+// Licensed under the 2-clause BSD license; see the LICENSE file
+
+// bench978: run the receive chain (sample conversion, sync search,
+// demodulation / FEC, message decoding) over a fixed input as fast as
+// possible and report throughput and per-stage timings as JSON.
+//
+// The input is either an IQ capture (--iq), or is synthesised from a file of
+// raw messages in the format written by --raw-port (--messages), such as
+// sample-data.txt.gz once decompressed.
+
+#include <boost/exception/diagnostic_information.hpp>
+#include <boost/program_options.hpp>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <random>
+
+#include <json.hpp>
+
+#include "alloc_counter.h"
+#include "convert.h"
+#include "demodulator.h"
+#include "uat_message.h"
+#include "uat_protocol.h"
+
+using namespace flightaware::uat;
+
+namespace po = boost::program_options;
+
+// Specializations of validate for --format
+namespace flightaware::uat {
+    void validate(boost::any &v, const std::vector<std::string> &values, SampleFormat *target_type, int) {
+        po::validators::check_first_occurrence(v);
+        const std::string &s = po::validators::get_single_string(values);
+
+        // clang-format off
+        static std::map<std::string, SampleFormat> formats = {
+            {"CU8", SampleFormat::CU8},
+            {"CS8", SampleFormat::CS8},
+            {"CS16H", SampleFormat::CS16H},
+            {"CF32H", SampleFormat::CF32H}
+        };
+        // clang-format on
+
+        auto entry = formats.find(s);
+        if (entry == formats.end())
+            throw po::validation_error(po::validation_error::invalid_option_value);
+
+        v = boost::any(entry->second);
+    }
+} // namespace flightaware::uat
+
+#define EXIT_NO_RESTART (64)
+
+// Read raw messages ("-hex;..." or "+hex;...", one per line) from `in`.
+// Lines that do not parse are skipped.
+static std::vector<Bytes> ReadMessages(std::istream &in) {
+    std::vector<Bytes> messages;
+
+    auto hexvalue = [](char c) -> int {
+        if (c >= '0' && c <= '9')
+            return c - '0';
+        if (c >= 'a' && c <= 'f')
+            return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F')
+            return c - 'A' + 10;
+        return -1;
+    };
+
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.size() < 2 || (line[0] != '-' && line[0] != '+'))
+            continue;
+
+        auto eod = line.find(';');
+        if (eod == std::string::npos)
+            eod = line.size();
+
+        Bytes payload;
+        bool ok = ((eod - 1) % 2 == 0);
+        for (std::size_t i = 1; ok && i < eod; i += 2) {
+            auto h1 = hexvalue(line[i]);
+            auto h2 = hexvalue(line[i + 1]);
+            ok = (h1 >= 0 && h2 >= 0);
+            payload.push_back((h1 << 4) | h2);
+        }
+
+        if (ok && (payload.size() == DOWNLINK_SHORT_DATA_BYTES || payload.size() == DOWNLINK_LONG_DATA_BYTES || payload.size() == UPLINK_DATA_BYTES))
+            messages.emplace_back(std::move(payload));
+    }
+
+    return messages;
+}
+
+// Reed-Solomon encoder for the UAT codes, used to turn raw messages back into
+// transmitted frames. Same field and roots as FEC.
+class Encoder {
+  public:
+    Encoder() {
+        unsigned sr = 1;
+        for (unsigned i = 0; i < 255; ++i) {
+            alpha_to_[i] = sr;
+            index_of_[sr] = i;
+            sr <<= 1;
+            if (sr & 0x100)
+                sr ^= fec::UPLINK_BLOCK_POLY;
+        }
+    }
+
+    // Return `data` followed by `nroots` parity bytes
+    Bytes Encode(Bytes::const_iterator begin, Bytes::const_iterator end, unsigned nroots) const {
+        // generator polynomial, highest power first
+        std::vector<std::uint8_t> generator{1};
+        for (unsigned i = 0; i < nroots; ++i) {
+            const unsigned root = (fec::FCR + i * fec::PRIM) % 255;
+            generator.push_back(0);
+            for (std::size_t j = generator.size() - 1; j > 0; --j) {
+                generator[j] ^= Multiply(generator[j - 1], root);
+            }
+        }
+
+        // systematic encoding: parity is the remainder of data(x) * x^nroots
+        Bytes frame(begin, end);
+        frame.resize(frame.size() + nroots, 0);
+        Bytes remainder = frame;
+        const std::size_t data_bytes = std::distance(begin, end);
+        for (std::size_t i = 0; i < data_bytes; ++i) {
+            const auto coef = remainder[i];
+            if (!coef)
+                continue;
+            for (std::size_t j = 1; j < generator.size(); ++j) {
+                remainder[i + j] ^= Multiply(generator[j], index_of_[coef]);
+            }
+        }
+
+        std::copy(remainder.begin() + data_bytes, remainder.end(), frame.begin() + data_bytes);
+        return frame;
+    }
+
+    // Return the sync word and encoded (and for uplink, interleaved) frame
+    // for the given message payload
+    std::pair<std::uint64_t, Bytes> Frame(const Bytes &payload) const {
+        switch (payload.size()) {
+        case DOWNLINK_SHORT_DATA_BYTES:
+            return {DOWNLINK_SYNC_WORD, Encode(payload.begin(), payload.end(), fec::DOWNLINK_SHORT_ROOTS)};
+        case DOWNLINK_LONG_DATA_BYTES:
+            return {DOWNLINK_SYNC_WORD, Encode(payload.begin(), payload.end(), fec::DOWNLINK_LONG_ROOTS)};
+        default: {
+            Bytes raw(UPLINK_BYTES);
+            for (unsigned block = 0; block < UPLINK_BLOCKS_PER_FRAME; ++block) {
+                auto data = payload.begin() + block * UPLINK_BLOCK_DATA_BYTES;
+                auto encoded = Encode(data, data + UPLINK_BLOCK_DATA_BYTES, fec::UPLINK_BLOCK_ROOTS);
+                for (unsigned i = 0; i < UPLINK_BLOCK_BYTES; ++i) {
+                    raw[i * UPLINK_BLOCKS_PER_FRAME + block] = encoded[i];
+                }
+            }
+            return {UPLINK_SYNC_WORD, std::move(raw)};
+        }
+        }
+    }
+
+  private:
+    // multiply x by alpha^log_c
+    std::uint8_t Multiply(std::uint8_t x, unsigned log_c) const { return x ? alpha_to_[(index_of_[x] + log_c) % 255] : 0; }
+
+    std::array<std::uint8_t, 255> alpha_to_;
+    std::array<unsigned, 256> index_of_;
+};
+
+// Append one IQ sample to `out` in the given format; i and q are nominally
+// in the range -1 .. +1
+static void AppendSample(Bytes &out, SampleFormat format, double i, double q) {
+    auto clamp = [](double v, double lo, double hi) { return v < lo ? lo : v > hi ? hi : v; };
+
+    switch (format) {
+    case SampleFormat::CU8:
+        out.push_back(std::lround(clamp(i * 127.5 + 127.5, 0, 255)));
+        out.push_back(std::lround(clamp(q * 127.5 + 127.5, 0, 255)));
+        break;
+    case SampleFormat::CS8:
+        out.push_back(static_cast<std::uint8_t>(static_cast<std::int8_t>(std::lround(clamp(i * 127, -128, 127)))));
+        out.push_back(static_cast<std::uint8_t>(static_cast<std::int8_t>(std::lround(clamp(q * 127, -128, 127)))));
+        break;
+    case SampleFormat::CS16H: {
+        std::int16_t iq[2] = {static_cast<std::int16_t>(std::lround(clamp(i * 16384, -32768, 32767))), static_cast<std::int16_t>(std::lround(clamp(q * 16384, -32768, 32767)))};
+        auto p = reinterpret_cast<const std::uint8_t *>(iq);
+        out.insert(out.end(), p, p + sizeof(iq));
+        break;
+    }
+    case SampleFormat::CF32H: {
+        float iq[2] = {static_cast<float>(i), static_cast<float>(q)};
+        auto p = reinterpret_cast<const std::uint8_t *>(iq);
+        out.insert(out.end(), p, p + sizeof(iq));
+        break;
+    }
+    default:
+        throw std::logic_error("unhandled sample format");
+    }
+}
+
+// Build a 2.083333MHz IQ capture containing each of `messages` once, in order,
+// separated by random gaps of noise. `noise` is the standard deviation of the
+// gaussian noise added to every sample, relative to a signal amplitude of 0.8.
+static Bytes Synthesise(const std::vector<Bytes> &messages, SampleFormat format, double noise) {
+    Encoder encoder;
+    std::mt19937 rng(1);
+    std::normal_distribution<double> gaussian(0, noise > 0 ? noise : 1e-9);
+    std::uniform_int_distribution<unsigned> gap_samples(200, 30000);
+    std::uniform_real_distribution<double> random_phase(0, 2 * M_PI);
+
+    const double amplitude = 0.8;
+    // +/- 312.5kHz deviation at 2 samples per bit
+    const double phase_step = 0.6 * M_PI / 2;
+
+    Bytes out;
+    auto emit = [&](double phase, double amp) { AppendSample(out, format, amp * std::cos(phase) + (noise > 0 ? gaussian(rng) : 0), amp * std::sin(phase) + (noise > 0 ? gaussian(rng) : 0)); };
+    auto emit_gap = [&](unsigned n) {
+        for (unsigned s = 0; s < n; ++s)
+            emit(random_phase(rng), noise > 0 ? 0 : 0.05);
+    };
+
+    double phase = 0;
+    for (const auto &payload : messages) {
+        emit_gap(gap_samples(rng));
+
+        auto frame = encoder.Frame(payload);
+        std::vector<bool> bits;
+        for (unsigned i = 0; i < SYNC_BITS; ++i)
+            bits.push_back((frame.first >> (SYNC_BITS - 1 - i)) & 1);
+        for (auto b : frame.second)
+            for (unsigned i = 0; i < 8; ++i)
+                bits.push_back((b >> (7 - i)) & 1);
+
+        for (auto bit : bits) {
+            for (unsigned s = 0; s < 2; ++s) {
+                phase += (bit ? phase_step : -phase_step);
+                emit(phase, amplitude);
+            }
+        }
+    }
+
+    emit_gap(TwoMegDemodulator().NumTrailingSamples() + 1000);
+    return out;
+}
+
+// Accumulated wall-clock time for one stage
+class StageTimer {
+  public:
+    template <class F> void Time(F f) {
+        auto start = std::chrono::steady_clock::now();
+        f();
+        total_ += std::chrono::steady_clock::now() - start;
+    }
+
+    std::uint64_t Nanoseconds() const { return std::chrono::duration_cast<std::chrono::nanoseconds>(total_).count(); }
+
+  private:
+    std::chrono::steady_clock::duration total_ = std::chrono::steady_clock::duration::zero();
+};
+
+static int realmain(int argc, char **argv) {
+    // clang-format off
+    po::options_description desc("Allowed options");
+    desc.add_options()
+        ("help", "produce help message")
+        ("version", "show version")
+        ("messages", po::value<std::string>(), "synthesise input from raw messages read from this file ('-' for stdin)")
+        ("iq", po::value<std::string>(), "read input from this IQ capture file")
+        ("format", po::value<SampleFormat>()->default_value(SampleFormat::CU8, "CU8"), "sample format of synthesised input or --iq file: CU8, CS8, CS16H, CF32H")
+        ("noise", po::value<double>()->default_value(0.1), "noise level for synthesised input (standard deviation, signal amplitude is 0.8)")
+        ("repeat", po::value<unsigned>()->default_value(1), "repeat each synthesised message this many times")
+        ("block-samples", po::value<std::size_t>()->default_value(524288), "number of samples handed to the receive chain at once")
+        ("iterations", po::value<unsigned>()->default_value(5), "number of passes over the input");
+    // clang-format on
+
+    po::variables_map opts;
+
+    try {
+        po::store(po::parse_command_line(argc, argv, desc), opts);
+        po::notify(opts);
+    } catch (boost::program_options::error &err) {
+        std::cerr << err.what() << std::endl;
+        std::cerr << desc << std::endl;
+        return EXIT_NO_RESTART;
+    }
+
+    if (opts.count("help")) {
+        std::cerr << "bench978 " << VERSION << std::endl;
+        std::cerr << desc << std::endl;
+        return EXIT_NO_RESTART;
+    }
+
+    if (opts.count("version")) {
+        std::cerr << "bench978 " << VERSION << std::endl;
+        return EXIT_NO_RESTART;
+    }
+
+    if (opts.count("messages") + opts.count("iq") != 1) {
+        std::cerr << "exactly one of --messages or --iq must be specified" << std::endl;
+        return EXIT_NO_RESTART;
+    }
+
+    const auto format = opts["format"].as<SampleFormat>();
+    const auto bytes_per_sample = BytesPerSample(format);
+    const auto block_samples = opts["block-samples"].as<std::size_t>();
+    const auto iterations = opts["iterations"].as<unsigned>();
+    if (!block_samples || !iterations) {
+        std::cerr << "--block-samples and --iterations must be positive" << std::endl;
+        return EXIT_NO_RESTART;
+    }
+
+    Bytes input;
+    std::size_t expected_messages = 0; // for synthesised input
+    if (opts.count("messages")) {
+        std::vector<Bytes> messages;
+        auto path = opts["messages"].as<std::string>();
+        if (path == "-") {
+            messages = ReadMessages(std::cin);
+        } else {
+            std::ifstream in(path);
+            if (!in) {
+                std::cerr << path << ": cannot open" << std::endl;
+                return EXIT_NO_RESTART;
+            }
+            messages = ReadMessages(in);
+        }
+
+        if (messages.empty()) {
+            std::cerr << "no messages found in input" << std::endl;
+            return EXIT_NO_RESTART;
+        }
+
+        std::vector<Bytes> repeated;
+        for (unsigned i = 0; i < opts["repeat"].as<unsigned>(); ++i)
+            repeated.insert(repeated.end(), messages.begin(), messages.end());
+
+        input = Synthesise(repeated, format, opts["noise"].as<double>());
+        expected_messages = repeated.size();
+    } else {
+        auto path = opts["iq"].as<std::string>();
+        std::ifstream in(path, std::ios::binary);
+        if (!in) {
+            std::cerr << path << ": cannot open" << std::endl;
+            return EXIT_NO_RESTART;
+        }
+        input.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        input.resize(input.size() - input.size() % bytes_per_sample);
+        if (input.empty()) {
+            std::cerr << path << ": no samples" << std::endl;
+            return EXIT_NO_RESTART;
+        }
+    }
+
+    // The receive chain, as run by PipelinedReceiver, but with each stage
+    // timed separately on a single thread
+    auto converter = SampleConverter::Create(format);
+    TwoMegDemodulator demodulator;
+    const std::size_t trailing_samples = demodulator.NumTrailingSamples();
+
+    StageTimer convert_timer, sync_timer, demod_timer, decode_timer;
+    std::uint64_t total_samples = 0, blocks = 0, empty_blocks = 0;
+    std::uint64_t block_allocations = 0, empty_block_allocations = 0;
+    std::uint64_t downlink_messages = 0, uplink_messages = 0, corrected_errors = 0;
+    std::uint64_t decoded_adsb = 0;
+
+    Bytes samples;
+    PhaseDiffBuffer dphi;
+    std::vector<TwoMegDemodulator::SyncCandidate> candidates;
+
+    const auto wall_start = std::chrono::steady_clock::now();
+
+    for (unsigned iteration = 0; iteration < iterations; ++iteration) {
+        std::size_t saved_samples = 0;
+        for (auto next = input.cbegin(); next != input.cend();) {
+            const auto chunk_bytes = std::min<std::size_t>(block_samples * bytes_per_sample, std::distance(next, input.cend()));
+            const auto n_samples = saved_samples + chunk_bytes / bytes_per_sample;
+
+            // carry over the tail of the previous block
+            samples.resize(n_samples * bytes_per_sample);
+            std::copy(next, next + chunk_bytes, samples.begin() + saved_samples * bytes_per_sample);
+            next += chunk_bytes;
+            dphi.resize(n_samples);
+
+            const auto allocations_before = ThreadAllocationCount();
+
+            convert_timer.Time([&]() { converter->ConvertPhaseDifference(samples.data(), samples.data() + samples.size(), dphi.begin()); });
+
+            sync_timer.Time([&]() { demodulator.FindSync(dphi.begin(), dphi.end(), candidates); });
+
+            std::vector<Demodulator::Message> messages;
+            demod_timer.Time([&]() {
+                PhaseDiffBuffer::const_iterator decoded_until = dphi.begin();
+                for (const auto &candidate : candidates) {
+                    if (candidate.start < decoded_until)
+                        continue;
+
+                    auto message = demodulator.DemodBest(candidate.start, candidate.downlink);
+                    if (!message)
+                        continue;
+
+                    decoded_until = message->end;
+                    messages.emplace_back(std::move(message.value()));
+                }
+            });
+
+            const auto allocations = ThreadAllocationCount() - allocations_before;
+            ++blocks;
+            block_allocations += allocations;
+            if (messages.empty()) {
+                ++empty_blocks;
+                empty_block_allocations += allocations;
+            }
+
+            decode_timer.Time([&]() {
+                for (auto &message : messages) {
+                    corrected_errors += message.corrected_errors;
+                    RawMessage raw(std::move(message.payload), 0, message.corrected_errors, 0);
+                    if (raw.Type() == MessageType::UPLINK) {
+                        ++uplink_messages;
+                    } else {
+                        ++downlink_messages;
+                        AdsbMessage adsb(raw);
+                        if (adsb.address)
+                            ++decoded_adsb;
+                    }
+                }
+            });
+
+            total_samples += n_samples - saved_samples;
+
+            // preserve the tail of the sample buffer for next time
+            saved_samples = std::min(n_samples, trailing_samples);
+            std::copy(samples.end() - saved_samples * bytes_per_sample, samples.end(), samples.begin());
+        }
+    }
+
+    const auto wall_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - wall_start).count();
+    const double wall_seconds = wall_ns / 1e9;
+    const auto total_messages = downlink_messages + uplink_messages;
+
+    auto stage = [total_samples](const StageTimer &timer) {
+        nlohmann::json j;
+        j["ns"] = timer.Nanoseconds();
+        j["ns_per_sample"] = RoundN(1.0 * timer.Nanoseconds() / total_samples, 3);
+        return j;
+    };
+
+    nlohmann::json result;
+    result["version"] = "bench978 " VERSION;
+    result["input"] = opts.count("iq") ? "iq" : "synthesised";
+    result["iterations"] = iterations;
+    result["block_samples"] = block_samples;
+    result["samples"] = total_samples;
+    result["blocks"] = blocks;
+    result["seconds"] = RoundN(wall_seconds, 6);
+    result["samples_per_second"] = std::llround(total_samples / wall_seconds);
+    result["realtime_factor"] = RoundN(total_samples / wall_seconds / 2083333, 2);
+    result["messages"] = total_messages;
+    result["messages_per_second"] = RoundN(total_messages / wall_seconds, 1);
+    result["downlink_messages"] = downlink_messages;
+    result["uplink_messages"] = uplink_messages;
+    result["corrected_errors"] = corrected_errors;
+    result["adsb_decoded"] = decoded_adsb;
+    if (opts.count("messages")) {
+        result["expected_messages"] = expected_messages * iterations;
+    }
+    result["stages"]["convert"] = stage(convert_timer);
+    result["stages"]["sync"] = stage(sync_timer);
+    result["stages"]["demod_fec"] = stage(demod_timer);
+    result["stages"]["decode"] = stage(decode_timer);
+    result["allocations_per_block"] = RoundN(1.0 * block_allocations / blocks, 3);
+    result["allocations_per_empty_block"] = empty_blocks ? RoundN(1.0 * empty_block_allocations / empty_blocks, 3) : 0.0;
+
+    std::cout << result << std::endl;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+#ifndef DEBUG_EXCEPTIONS
+    try {
+        return realmain(argc, argv);
+    } catch (...) {
+        std::cerr << "Uncaught exception: " << boost::current_exception_diagnostic_information() << std::endl;
+        return 2;
+    }
+#else
+    return realmain(argc, argv);
+#endif
+}
@@ -0,0 +1,93 @@
+// -*- c++ -*-
+
+// Copyright (c) 2019, FlightAware LLC.
+// All rights reserved.
+// Licensed under the 2-clause BSD license; see the LICENSE file
+
+#ifndef DUMP978_BOUNDED_QUEUE_H
+#define DUMP978_BOUNDED_QUEUE_H
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+namespace flightaware::uat {
+    // A fixed-capacity blocking FIFO used to hand work between threads.
+    // Producers block while the queue is full; consumers block while it is
+    // empty. Once closed, Push fails immediately and Pop drains whatever is
+    // left before failing.
+    template <typename T> class BoundedQueue {
+      public:
+        explicit BoundedQueue(std::size_t capacity) : capacity_(capacity) {}
+
+        BoundedQueue(const BoundedQueue &) = delete;
+        BoundedQueue &operator=(const BoundedQueue &) = delete;
+
+        // Add `item` to the queue, waiting for space if needed.
+        // Returns false (and discards `item`) if the queue has been closed.
+        bool Push(T item) {
+            std::unique_lock<std::mutex> lock(mutex_);
+            not_full_.wait(lock, [this] { return closed_ || items_.size() < capacity_; });
+            if (closed_)
+                return false;
+
+            items_.push_back(std::move(item));
+            lock.unlock();
+            not_empty_.notify_one();
+            return true;
+        }
+
+        // Add `item` to the queue only if there is space for it right now.
+        // Returns false (and discards `item`) if the queue is full or closed.
+        bool TryPush(T item) {
+            std::unique_lock<std::mutex> lock(mutex_);
+            if (closed_ || items_.size() >= capacity_)
+                return false;
+
+            items_.push_back(std::move(item));
+            lock.unlock();
+            not_empty_.notify_one();
+            return true;
+        }
+
+        // Remove the oldest item from the queue into `item`, waiting for one
+        // to arrive if needed. Returns false if the queue is closed and empty.
+        bool Pop(T &item) {
+            std::unique_lock<std::mutex> lock(mutex_);
+            not_empty_.wait(lock, [this] { return closed_ || !items_.empty(); });
+            if (items_.empty())
+                return false;
+
+            item = std::move(items_.front());
+            items_.pop_front();
+            lock.unlock();
+            not_full_.notify_one();
+            return true;
+        }
+
+        // Return the number of items currently queued
+        std::size_t Size() {
+            std::unique_lock<std::mutex> lock(mutex_);
+            return items_.size();
+        }
+
+        // Stop accepting new items and wake up any waiting threads
+        void Close() {
+            std::unique_lock<std::mutex> lock(mutex_);
+            closed_ = true;
+            lock.unlock();
+            not_full_.notify_all();
+            not_empty_.notify_all();
+        }
+
+      private:
+        std::size_t capacity_;
+        std::mutex mutex_;
+        std::condition_variable not_full_;
+        std::condition_variable not_empty_;
+        std::deque<T> items_;
+        bool closed_ = false;
+    };
+}; // namespace flightaware::uat
+
+#endif
@@ -20,6 +20,10 @@ namespace flightaware::uat {
     typedef std::vector<std::uint8_t> Bytes;
     typedef std::vector<std::uint16_t> PhaseBuffer;
 
+    // Phase differences between adjacent samples: element N holds the
+    // (wrapped) phase change from sample N to sample N+1
+    typedef std::vector<std::int16_t> PhaseDiffBuffer;
+
     inline static double RoundN(double value, unsigned dp) {
         const double scale = std::pow(10, dp);
         return std::round(value * scale) / scale;
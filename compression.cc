@@ -0,0 +1,81 @@
+// Copyright (c) 2019, FlightAware LLC.
+// All rights reserved.
+// Licensed under the 2-clause BSD license; see the LICENSE file
+
+#include "compression.h"
+
+#include <new>
+
+using namespace flightaware::uat;
+
+// windowBits for deflateInit2 and inflateInit2: a 32kB window, plus 16 to
+// write a gzip wrapper, or plus 32 to accept either a gzip or zlib wrapper
+static const int WINDOW_BITS = 15;
+static const int GZIP_WRAPPER = 16;
+static const int AUTO_WRAPPER = 32;
+
+Deflater::Deflater() {
+    stream_.zalloc = Z_NULL;
+    stream_.zfree = Z_NULL;
+    stream_.opaque = Z_NULL;
+    if (deflateInit2(&stream_, Z_DEFAULT_COMPRESSION, Z_DEFLATED, WINDOW_BITS + GZIP_WRAPPER, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        throw std::bad_alloc();
+    }
+}
+
+Deflater::~Deflater() { deflateEnd(&stream_); }
+
+void Deflater::Compress(const void *data, std::size_t size, bool sync, std::string &out) {
+    stream_.next_in = static_cast<Bytef *>(const_cast<void *>(data));
+    stream_.avail_in = size;
+
+    // deflate only fails on a bad stream or flush value, and neither can
+    // happen here; keep going until it stops filling the output space
+    Bytef chunk[16384];
+    do {
+        stream_.next_out = chunk;
+        stream_.avail_out = sizeof(chunk);
+        deflate(&stream_, sync ? Z_SYNC_FLUSH : Z_NO_FLUSH);
+        out.append(reinterpret_cast<const char *>(chunk), sizeof(chunk) - stream_.avail_out);
+    } while (stream_.avail_out == 0);
+}
+
+Inflater::Inflater() {
+    stream_.zalloc = Z_NULL;
+    stream_.zfree = Z_NULL;
+    stream_.opaque = Z_NULL;
+    stream_.next_in = Z_NULL;
+    stream_.avail_in = 0;
+    if (inflateInit2(&stream_, WINDOW_BITS + AUTO_WRAPPER) != Z_OK) {
+        throw std::bad_alloc();
+    }
+}
+
+Inflater::~Inflater() { inflateEnd(&stream_); }
+
+void Inflater::Reset() { inflateReset(&stream_); }
+
+bool Inflater::Decompress(const std::uint8_t *in, std::size_t in_size, std::size_t &consumed, std::uint8_t *out, std::size_t out_size, std::size_t &produced) {
+    stream_.next_in = const_cast<Bytef *>(in);
+    stream_.avail_in = in_size;
+    stream_.next_out = out;
+    stream_.avail_out = out_size;
+
+    const int rc = inflate(&stream_, Z_NO_FLUSH);
+    consumed = in_size - stream_.avail_in;
+    produced = out_size - stream_.avail_out;
+
+    switch (rc) {
+    case Z_OK:
+    case Z_BUF_ERROR: // no progress possible until there is more input
+        return true;
+
+    case Z_STREAM_END:
+        // the sender finished its stream; expect another to follow
+        inflateReset(&stream_);
+        return true;
+
+    default:
+        return false;
+    }
+}
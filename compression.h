@@ -0,0 +1,63 @@
+// -*- c++ -*-
+
+// Copyright (c) 2019, FlightAware LLC.
+// All rights reserved.
+// Licensed under the 2-clause BSD license; see the LICENSE file
+
+#ifndef DUMP978_COMPRESSION_H
+#define DUMP978_COMPRESSION_H
+
+#include <cstdint>
+#include <string>
+
+#include <zlib.h>
+
+namespace flightaware::uat {
+    // Compresses one output stream in the gzip format, so that the stream of
+    // a compressed port can be read with `gzip -dc` as well as by
+    // StreamInput. Not thread-safe: each connection owns one.
+    class Deflater {
+      public:
+        Deflater();
+        ~Deflater();
+
+        Deflater(const Deflater &) = delete;
+        Deflater &operator=(const Deflater &) = delete;
+
+        // Compress `size` bytes at `data`, appending whatever output the
+        // compressor produces to `out`. Most of it is held back to be
+        // compressed along with later data, unless `sync` is set: then
+        // everything so far is flushed through to `out` so that the reader
+        // can decode it.
+        void Compress(const void *data, std::size_t size, bool sync, std::string &out);
+
+      private:
+        z_stream stream_;
+    };
+
+    // Decompresses a gzip or zlib stream. Not thread-safe.
+    class Inflater {
+      public:
+        Inflater();
+        ~Inflater();
+
+        Inflater(const Inflater &) = delete;
+        Inflater &operator=(const Inflater &) = delete;
+
+        // Start again at the beginning of a new stream
+        void Reset();
+
+        // Decompress from `in` .. `in + in_size` into `out` .. `out + out_size`,
+        // setting `consumed` and `produced` to the number of bytes used and
+        // written. Returns false if the stream is corrupt.
+        bool Decompress(const std::uint8_t *in, std::size_t in_size, std::size_t &consumed, std::uint8_t *out, std::size_t out_size, std::size_t &produced);
+
+        // zlib's description of the last error
+        std::string Error() const { return stream_.msg ? stream_.msg : "corrupt compressed data"; }
+
+      private:
+        z_stream stream_;
+    };
+}; // namespace flightaware::uat
+
+#endif
@@ -3,8 +3,11 @@
 // Licensed under the 2-clause BSD license; see the LICENSE file
 
 #include "convert.h"
+#include "convert_simd.h"
+#include "convert_tables.h"
 
 #include <assert.h>
+#include <algorithm>
 #include <cmath>
 
 using namespace flightaware::uat;
@@ -19,17 +22,46 @@ static inline std::uint16_t scaled_atan2(double y, double x) {
     return scaled_ang < 0 ? 0 : scaled_ang > 65535 ? 65535 : (std::uint16_t)scaled_ang;
 }
 
-static inline std::uint16_t scaled_atan(double x) {
-    double ang = std::atan(x);
-    if (ang < 0) {
-        // atan returns [-pi/2..pi/2], normalize to [0..2*pi]
-        ang += 2 * M_PI;
+static inline double magsq(double i, double q) { return i * i + q * q; }
+
+SampleConverter::SampleConverter(SampleFormat format) : phase_kernel_(simd::SelectPhaseKernel(format)), format_(format), bytes_per_sample_(flightaware::uat::BytesPerSample(format)) {}
+
+void SampleConverter::ConvertPhaseDifference(const std::uint8_t *begin, const std::uint8_t *end, PhaseDiffBuffer::iterator out) {
+    // Convert a chunk at a time into a buffer small enough to stay in L1,
+    // carrying the last phase value of each chunk over to the next one.
+    const std::size_t chunk_samples = 2048;
+    auto &phase = phase_scratch_;
+    phase.resize(chunk_samples + 1);
+
+    const auto bps = BytesPerSample();
+    auto n = std::distance(begin, end) / bps;
+    if (n == 0) {
+        return;
     }
-    double scaled_ang = std::round(32768 * ang / M_PI);
-    return scaled_ang < 0 ? 0 : scaled_ang > 65535 ? 65535 : (std::uint16_t)scaled_ang;
-}
 
-static inline double magsq(double i, double q) { return i * i + q * q; }
+    // phase[0] holds the last sample of the previous chunk
+    ConvertPhase(begin, begin + bps, phase.begin());
+    begin += bps;
+    --n;
+
+    while (n > 0) {
+        const auto count = std::min<std::size_t>(n, chunk_samples);
+        ConvertPhase(begin, begin + count * bps, phase.begin() + 1);
+
+        // uint16 subtraction wraps modulo 65536; reinterpreting that as
+        // int16 gives the shortest signed difference
+        for (std::size_t i = 0; i < count; ++i) {
+            out[i] = static_cast<std::int16_t>(static_cast<std::uint16_t>(phase[i + 1] - phase[i]));
+        }
+
+        phase[0] = phase[count];
+        begin += count * bps;
+        out += count;
+        n -= count;
+    }
+
+    *out = 0;
+}
 
 SampleConverter::Pointer SampleConverter::Create(SampleFormat format) {
     switch (format) {
@@ -46,129 +78,72 @@ SampleConverter::Pointer SampleConverter::Create(SampleFormat format) {
     }
 }
 
-CU8Converter::CU8Converter() : SampleConverter(SampleFormat::CU8) {
-
-    cu8_alias u;
+CU8Converter::CU8Converter() : SampleConverter(SampleFormat::CU8) {}
 
-    unsigned i, q;
-    for (i = 0; i < 256; ++i) {
-        double d_i = (i - 127.5) / 128.0;
-        for (q = 0; q < 256; ++q) {
-            double d_q = (q - 127.5) / 128.0;
-            u.iq[0] = i;
-            u.iq[1] = q;
-            lookup_phase_[u.iq16] = scaled_atan2(d_q, d_i);
-            lookup_magsq_[u.iq16] = magsq(d_i, d_q);
-        }
-    }
-}
+CS8Converter::CS8Converter() : SampleConverter(SampleFormat::CS8) {}
 
-void CU8Converter::ConvertPhase(Bytes::const_iterator begin, Bytes::const_iterator end, PhaseBuffer::iterator out) {
-    const cu8_alias *in_iq = reinterpret_cast<const cu8_alias *>(&*begin);
+// Look up each two-byte sample in `begin` .. `end` in `table`, which is
+// indexed by the first byte plus 256 times the second
+static void LookupPairs(const std::uint8_t *begin, const std::uint8_t *end, const std::uint16_t *table, PhaseBuffer::iterator out) {
+    const std::uint8_t *in_iq = begin;
 
     // unroll the loop
     const auto n = std::distance(begin, end) / 2;
     const auto n8 = n / 8;
     const auto n7 = n & 7;
 
-    for (auto i = 0; i < n8; ++i, in_iq += 8) {
-        *out++ = lookup_phase_[in_iq[0].iq16];
-        *out++ = lookup_phase_[in_iq[1].iq16];
-        *out++ = lookup_phase_[in_iq[2].iq16];
-        *out++ = lookup_phase_[in_iq[3].iq16];
-        *out++ = lookup_phase_[in_iq[4].iq16];
-        *out++ = lookup_phase_[in_iq[5].iq16];
-        *out++ = lookup_phase_[in_iq[6].iq16];
-        *out++ = lookup_phase_[in_iq[7].iq16];
+    for (auto i = 0; i < n8; ++i, in_iq += 16) {
+        *out++ = table[in_iq[0] | (in_iq[1] << 8)];
+        *out++ = table[in_iq[2] | (in_iq[3] << 8)];
+        *out++ = table[in_iq[4] | (in_iq[5] << 8)];
+        *out++ = table[in_iq[6] | (in_iq[7] << 8)];
+        *out++ = table[in_iq[8] | (in_iq[9] << 8)];
+        *out++ = table[in_iq[10] | (in_iq[11] << 8)];
+        *out++ = table[in_iq[12] | (in_iq[13] << 8)];
+        *out++ = table[in_iq[14] | (in_iq[15] << 8)];
     }
-    for (auto i = 0; i < n7; ++i, ++in_iq) {
-        *out++ = lookup_phase_[in_iq[0].iq16];
+    for (auto i = 0; i < n7; ++i, in_iq += 2) {
+        *out++ = table[in_iq[0] | (in_iq[1] << 8)];
     }
 }
 
-void CU8Converter::ConvertMagSq(Bytes::const_iterator begin, Bytes::const_iterator end, std::vector<double>::iterator out) {
-    const cu8_alias *in_iq = reinterpret_cast<const cu8_alias *>(&*begin);
+void CU8Converter::ConvertPhase(const std::uint8_t *begin, const std::uint8_t *end, PhaseBuffer::iterator out) {
+    LookupPairs(begin, end, tables::cu8_phase, out);
+}
 
-    // unroll the loop
+// CU8 components are (c - 127.5) / 128, so (2c - 255)^2 / 65536 is their
+// exact square
+void CU8Converter::ConvertMagSq(const std::uint8_t *begin, const std::uint8_t *end, std::vector<double>::iterator out) {
     const auto n = std::distance(begin, end) / 2;
-    const auto n8 = n / 8;
-    const auto n7 = n & 7;
-
-    for (auto i = 0; i < n8; ++i, in_iq += 8) {
-        *out++ = lookup_magsq_[in_iq[0].iq16];
-        *out++ = lookup_magsq_[in_iq[1].iq16];
-        *out++ = lookup_magsq_[in_iq[2].iq16];
-        *out++ = lookup_magsq_[in_iq[3].iq16];
-        *out++ = lookup_magsq_[in_iq[4].iq16];
-        *out++ = lookup_magsq_[in_iq[5].iq16];
-        *out++ = lookup_magsq_[in_iq[6].iq16];
-        *out++ = lookup_magsq_[in_iq[7].iq16];
-    }
-    for (auto i = 0; i < n7; ++i, ++in_iq) {
-        *out++ = lookup_magsq_[in_iq[0].iq16];
+    for (auto i = 0; i < n; ++i, begin += 2) {
+        const int d_i = 2 * begin[0] - 255;
+        const int d_q = 2 * begin[1] - 255;
+        *out++ = (d_i * d_i + d_q * d_q) / 65536.0;
     }
 }
 
-CS8Converter::CS8Converter() : SampleConverter(SampleFormat::CS8) {
-    cs8_alias u;
-
-    int i, q;
-    for (i = -128; i <= 127; ++i) {
-        double d_i = i / 128.0;
-        for (q = -128; q <= 127; ++q) {
-            double d_q = q / 128.0;
-            u.iq[0] = i;
-            u.iq[1] = q;
-            lookup_phase_[u.iq16] = scaled_atan2(d_q, d_i);
-            lookup_magsq_[u.iq16] = magsq(d_i, d_q);
-        }
-    }
+double CU8Converter::MeanPower(const std::uint8_t *begin, const std::uint8_t *end) {
+    const auto n = std::distance(begin, end) / 2;
+    return n ? SumSquares<std::uint8_t, std::uint64_t, 2, 255>(begin, 2 * n) / 65536.0 / n : 0.0;
 }
 
-void CS8Converter::ConvertPhase(Bytes::const_iterator begin, Bytes::const_iterator end, PhaseBuffer::iterator out) {
-    auto in_iq = reinterpret_cast<const cs8_alias *>(&*begin);
+void CS8Converter::ConvertPhase(const std::uint8_t *begin, const std::uint8_t *end, PhaseBuffer::iterator out) {
+    LookupPairs(begin, end, tables::cs8_phase, out);
+}
 
-    // unroll the loop
-    const auto n = std::distance(begin, end) / 2;
-    const auto n8 = n / 8;
-    const auto n7 = n & 7;
+// CS8 components are c / 128
+void CS8Converter::ConvertMagSq(const std::uint8_t *begin, const std::uint8_t *end, std::vector<double>::iterator out) {
+    auto in_iq = reinterpret_cast<const std::int8_t *>(begin);
 
-    for (auto i = 0; i < n8; ++i, in_iq += 8) {
-        *out++ = lookup_phase_[in_iq[0].iq16];
-        *out++ = lookup_phase_[in_iq[1].iq16];
-        *out++ = lookup_phase_[in_iq[2].iq16];
-        *out++ = lookup_phase_[in_iq[3].iq16];
-        *out++ = lookup_phase_[in_iq[4].iq16];
-        *out++ = lookup_phase_[in_iq[5].iq16];
-        *out++ = lookup_phase_[in_iq[6].iq16];
-        *out++ = lookup_phase_[in_iq[7].iq16];
-    }
-    for (auto i = 0; i < n7; ++i, ++in_iq) {
-        *out++ = lookup_phase_[in_iq[0].iq16];
+    const auto n = std::distance(begin, end) / 2;
+    for (auto i = 0; i < n; ++i, in_iq += 2) {
+        *out++ = (in_iq[0] * in_iq[0] + in_iq[1] * in_iq[1]) / 16384.0;
     }
 }
 
-void CS8Converter::ConvertMagSq(Bytes::const_iterator begin, Bytes::const_iterator end, std::vector<double>::iterator out) {
-    auto in_iq = reinterpret_cast<const cs8_alias *>(&*begin);
-
-    // unroll the loop
+double CS8Converter::MeanPower(const std::uint8_t *begin, const std::uint8_t *end) {
     const auto n = std::distance(begin, end) / 2;
-    const auto n8 = n / 8;
-    const auto n7 = n & 7;
-
-    for (auto i = 0; i < n8; ++i, in_iq += 8) {
-        *out++ = lookup_magsq_[in_iq[0].iq16];
-        *out++ = lookup_magsq_[in_iq[1].iq16];
-        *out++ = lookup_magsq_[in_iq[2].iq16];
-        *out++ = lookup_magsq_[in_iq[3].iq16];
-        *out++ = lookup_magsq_[in_iq[4].iq16];
-        *out++ = lookup_magsq_[in_iq[5].iq16];
-        *out++ = lookup_magsq_[in_iq[6].iq16];
-        *out++ = lookup_magsq_[in_iq[7].iq16];
-    }
-    for (auto i = 0; i < n7; ++i, ++in_iq) {
-        *out++ = lookup_magsq_[in_iq[0].iq16];
-    }
+    return n ? SumSquares<std::int8_t, std::uint64_t, 1, 0>(reinterpret_cast<const std::int8_t *>(begin), 2 * n) / 16384.0 / n : 0.0;
 }
 
 static inline std::int16_t PhaseDifference(std::uint16_t from, std::uint16_t to) {
@@ -180,19 +155,13 @@ static inline std::int16_t PhaseDifference(std::uint16_t from, std::uint16_t to)
     else
         return difference;
 }
-CS16HConverter::CS16HConverter() : SampleConverter(SampleFormat::CS16H) {
-    // atan lookup, positive values only, 8-bit fixed point covering 0.0 .. 256.0
-    for (std::size_t i = 0; i < lookup_atan_.size(); ++i) {
-        lookup_atan_[i] = scaled_atan(i / 256.0);
-    }
-}
-
+// atan lookup, positive values only, 8-bit fixed point covering 0.0 .. 256.0
 // caution, expects unsigned (positive) input only
 inline std::uint16_t CS16HConverter::TableAtan(std::uint32_t r) {
-    if (r > lookup_atan_.size())
+    if (r >= 65536)
         return 16384; // pi/2
     else
-        return lookup_atan_[r];
+        return tables::atan_q8[r];
 }
 
 inline std::uint16_t CS16HConverter::TableAtan2(std::int16_t y, std::int16_t x) {
@@ -231,8 +200,13 @@ inline std::uint16_t CS16HConverter::TableAtan2(std::int16_t y, std::int16_t x)
     }
 }
 
-void CS16HConverter::ConvertPhase(Bytes::const_iterator begin, Bytes::const_iterator end, PhaseBuffer::iterator out) {
-    auto in_iq = reinterpret_cast<const std::int16_t *>(&*begin);
+void CS16HConverter::ConvertPhase(const std::uint8_t *begin, const std::uint8_t *end, PhaseBuffer::iterator out) {
+    if (phase_kernel_) {
+        phase_kernel_(begin, std::distance(begin, end) / 4, &*out);
+        return;
+    }
+
+    auto in_iq = reinterpret_cast<const std::int16_t *>(begin);
 
     // unroll the loop
     const auto n = std::distance(begin, end) / 4;
@@ -254,8 +228,8 @@ void CS16HConverter::ConvertPhase(Bytes::const_iterator begin, Bytes::const_iter
     }
 }
 
-void CS16HConverter::ConvertMagSq(Bytes::const_iterator begin, Bytes::const_iterator end, std::vector<double>::iterator out) {
-    auto in_iq = reinterpret_cast<const std::int16_t *>(&*begin);
+void CS16HConverter::ConvertMagSq(const std::uint8_t *begin, const std::uint8_t *end, std::vector<double>::iterator out) {
+    auto in_iq = reinterpret_cast<const std::int16_t *>(begin);
 
     // unroll the loop
     const auto n = std::distance(begin, end) / 4;
@@ -277,8 +251,18 @@ void CS16HConverter::ConvertMagSq(Bytes::const_iterator begin, Bytes::const_iter
     }
 }
 
-void CF32HConverter::ConvertPhase(Bytes::const_iterator begin, Bytes::const_iterator end, PhaseBuffer::iterator out) {
-    auto in_iq = reinterpret_cast<const double *>(&*begin);
+double CS16HConverter::MeanPower(const std::uint8_t *begin, const std::uint8_t *end) {
+    const auto n = std::distance(begin, end) / 4;
+    return n ? SumSquares<std::int16_t, std::uint64_t, 1, 0>(reinterpret_cast<const std::int16_t *>(begin), 2 * n) / 32768.0 / 32768.0 / n : 0.0;
+}
+
+void CF32HConverter::ConvertPhase(const std::uint8_t *begin, const std::uint8_t *end, PhaseBuffer::iterator out) {
+    if (phase_kernel_) {
+        phase_kernel_(begin, std::distance(begin, end) / 8, &*out);
+        return;
+    }
+
+    auto in_iq = reinterpret_cast<const float *>(begin);
 
     // unroll the loop
     const auto n = std::distance(begin, end) / 8;
@@ -300,8 +284,8 @@ void CF32HConverter::ConvertPhase(Bytes::const_iterator begin, Bytes::const_iter
     }
 }
 
-void CF32HConverter::ConvertMagSq(Bytes::const_iterator begin, Bytes::const_iterator end, std::vector<double>::iterator out) {
-    auto in_iq = reinterpret_cast<const double *>(&*begin);
+void CF32HConverter::ConvertMagSq(const std::uint8_t *begin, const std::uint8_t *end, std::vector<double>::iterator out) {
+    auto in_iq = reinterpret_cast<const float *>(begin);
 
     // unroll the loop
     const auto n = std::distance(begin, end) / 8;
@@ -322,3 +306,14 @@ void CF32HConverter::ConvertMagSq(Bytes::const_iterator begin, Bytes::const_iter
         *out++ = magsq(in_iq[1], in_iq[0]);
     }
 }
+
+double CF32HConverter::MeanPower(const std::uint8_t *begin, const std::uint8_t *end) {
+    auto in_iq = reinterpret_cast<const float *>(begin);
+
+    const auto n = std::distance(begin, end) / 8;
+    double total = 0;
+    for (auto i = 0; i < n; ++i, in_iq += 2) {
+        total += magsq(in_iq[1], in_iq[0]);
+    }
+    return n ? total / n : 0.0;
+}
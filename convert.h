@@ -7,7 +7,9 @@
 #ifndef DUMP978_CONVERT_H
 #define DUMP978_CONVERT_H
 
+#include <array>
 #include <memory>
+#include <stdexcept>
 
 #include "common.h"
 
@@ -16,7 +18,7 @@ namespace flightaware::uat {
     //   CU8  - interleaved I/Q data, 8 bit unsigned integers
     //   CS8  - interleaved I/Q data, 8 bit signed integers
     //   CS16H - interleaved I/Q data, 16 bit signed integers, host byte order
-    //   CF32H - interleaved I/Q data, 32 bit signed floats, host byte order
+    //   CF32H - interleaved I/Q data, 32 bit floats, host byte order
     enum class SampleFormat { CU8, CS8, CS16H, CF32H, UNKNOWN };
 
     // Return the number of bytes for 1 sample in the given format
@@ -35,25 +37,54 @@ namespace flightaware::uat {
         }
     }
 
+    // Sum of squares of the `n` integer components at `in`, each mapped to
+    // a signed value by SCALE * c - OFFSET (CU8 uses 2c - 255 to keep its
+    // 127.5 midpoint in integers). Accum must hold the whole sum. Shared by
+    // SampleConverter::MeanPower and Squelch; called with a constant `n`, the
+    // compiler can vectorize it.
+    template <typename T, typename Accum, int SCALE, int OFFSET> inline Accum SumSquares(const T *in, std::size_t n) {
+        Accum sum = 0;
+        for (std::size_t i = 0; i < n; ++i) {
+            const std::int32_t v = SCALE * (std::int32_t)in[i] - OFFSET;
+            sum += (Accum)(std::uint32_t)(v * v);
+        }
+        return sum;
+    }
+
     // Base class for all sample converters.
     // Use SampleConverter::Create to build converters.
     class SampleConverter {
       public:
         typedef std::shared_ptr<SampleConverter> Pointer;
 
-        SampleConverter(SampleFormat format) : format_(format), bytes_per_sample_(flightaware::uat::BytesPerSample(format)) {}
+        SampleConverter(SampleFormat format);
 
         virtual ~SampleConverter() {}
 
         // Read samples from `begin` .. `end` and write one phase value per sample to
         // `out`. The input buffer should contain an integral number of samples
         // (trailing partial samples are ignored, not buffered).
-        virtual void ConvertPhase(Bytes::const_iterator begin, Bytes::const_iterator end, PhaseBuffer::iterator out) = 0;
+        virtual void ConvertPhase(const std::uint8_t *begin, const std::uint8_t *end, PhaseBuffer::iterator out) = 0;
+
+        // Read samples from `begin` .. `end` and write one phase difference per
+        // sample to `out`: out[N] is the phase change from sample N to sample
+        // N+1, wrapped to -32768..32767 (with the same scaling as
+        // ConvertPhase). The final value, which has no following sample, is
+        // set to zero. Phase is converted in small chunks, so no full-size
+        // PhaseBuffer is needed. Not safe to call concurrently on the same
+        // converter, as it reuses an internal scratch buffer.
+        void ConvertPhaseDifference(const std::uint8_t *begin, const std::uint8_t *end, PhaseDiffBuffer::iterator out);
 
         // Read samples from `begin` .. `end` and write one magnitude-squared value
         // per sample to `out`. The input buffer should contain an integral number of
         // samples (trailing partial samples are ignored, not buffered).
-        virtual void ConvertMagSq(Bytes::const_iterator begin, Bytes::const_iterator end, std::vector<double>::iterator out) = 0;
+        virtual void ConvertMagSq(const std::uint8_t *begin, const std::uint8_t *end, std::vector<double>::iterator out) = 0;
+
+        // Return the mean of the magnitude-squared values (as from
+        // ConvertMagSq) of the samples in `begin` .. `end`, or 0 if there are
+        // none. Integer formats are summed exactly, in integer arithmetic,
+        // without converting each sample.
+        virtual double MeanPower(const std::uint8_t *begin, const std::uint8_t *end) = 0;
 
         SampleFormat Format() const { return format_; }
         unsigned BytesPerSample() const { return bytes_per_sample_; }
@@ -61,7 +92,14 @@ namespace flightaware::uat {
         // Return a new SampleConverter that converts from the given format
         static Pointer Create(SampleFormat format);
 
+      protected:
+        // Vectorized ConvertPhase implementation for this CPU, or nullptr if
+        // none is available (see convert_simd.h)
+        typedef void (*PhaseKernel)(const std::uint8_t *in, std::size_t n, std::uint16_t *out);
+        PhaseKernel phase_kernel_;
+
       private:
+        PhaseBuffer phase_scratch_; // used by ConvertPhaseDifference
         SampleFormat format_;
         unsigned bytes_per_sample_;
     };
@@ -70,53 +108,38 @@ namespace flightaware::uat {
       public:
         CU8Converter();
 
-        void ConvertPhase(Bytes::const_iterator begin, Bytes::const_iterator end, PhaseBuffer::iterator out) override;
-        void ConvertMagSq(Bytes::const_iterator begin, Bytes::const_iterator end, std::vector<double>::iterator out) override;
-
-      private:
-        union cu8_alias {
-            std::uint8_t iq[2];
-            std::uint16_t iq16;
-        };
-
-        std::array<std::uint16_t, 65536> lookup_phase_;
-        std::array<double, 65536> lookup_magsq_;
+        void ConvertPhase(const std::uint8_t *begin, const std::uint8_t *end, PhaseBuffer::iterator out) override;
+        void ConvertMagSq(const std::uint8_t *begin, const std::uint8_t *end, std::vector<double>::iterator out) override;
+        double MeanPower(const std::uint8_t *begin, const std::uint8_t *end) override;
     };
 
     class CS8Converter : public SampleConverter {
       public:
         CS8Converter();
 
-        void ConvertPhase(Bytes::const_iterator begin, Bytes::const_iterator end, PhaseBuffer::iterator out) override;
-        void ConvertMagSq(Bytes::const_iterator begin, Bytes::const_iterator end, std::vector<double>::iterator out) override;
-
-      private:
-        union cs8_alias {
-            std::int8_t iq[2];
-            std::uint16_t iq16;
-        };
-
-        std::array<std::uint16_t, 65536> lookup_phase_;
-        std::array<double, 65536> lookup_magsq_;
+        void ConvertPhase(const std::uint8_t *begin, const std::uint8_t *end, PhaseBuffer::iterator out) override;
+        void ConvertMagSq(const std::uint8_t *begin, const std::uint8_t *end, std::vector<double>::iterator out) override;
+        double MeanPower(const std::uint8_t *begin, const std::uint8_t *end) override;
     };
 
     class CS16HConverter : public SampleConverter {
       public:
-        CS16HConverter();
-        void ConvertPhase(Bytes::const_iterator begin, Bytes::const_iterator end, PhaseBuffer::iterator out) override;
-        void ConvertMagSq(Bytes::const_iterator begin, Bytes::const_iterator end, std::vector<double>::iterator out) override;
+        CS16HConverter() : SampleConverter(SampleFormat::CS16H) {}
+        void ConvertPhase(const std::uint8_t *begin, const std::uint8_t *end, PhaseBuffer::iterator out) override;
+        void ConvertMagSq(const std::uint8_t *begin, const std::uint8_t *end, std::vector<double>::iterator out) override;
+        double MeanPower(const std::uint8_t *begin, const std::uint8_t *end) override;
 
       private:
         std::uint16_t TableAtan(std::uint32_t r);
         std::uint16_t TableAtan2(std::int16_t y, std::int16_t x);
-        std::array<std::uint16_t, 65536> lookup_atan_;
     };
 
     class CF32HConverter : public SampleConverter {
       public:
         CF32HConverter() : SampleConverter(SampleFormat::CF32H) {}
-        void ConvertPhase(Bytes::const_iterator begin, Bytes::const_iterator end, PhaseBuffer::iterator out) override;
-        void ConvertMagSq(Bytes::const_iterator begin, Bytes::const_iterator end, std::vector<double>::iterator out) override;
+        void ConvertPhase(const std::uint8_t *begin, const std::uint8_t *end, PhaseBuffer::iterator out) override;
+        void ConvertMagSq(const std::uint8_t *begin, const std::uint8_t *end, std::vector<double>::iterator out) override;
+        double MeanPower(const std::uint8_t *begin, const std::uint8_t *end) override;
     };
 }; // namespace flightaware::uat
 
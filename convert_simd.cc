@@ -0,0 +1,331 @@
+// Copyright (c) 2019, FlightAware LLC.
+// All rights reserved.
+// Licensed under the 2-clause BSD license; see the LICENSE file
+
+#include "convert_simd.h"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SIMD_X86
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define SIMD_NEON
+#include <arm_neon.h>
+#endif
+
+using namespace flightaware::uat;
+using namespace flightaware::uat::simd;
+
+// atan(a) for 0 <= a <= 1 is approximated by the polynomial
+//   a * (C1 + C3*a^2 + C5*a^4 + C7*a^6 + C9*a^8)
+// with |error| <= 1e-5 radians (Abramowitz & Stegun 4.4.49), well inside
+// the 9.6e-5 radian resolution of our 16-bit phase values. The coefficients
+// are prescaled so that the result is directly in phase units.
+static const float PHASE_UNITS = 32768 / M_PI;
+static const float ATAN_C1 = 0.9998660 * PHASE_UNITS;
+static const float ATAN_C3 = -0.3302995 * PHASE_UNITS;
+static const float ATAN_C5 = 0.1801410 * PHASE_UNITS;
+static const float ATAN_C7 = -0.0851330 * PHASE_UNITS;
+static const float ATAN_C9 = 0.0208351 * PHASE_UNITS;
+
+// Scalar version of the vectorized atan2, used for leftover samples so that
+// all samples in a buffer are converted the same way.
+static inline std::uint16_t PolyAtan2(float y, float x) {
+    const float ax = std::fabs(x), ay = std::fabs(y);
+    const float mx = std::max(ax, ay), mn = std::min(ax, ay);
+    const float a = (mx > 0 ? mn / mx : 0.0f);
+    const float s = a * a;
+
+    float p = a * ((((ATAN_C9 * s + ATAN_C7) * s + ATAN_C5) * s + ATAN_C3) * s + ATAN_C1);
+    if (ay > ax)
+        p = 16384 - p;
+    if (x < 0)
+        p = 32768 - p;
+    if (y < 0)
+        p = 65536 - p;
+
+    return (std::uint16_t)((std::int32_t)std::lrint(p) & 0xFFFF);
+}
+
+static inline void ScalarTail(SampleFormat format, const std::uint8_t *in, std::size_t n, std::uint16_t *out) {
+    switch (format) {
+    case SampleFormat::CS16H: {
+        auto in_iq = reinterpret_cast<const std::int16_t *>(in);
+        for (std::size_t i = 0; i < n; ++i, in_iq += 2)
+            *out++ = PolyAtan2(in_iq[1], in_iq[0]);
+        break;
+    }
+    case SampleFormat::CF32H: {
+        auto in_iq = reinterpret_cast<const float *>(in);
+        for (std::size_t i = 0; i < n; ++i, in_iq += 2)
+            *out++ = PolyAtan2(in_iq[1], in_iq[0]);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+#ifdef SIMD_X86
+
+//
+// SSE4.1, 4 samples at a time
+//
+
+__attribute__((target("sse4.1"))) static inline __m128i Atan2SSE(__m128 y, __m128 x) {
+    const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+    const __m128 zero = _mm_setzero_ps();
+
+    const __m128 ax = _mm_and_ps(x, abs_mask);
+    const __m128 ay = _mm_and_ps(y, abs_mask);
+    const __m128 mx = _mm_max_ps(ax, ay);
+    const __m128 mn = _mm_min_ps(ax, ay);
+    // reciprocal estimate plus one Newton-Raphson step is good to ~22 bits
+    // and much cheaper than a divide
+    const __m128 r0 = _mm_rcp_ps(mx);
+    const __m128 r1 = _mm_sub_ps(_mm_add_ps(r0, r0), _mm_mul_ps(mx, _mm_mul_ps(r0, r0)));
+    const __m128 a = _mm_and_ps(_mm_min_ps(_mm_mul_ps(mn, r1), _mm_set1_ps(1.0f)), _mm_cmpgt_ps(mx, zero)); // 0/0 -> 0
+    const __m128 s = _mm_mul_ps(a, a);
+
+    __m128 p = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(ATAN_C9), s), _mm_set1_ps(ATAN_C7));
+    p = _mm_add_ps(_mm_mul_ps(p, s), _mm_set1_ps(ATAN_C5));
+    p = _mm_add_ps(_mm_mul_ps(p, s), _mm_set1_ps(ATAN_C3));
+    p = _mm_add_ps(_mm_mul_ps(p, s), _mm_set1_ps(ATAN_C1));
+    p = _mm_mul_ps(p, a);
+
+    p = _mm_blendv_ps(p, _mm_sub_ps(_mm_set1_ps(16384), p), _mm_cmpgt_ps(ay, ax));
+    p = _mm_blendv_ps(p, _mm_sub_ps(_mm_set1_ps(32768), p), _mm_cmplt_ps(x, zero));
+    p = _mm_blendv_ps(p, _mm_sub_ps(_mm_set1_ps(65536), p), _mm_cmplt_ps(y, zero));
+
+    return _mm_and_si128(_mm_cvtps_epi32(p), _mm_set1_epi32(0xFFFF));
+}
+
+// Split 8 interleaved 16-bit I/Q values into 4 I and 4 Q float values
+__attribute__((target("sse4.1"))) static inline void SplitIQ16SSE(__m128i iq, __m128 &i, __m128 &q) {
+    i = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_slli_epi32(iq, 16), 16));
+    q = _mm_cvtepi32_ps(_mm_srai_epi32(iq, 16));
+}
+
+__attribute__((target("sse4.1"))) static void PhaseCS16HSSE(const std::uint8_t *in, std::size_t n, std::uint16_t *out) {
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8, in += 32, out += 8) {
+        __m128 i0, q0, i1, q1;
+        SplitIQ16SSE(_mm_loadu_si128(reinterpret_cast<const __m128i *>(in)), i0, q0);
+        SplitIQ16SSE(_mm_loadu_si128(reinterpret_cast<const __m128i *>(in + 16)), i1, q1);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out), _mm_packus_epi32(Atan2SSE(q0, i0), Atan2SSE(q1, i1)));
+    }
+    ScalarTail(SampleFormat::CS16H, in, n - i, out);
+}
+
+__attribute__((target("sse4.1"))) static void PhaseCF32HSSE(const std::uint8_t *in, std::size_t n, std::uint16_t *out) {
+    auto in_f = reinterpret_cast<const float *>(in);
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8, in_f += 16, out += 8) {
+        const __m128 a = _mm_loadu_ps(in_f), b = _mm_loadu_ps(in_f + 4);
+        const __m128 c = _mm_loadu_ps(in_f + 8), d = _mm_loadu_ps(in_f + 12);
+        auto p0 = Atan2SSE(_mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)), _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+        auto p1 = Atan2SSE(_mm_shuffle_ps(c, d, _MM_SHUFFLE(3, 1, 3, 1)), _mm_shuffle_ps(c, d, _MM_SHUFFLE(2, 0, 2, 0)));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out), _mm_packus_epi32(p0, p1));
+    }
+    ScalarTail(SampleFormat::CF32H, reinterpret_cast<const std::uint8_t *>(in_f), n - i, out);
+}
+
+//
+// AVX2, 8 samples at a time
+//
+
+__attribute__((target("avx2"))) static inline __m128i Atan2AVX2(__m256 y, __m256 x) {
+    const __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF));
+    const __m256 zero = _mm256_setzero_ps();
+
+    const __m256 ax = _mm256_and_ps(x, abs_mask);
+    const __m256 ay = _mm256_and_ps(y, abs_mask);
+    const __m256 mx = _mm256_max_ps(ax, ay);
+    const __m256 mn = _mm256_min_ps(ax, ay);
+    // reciprocal estimate plus one Newton-Raphson step is good to ~22 bits
+    // and much cheaper than a divide
+    const __m256 r0 = _mm256_rcp_ps(mx);
+    const __m256 r1 = _mm256_sub_ps(_mm256_add_ps(r0, r0), _mm256_mul_ps(mx, _mm256_mul_ps(r0, r0)));
+    const __m256 a = _mm256_and_ps(_mm256_min_ps(_mm256_mul_ps(mn, r1), _mm256_set1_ps(1.0f)), _mm256_cmp_ps(mx, zero, _CMP_GT_OQ)); // 0/0 -> 0
+    const __m256 s = _mm256_mul_ps(a, a);
+
+    __m256 p = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(ATAN_C9), s), _mm256_set1_ps(ATAN_C7));
+    p = _mm256_add_ps(_mm256_mul_ps(p, s), _mm256_set1_ps(ATAN_C5));
+    p = _mm256_add_ps(_mm256_mul_ps(p, s), _mm256_set1_ps(ATAN_C3));
+    p = _mm256_add_ps(_mm256_mul_ps(p, s), _mm256_set1_ps(ATAN_C1));
+    p = _mm256_mul_ps(p, a);
+
+    p = _mm256_blendv_ps(p, _mm256_sub_ps(_mm256_set1_ps(16384), p), _mm256_cmp_ps(ay, ax, _CMP_GT_OQ));
+    p = _mm256_blendv_ps(p, _mm256_sub_ps(_mm256_set1_ps(32768), p), _mm256_cmp_ps(x, zero, _CMP_LT_OQ));
+    p = _mm256_blendv_ps(p, _mm256_sub_ps(_mm256_set1_ps(65536), p), _mm256_cmp_ps(y, zero, _CMP_LT_OQ));
+
+    const __m256i r = _mm256_and_si256(_mm256_cvtps_epi32(p), _mm256_set1_epi32(0xFFFF));
+    return _mm_packus_epi32(_mm256_castsi256_si128(r), _mm256_extracti128_si256(r, 1));
+}
+
+// Split 16 interleaved 16-bit I/Q values into 8 I and 8 Q float values
+__attribute__((target("avx2"))) static inline void SplitIQ16AVX2(__m256i iq, __m256 &i, __m256 &q) {
+    i = _mm256_cvtepi32_ps(_mm256_srai_epi32(_mm256_slli_epi32(iq, 16), 16));
+    q = _mm256_cvtepi32_ps(_mm256_srai_epi32(iq, 16));
+}
+
+__attribute__((target("avx2"))) static void PhaseCS16HAVX2(const std::uint8_t *in, std::size_t n, std::uint16_t *out) {
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8, in += 32, out += 8) {
+        __m256 i0, q0;
+        SplitIQ16AVX2(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(in)), i0, q0);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out), Atan2AVX2(q0, i0));
+    }
+    ScalarTail(SampleFormat::CS16H, in, n - i, out);
+}
+
+__attribute__((target("avx2"))) static void PhaseCF32HAVX2(const std::uint8_t *in, std::size_t n, std::uint16_t *out) {
+    auto in_f = reinterpret_cast<const float *>(in);
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8, in_f += 16, out += 8) {
+        const __m256 a = _mm256_loadu_ps(in_f), b = _mm256_loadu_ps(in_f + 8);
+        // shuffle_ps works within 128-bit lanes, leaving the samples in the
+        // order 0 1 4 5 2 3 6 7; permute the 64-bit pairs back into order
+        const __m256 i0 = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(_mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0))), _MM_SHUFFLE(3, 1, 2, 0)));
+        const __m256 q0 = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(_mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1))), _MM_SHUFFLE(3, 1, 2, 0)));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out), Atan2AVX2(q0, i0));
+    }
+    ScalarTail(SampleFormat::CF32H, reinterpret_cast<const std::uint8_t *>(in_f), n - i, out);
+}
+
+#endif // SIMD_X86
+
+#ifdef SIMD_NEON
+
+//
+// NEON, 8 samples at a time (as two 4-lane halves)
+//
+
+static inline uint16x4_t Atan2NEON(float32x4_t y, float32x4_t x) {
+    const float32x4_t zero = vdupq_n_f32(0);
+
+    const float32x4_t ax = vabsq_f32(x);
+    const float32x4_t ay = vabsq_f32(y);
+    const float32x4_t mx = vmaxq_f32(vmaxq_f32(ax, ay), vdupq_n_f32(1e-30f)); // 0/0 -> 0
+    const float32x4_t mn = vminq_f32(ax, ay);
+
+    // no vector divide on ARMv7; reciprocal estimate plus two Newton-Raphson steps
+    float32x4_t inv = vrecpeq_f32(mx);
+    inv = vmulq_f32(vrecpsq_f32(mx, inv), inv);
+    inv = vmulq_f32(vrecpsq_f32(mx, inv), inv);
+    const float32x4_t a = vminq_f32(vmulq_f32(mn, inv), vdupq_n_f32(1.0f));
+    const float32x4_t s = vmulq_f32(a, a);
+
+    float32x4_t p = vmlaq_f32(vdupq_n_f32(ATAN_C7), vdupq_n_f32(ATAN_C9), s);
+    p = vmlaq_f32(vdupq_n_f32(ATAN_C5), p, s);
+    p = vmlaq_f32(vdupq_n_f32(ATAN_C3), p, s);
+    p = vmlaq_f32(vdupq_n_f32(ATAN_C1), p, s);
+    p = vmulq_f32(p, a);
+
+    p = vbslq_f32(vcgtq_f32(ay, ax), vsubq_f32(vdupq_n_f32(16384), p), p);
+    p = vbslq_f32(vcltq_f32(x, zero), vsubq_f32(vdupq_n_f32(32768), p), p);
+    p = vbslq_f32(vcltq_f32(y, zero), vsubq_f32(vdupq_n_f32(65536), p), p);
+
+    // p is non-negative here, so adding 0.5 and truncating rounds to nearest
+    return vmovn_u32(vandq_u32(vcvtq_u32_f32(vaddq_f32(p, vdupq_n_f32(0.5f))), vdupq_n_u32(0xFFFF)));
+}
+
+static inline void StoreNEON(std::uint16_t *out, int16x8_t i, int16x8_t q) {
+    const float32x4_t i0 = vcvtq_f32_s32(vmovl_s16(vget_low_s16(i)));
+    const float32x4_t q0 = vcvtq_f32_s32(vmovl_s16(vget_low_s16(q)));
+    const float32x4_t i1 = vcvtq_f32_s32(vmovl_s16(vget_high_s16(i)));
+    const float32x4_t q1 = vcvtq_f32_s32(vmovl_s16(vget_high_s16(q)));
+    vst1q_u16(out, vcombine_u16(Atan2NEON(q0, i0), Atan2NEON(q1, i1)));
+}
+
+static void PhaseCS16HNEON(const std::uint8_t *in, std::size_t n, std::uint16_t *out) {
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8, in += 32, out += 8) {
+        const int16x8x2_t iq = vld2q_s16(reinterpret_cast<const std::int16_t *>(in));
+        StoreNEON(out, iq.val[0], iq.val[1]);
+    }
+    ScalarTail(SampleFormat::CS16H, in, n - i, out);
+}
+
+static void PhaseCF32HNEON(const std::uint8_t *in, std::size_t n, std::uint16_t *out) {
+    auto in_f = reinterpret_cast<const float *>(in);
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8, in_f += 16, out += 8) {
+        const float32x4x2_t iq0 = vld2q_f32(in_f);
+        const float32x4x2_t iq1 = vld2q_f32(in_f + 8);
+        vst1q_u16(out, vcombine_u16(Atan2NEON(iq0.val[1], iq0.val[0]), Atan2NEON(iq1.val[1], iq1.val[0])));
+    }
+    ScalarTail(SampleFormat::CF32H, reinterpret_cast<const std::uint8_t *>(in_f), n - i, out);
+}
+
+#endif // SIMD_NEON
+
+//
+// Runtime selection
+//
+
+enum class InstructionSet { NONE, SSE41, AVX2, NEON };
+
+static InstructionSet DetectInstructionSet() {
+#if defined(SIMD_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return InstructionSet::AVX2;
+    if (__builtin_cpu_supports("sse4.1"))
+        return InstructionSet::SSE41;
+    return InstructionSet::NONE;
+#elif defined(SIMD_NEON)
+    // NEON availability is fixed at compile time
+    return InstructionSet::NEON;
+#else
+    return InstructionSet::NONE;
+#endif
+}
+
+static InstructionSet BestInstructionSet() {
+    static const InstructionSet best = DetectInstructionSet();
+    return best;
+}
+
+PhaseKernel flightaware::uat::simd::SelectPhaseKernel(SampleFormat format) {
+    switch (BestInstructionSet()) {
+#ifdef SIMD_X86
+    case InstructionSet::AVX2:
+        switch (format) {
+        case SampleFormat::CS16H:
+            return PhaseCS16HAVX2;
+        case SampleFormat::CF32H:
+            return PhaseCF32HAVX2;
+        default:
+            return nullptr;
+        }
+
+    case InstructionSet::SSE41:
+        switch (format) {
+        case SampleFormat::CS16H:
+            return PhaseCS16HSSE;
+        case SampleFormat::CF32H:
+            return PhaseCF32HSSE;
+        default:
+            return nullptr;
+        }
+#endif
+
+#ifdef SIMD_NEON
+    case InstructionSet::NEON:
+        switch (format) {
+        case SampleFormat::CS16H:
+            return PhaseCS16HNEON;
+        case SampleFormat::CF32H:
+            return PhaseCF32HNEON;
+        default:
+            return nullptr;
+        }
+#endif
+
+    default:
+        return nullptr;
+    }
+}
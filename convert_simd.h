@@ -0,0 +1,28 @@
+// -*- c++ -*-
+
+// Copyright (c) 2019, FlightAware LLC.
+// All rights reserved.
+// Licensed under the 2-clause BSD license; see the LICENSE file
+
+#ifndef DUMP978_CONVERT_SIMD_H
+#define DUMP978_CONVERT_SIMD_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "convert.h"
+
+namespace flightaware::uat::simd {
+    // A vectorized phase conversion kernel: converts `n` samples starting at
+    // `in` to `n` phase values written to `out`, with the same scaling as
+    // SampleConverter::ConvertPhase. Phase is computed with a polynomial
+    // atan2 approximation that is accurate to about 1 unit (2*pi/65536).
+    typedef void (*PhaseKernel)(const std::uint8_t *in, std::size_t n, std::uint16_t *out);
+
+    // Return the best phase kernel for `format` that the current CPU
+    // supports, or nullptr if there is none (use the scalar converter).
+    // CU8 and CS8 never get a kernel: their exact lookup tables are faster.
+    PhaseKernel SelectPhaseKernel(SampleFormat format);
+}; // namespace flightaware::uat::simd
+
+#endif
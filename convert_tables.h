@@ -0,0 +1,26 @@
+// -*- c++ -*-
+
+// Copyright (c) 2019, FlightAware LLC.
+// All rights reserved.
+// Licensed under the 2-clause BSD license; see the LICENSE file
+
+#ifndef DUMP978_CONVERT_TABLES_H
+#define DUMP978_CONVERT_TABLES_H
+
+#include <cstdint>
+
+// Lookup tables for the sample converters. These are computed at build time
+// by convert_tables_gen (see the Makefile) and compiled in as read-only
+// data, so they cost nothing at startup and are shared between processes
+// through the page cache.
+namespace flightaware::uat::tables {
+    // Phase of a CU8 / CS8 sample, scaled so that 65536 is 2*pi, indexed
+    // by I + 256 * Q (the raw bytes of I and Q, in that order)
+    extern const std::uint16_t cu8_phase[65536];
+    extern const std::uint16_t cs8_phase[65536];
+
+    // atan(N / 256) for N = 0 .. 65535, with the same scaling
+    extern const std::uint16_t atan_q8[65536];
+}; // namespace flightaware::uat::tables
+
+#endif
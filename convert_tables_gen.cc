@@ -0,0 +1,64 @@
+// Copyright (c) 2019, FlightAware LLC.
+// All rights reserved.
+// Licensed under the 2-clause BSD license; see the LICENSE file
+
+// Writes the source for the lookup tables declared in convert_tables.h to
+// stdout. This runs on the build host as part of the build.
+
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+// must match scaled_atan2 in convert.cc, which CF32H uses at runtime
+static std::uint16_t scaled_atan2(double y, double x) {
+    double ang = std::atan2(y, x);
+    if (ang < 0) {
+        // atan2 returns [-pi..pi], normalize to [0..2*pi]
+        ang += 2 * M_PI;
+    }
+    double scaled_ang = std::round(32768 * ang / M_PI);
+    return scaled_ang < 0 ? 0 : scaled_ang > 65535 ? 65535 : (std::uint16_t)scaled_ang;
+}
+
+static std::uint16_t scaled_atan(double x) {
+    double ang = std::atan(x);
+    if (ang < 0) {
+        // atan returns [-pi/2..pi/2], normalize to [0..2*pi]
+        ang += 2 * M_PI;
+    }
+    double scaled_ang = std::round(32768 * ang / M_PI);
+    return scaled_ang < 0 ? 0 : scaled_ang > 65535 ? 65535 : (std::uint16_t)scaled_ang;
+}
+
+static void WriteTable(const char *name, const std::vector<std::uint16_t> &table) {
+    std::cout << "const std::uint16_t flightaware::uat::tables::" << name << "[" << table.size() << "] = {";
+    for (std::size_t i = 0; i < table.size(); ++i) {
+        std::cout << (i % 16 ? " " : "\n    ") << table[i] << ",";
+    }
+    std::cout << "\n};\n\n";
+}
+
+int main() {
+    std::vector<std::uint16_t> cu8_phase(65536), cs8_phase(65536), atan_q8(65536);
+
+    for (unsigned i = 0; i < 256; ++i) {
+        for (unsigned q = 0; q < 256; ++q) {
+            // CU8 is offset binary, CS8 is two's complement
+            cu8_phase[i + 256 * q] = scaled_atan2((q - 127.5) / 128.0, (i - 127.5) / 128.0);
+            cs8_phase[i + 256 * q] = scaled_atan2((std::int8_t)q / 128.0, (std::int8_t)i / 128.0);
+        }
+    }
+
+    for (unsigned n = 0; n < atan_q8.size(); ++n) {
+        atan_q8[n] = scaled_atan(n / 256.0);
+    }
+
+    std::cout << "// Generated by convert_tables_gen, do not edit\n\n";
+    std::cout << "#include \"convert_tables.h\"\n\n";
+    WriteTable("cu8_phase", cu8_phase);
+    WriteTable("cs8_phase", cs8_phase);
+    WriteTable("atan_q8", atan_q8);
+
+    return std::cout.good() ? 0 : 1;
+}
@@ -4,90 +4,376 @@
 // Licensed under the 2-clause BSD license; see the LICENSE file
 
 #include "demodulator.h"
+#include "stats.h"
+
+#ifdef CHECK_ALLOCATIONS
+#include "alloc_counter.h"
+#endif
 
 #include <assert.h>
+#include <algorithm>
 #include <iomanip>
 #include <iostream>
+#include <iterator>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 using namespace flightaware::uat;
 
-SingleThreadReceiver::SingleThreadReceiver(SampleFormat format) : converter_(SampleConverter::Create(format)), demodulator_(new TwoMegDemodulator()) {}
+SingleThreadReceiver::SingleThreadReceiver(SampleFormat format, unsigned demod_threads, Squelch::Pointer squelch) : converter_(SampleConverter::Create(format)), squelch_(std::move(squelch)) {
+    if (demod_threads > 1) {
+        demodulator_.reset(new ParallelDemodulator(demod_threads));
+    } else {
+        demodulator_.reset(new TwoMegDemodulator());
+    }
+}
+
+// Convert a demodulated message to a RawMessage and append it to `out`.
+// `samples` is the start of the sample data that the phase difference buffer
+// `dphi` was converted from; `timestamp` is the time of the first sample following the
+// `previous_samples` samples carried over from the previous block.
+static void AppendMessage(MessageVector &out, Demodulator::Message &&message, SampleConverter &converter, const std::uint8_t *samples, const PhaseDiffBuffer &dphi, std::uint64_t timestamp, std::size_t previous_samples) {
+    auto begin_sample = samples + std::distance(dphi.cbegin(), message.begin) * converter.BytesPerSample();
+    auto end_sample = samples + std::distance(dphi.cbegin(), message.end) * converter.BytesPerSample();
+    const RawMessage::SignalPower power{converter.MeanPower(begin_sample, end_sample)};
+
+    std::uint64_t message_timestamp = timestamp - (1000 * previous_samples / 2083333) + (1000 * std::distance(dphi.cbegin(), message.begin) / 2083333);
+
+    out.emplace_back(std::move(message.payload), message_timestamp, message.corrected_errors, power);
+
+    auto &stats = Stats::Global();
+    if (out.back().Type() == MessageType::UPLINK) {
+        ++stats.uplink_decoded;
+        stats.uplink_corrected.Add(message.corrected_errors);
+    } else {
+        ++stats.downlink_decoded;
+        stats.downlink_corrected.Add(message.corrected_errors);
+    }
+}
+
+// Find the spans of `begin` .. `end` to demodulate: all of it without a
+// squelch, otherwise whatever the squelch passes. Samples left out are
+// counted in Stats::squelched_samples.
+static void FindSpans(Squelch *squelch, const std::uint8_t *begin, const std::uint8_t *end, std::size_t bytes_per_sample, std::size_t margin, std::vector<Squelch::Span> &spans) {
+    const std::size_t total_samples = std::distance(begin, end) / bytes_per_sample;
+    if (!squelch) {
+        spans.clear();
+        spans.push_back({0, total_samples});
+        return;
+    }
+
+    squelch->FindActive(begin, end, margin, spans);
+
+    std::size_t active_samples = 0;
+    for (const auto &span : spans) {
+        active_samples += span.end - span.begin;
+    }
+    Stats::Global().squelched_samples += total_samples - active_samples;
+}
 
 // Handle samples in 'buffer' by:
-//   converting them to a phase buffer
-//   demodulating the phase buffer
+//   prefixing them with the tail of the previous buffer
+//   finding the spans that the squelch (if any) passes
+//   converting those spans to a phase difference buffer
+//   demodulating the phase difference buffer
 //   dispatching any demodulated messages
-//   preserving the end of the phase buffer for reuse in the next call
-void SingleThreadReceiver::HandleSamples(std::uint64_t timestamp, Bytes::const_iterator begin, Bytes::const_iterator end) {
+//   preserving the end of the sample buffer for reuse in the next call
+void SingleThreadReceiver::HandleSamples(std::uint64_t timestamp, SampleBuffer::Pointer buffer) {
     assert(converter_);
 
-    const auto buffer_bytes = std::distance(begin, end);
-    const auto buffer_samples = buffer_bytes / converter_->BytesPerSample();
+    const auto bytes_per_sample = converter_->BytesPerSample();
+    const auto previous_samples = tail_.size() / bytes_per_sample;
 
-    const auto previous_samples = saved_samples_;
-    const auto previous_bytes = previous_samples * converter_->BytesPerSample();
+    buffer->Prepend(tail_.data(), tail_.data() + tail_.size());
+    const std::size_t total_samples = std::distance(buffer->begin(), buffer->end()) / bytes_per_sample;
+    const auto samples_begin = buffer->begin();
+    const auto samples_end = samples_begin + total_samples * bytes_per_sample;
 
-    const auto total_samples = buffer_samples + previous_samples;
-    const auto total_bytes = total_samples * converter_->BytesPerSample();
+#ifdef CHECK_ALLOCATIONS
+    // Once the buffers have grown to size, a block that yields no messages
+    // should be handled without touching the heap
+    const bool steady_state = (previous_samples == TrailingSamples() && dphi_.size() >= total_samples);
+    const auto allocations_before = ThreadAllocationCount();
+#endif
 
-    if (samples_.size() < total_bytes) {
-        samples_.resize(total_bytes);
+    if (dphi_.size() < total_samples) {
+        dphi_.resize(total_samples);
     }
 
-    // TODO: rearrange things to avoid this copy
-    std::copy(begin, end, samples_.begin() + previous_bytes);
+    // Spans are converted at their own offsets in dphi_, so that message
+    // positions still map directly back to samples; dphi_ outside the spans
+    // is stale and never looked at.
+    {
+        ScopedTimer timer(Stats::Global().convert_us);
+        FindSpans(squelch_.get(), samples_begin, samples_end, bytes_per_sample, TrailingSamples(), spans_);
+        for (const auto &span : spans_) {
+            converter_->ConvertPhaseDifference(samples_begin + span.begin * bytes_per_sample, samples_begin + span.end * bytes_per_sample, dphi_.begin() + span.begin);
+        }
+    }
 
-    if (phase_.size() < total_samples) {
-        phase_.resize(total_samples);
+    std::vector<Demodulator::Message> messages;
+    {
+        ScopedTimer timer(Stats::Global().demod_us);
+        for (const auto &span : spans_) {
+            auto found = demodulator_->Demodulate(dphi_.begin() + span.begin, dphi_.begin() + span.end);
+            if (messages.empty()) {
+                messages = std::move(found);
+            } else {
+                std::move(found.begin(), found.end(), std::back_inserter(messages));
+            }
+        }
     }
 
-    converter_->ConvertPhase(samples_.begin(), samples_.begin() + total_bytes, phase_.begin());
-    auto messages = demodulator_->Demodulate(phase_.begin(), phase_.begin() + total_samples);
+    // preserve the tail of the sample buffer for next time
+    const auto tail_samples = std::min<std::size_t>(total_samples, TrailingSamples());
+    tail_.assign(samples_end - tail_samples * bytes_per_sample, samples_end);
+
+#ifdef CHECK_ALLOCATIONS
+    assert(!steady_state || !messages.empty() || ThreadAllocationCount() == allocations_before);
+#endif
 
     if (!messages.empty()) {
         SharedMessageVector dispatch = std::make_shared<MessageVector>();
         dispatch->reserve(messages.size());
         for (auto &message : messages) {
-            std::vector<double> magsq;
-            magsq.resize(std::distance(message.begin, message.end));
+            AppendMessage(*dispatch, std::move(message), *converter_, samples_begin, dphi_, timestamp, previous_samples);
+        }
+
+        DispatchMessages(dispatch);
+    }
+}
+
+//
+// PipelinedReceiver
+//
+
+// One block of samples as it moves through the pipeline
+struct PipelinedReceiver::Block {
+    std::uint64_t sequence;
+    std::uint64_t timestamp;
+    std::size_t previous_samples; // number of samples carried over from the previous block
+    SampleBuffer::Pointer buffer;
+    const std::uint8_t *samples_begin; // whole samples in `buffer`, including the previous block's tail
+    const std::uint8_t *samples_end;
+    std::vector<Squelch::Span> spans;
+    PhaseDiffBuffer dphi; // valid only within spans
+    std::vector<TwoMegDemodulator::SyncCandidate> candidates;
+    std::chrono::steady_clock::duration demod_time; // sync search plus FEC, for Stats::demod_us
+};
+
+PipelinedReceiver::PipelinedReceiver(SampleFormat format, unsigned fec_threads, Squelch::Pointer squelch, std::size_t queue_depth) : converter_(SampleConverter::Create(format)), squelch_(std::move(squelch)), trailing_samples_(TwoMegDemodulator().NumTrailingSamples()), free_blocks_(3 * queue_depth + 3 + std::max(1U, fec_threads)), convert_queue_(queue_depth), sync_queue_(queue_depth), fec_queue_(queue_depth) {
+    // free_blocks_ holds one block for each queue slot, one for
+    // HandleSamples, and one for each stage thread
+    while (free_blocks_.TryPush(std::make_shared<Block>()))
+        ;
+
+    threads_.emplace_back(&PipelinedReceiver::ConvertThread, this);
+    threads_.emplace_back(&PipelinedReceiver::SyncThread, this);
+    for (unsigned i = 0; i < std::max(1U, fec_threads); ++i) {
+        threads_.emplace_back(&PipelinedReceiver::FECThread, this);
+    }
+}
+
+PipelinedReceiver::~PipelinedReceiver() { Stop(); }
+
+void PipelinedReceiver::Stop() {
+    if (stopped_)
+        return;
+    stopped_ = true;
+
+    // Each stage closes the next queue once its input is drained, so this
+    // lets all queued blocks run to completion before the threads exit
+    convert_queue_.Close();
+    for (auto &t : threads_) {
+        t.join();
+    }
+    threads_.clear();
+}
+
+// Prefix the new samples with the saved tail of the previous block, in place,
+// and queue them for conversion. This blocks if the pipeline is full.
+void PipelinedReceiver::HandleSamples(std::uint64_t timestamp, SampleBuffer::Pointer buffer) {
+    const auto bytes_per_sample = converter_->BytesPerSample();
 
-            auto begin_sample = samples_.begin() + std::distance(phase_.cbegin(), message.begin) * converter_->BytesPerSample();
-            auto end_sample = samples_.begin() + std::distance(phase_.cbegin(), message.end) * converter_->BytesPerSample();
+    BlockPointer block;
+    free_blocks_.Pop(block);
+    block->sequence = next_sequence_++;
+    block->timestamp = timestamp;
+    block->previous_samples = tail_.size() / bytes_per_sample;
 
-            converter_->ConvertMagSq(begin_sample, end_sample, magsq.begin());
+    buffer->Prepend(tail_.data(), tail_.data() + tail_.size());
+    const std::size_t total_samples = std::distance(buffer->begin(), buffer->end()) / bytes_per_sample;
+    block->samples_begin = buffer->begin();
+    block->samples_end = block->samples_begin + total_samples * bytes_per_sample;
+    block->buffer = std::move(buffer);
 
-            auto total_power = 0.0;
-            for (auto m : magsq) {
-                total_power += m;
+    // preserve the tail of the sample buffer for next time
+    const auto tail_bytes = std::min<std::size_t>(total_samples, trailing_samples_) * bytes_per_sample;
+    tail_.assign(block->samples_end - tail_bytes, block->samples_end);
+
+    convert_queue_.Push(std::move(block));
+    Stats::Global().convert_queue.Set(convert_queue_.Size());
+}
+
+void PipelinedReceiver::ConvertThread() {
+    BlockPointer block;
+    while (convert_queue_.Pop(block)) {
+        {
+            ScopedTimer timer(Stats::Global().convert_us);
+            const auto bytes_per_sample = converter_->BytesPerSample();
+            const std::size_t total_samples = std::distance(block->samples_begin, block->samples_end) / bytes_per_sample;
+            if (block->dphi.size() < total_samples) {
+                block->dphi.resize(total_samples);
+            }
+            FindSpans(squelch_.get(), block->samples_begin, block->samples_end, bytes_per_sample, trailing_samples_, block->spans);
+            for (const auto &span : block->spans) {
+                converter_->ConvertPhaseDifference(block->samples_begin + span.begin * bytes_per_sample, block->samples_begin + span.end * bytes_per_sample, block->dphi.begin() + span.begin);
             }
+        }
+        sync_queue_.Push(std::move(block));
+        Stats::Global().sync_queue.Set(sync_queue_.Size());
+    }
 
-            auto rssi = (total_power == 0 ? -1000 : 10 * std::log10(total_power / magsq.size()));
-            std::uint64_t message_timestamp = timestamp - (1000 * previous_samples / 2083333) + (1000 * std::distance(phase_.cbegin(), message.begin) / 2083333);
+    sync_queue_.Close();
+}
 
-            dispatch->emplace_back(std::move(message.payload), message_timestamp, message.corrected_errors, rssi);
+void PipelinedReceiver::SyncThread() {
+    TwoMegDemodulator demodulator;
+    std::vector<TwoMegDemodulator::SyncCandidate> span_candidates;
+
+    BlockPointer block;
+    while (sync_queue_.Pop(block)) {
+        const auto start = std::chrono::steady_clock::now();
+        block->candidates.clear();
+        for (const auto &span : block->spans) {
+            demodulator.FindSync(block->dphi.begin() + span.begin, block->dphi.begin() + span.end, span_candidates);
+            block->candidates.insert(block->candidates.end(), span_candidates.begin(), span_candidates.end());
         }
+        block->demod_time = std::chrono::steady_clock::now() - start;
+        fec_queue_.Push(std::move(block));
+        Stats::Global().fec_queue.Set(fec_queue_.Size());
+    }
 
-        DispatchMessages(dispatch);
+    fec_queue_.Close();
+}
+
+void PipelinedReceiver::FECThread() {
+    TwoMegDemodulator demodulator;
+
+    BlockPointer block;
+    while (fec_queue_.Pop(block)) {
+        const auto start = std::chrono::steady_clock::now();
+        SharedMessageVector dispatch;
+
+        // Candidates are in order; once a message has been decoded, skip any
+        // candidates that overlap it, as the serial demodulator would.
+        PhaseDiffBuffer::const_iterator decoded_until = block->dphi.begin();
+        for (const auto &candidate : block->candidates) {
+            if (candidate.start < decoded_until)
+                continue;
+
+            auto message = demodulator.DemodBest(candidate.start, candidate.downlink);
+            if (!message)
+                continue;
+
+            decoded_until = message->end;
+            if (!dispatch) {
+                dispatch = std::make_shared<MessageVector>();
+            }
+            AppendMessage(*dispatch, std::move(message.value()), *converter_, block->samples_begin, block->dphi, block->timestamp, block->previous_samples);
+        }
+
+        block->demod_time += std::chrono::steady_clock::now() - start;
+        Stats::Global().demod_us.Add(std::chrono::duration_cast<std::chrono::microseconds>(block->demod_time).count());
+
+        // wait for our turn so that messages are dispatched in block order
+        std::unique_lock<std::mutex> lock(dispatch_mutex_);
+        dispatch_cond_.wait(lock, [this, &block] { return next_dispatch_ == block->sequence; });
+        if (dispatch) {
+            DispatchMessages(dispatch);
+        }
+        ++next_dispatch_;
+        lock.unlock();
+        dispatch_cond_.notify_all();
+
+        // let the sample buffer go back to its pool, and keep the rest
+        block->buffer.reset();
+        free_blocks_.Push(std::move(block));
     }
+}
 
-    // preserve the tail of the sample buffer for next time
-    const auto tail_size = demodulator_->NumTrailingSamples();
-    if (total_samples > tail_size) {
-        std::copy(samples_.end() - tail_size * converter_->BytesPerSample(), samples_.end(), samples_.begin());
-        saved_samples_ = tail_size;
-    } else {
-        saved_samples_ = total_samples;
+//
+// QueuedReceiver
+//
+
+QueuedReceiver::QueuedReceiver(std::shared_ptr<Receiver> receiver, std::size_t depth) : receiver_(receiver), ring_(std::max<std::size_t>(1, depth)) {
+    receiver_->SetConsumer([this](SharedMessageVector messages) { DispatchMessages(messages); });
+    thread_ = std::thread(&QueuedReceiver::DemodThread, this);
+}
+
+QueuedReceiver::~QueuedReceiver() { Stop(); }
+
+void QueuedReceiver::Stop() {
+    if (stopped_)
+        return;
+    stopped_ = true;
+
+    // the demodulation thread drains the ring before exiting
+    std::unique_lock<std::mutex> lock(mutex_);
+    halt_ = true;
+    lock.unlock();
+    cond_.notify_one();
+
+    thread_.join();
+    receiver_->Stop();
+}
+
+void QueuedReceiver::Reset() { dropped_ = true; }
+
+void QueuedReceiver::HandleSamples(std::uint64_t timestamp, SampleBuffer::Pointer buffer) {
+    Item item{timestamp, std::move(buffer), dropped_};
+    if (!ring_.Push(item)) {
+        // full: demodulation is not keeping up, drop this block
+        ++Stats::Global().blocks_queue_dropped;
+        dropped_ = true;
+        return;
+    }
+
+    dropped_ = false;
+    Stats::Global().sample_queue.Set(ring_.Size());
+
+    // Pairs with the fence in DemodThread: either it sees the item we just
+    // pushed, or we see that it is (about to be) sleeping and wake it
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleeping_.load(std::memory_order_relaxed)) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cond_.notify_one();
     }
 }
 
-static inline std::int16_t PhaseDifference(std::uint16_t from, std::uint16_t to) {
-    int32_t difference = to - from; // lies in the range -65535 .. +65535
-    if (difference >= 32768)        //   +32768..+65535
-        return difference - 65536;  //   -> -32768..-1: always in range
-    else if (difference < -32768)   //   -65535..-32769
-        return difference + 65536;  //   -> +1..32767: always in range
-    else
-        return difference;
+void QueuedReceiver::DemodThread() {
+    Item item;
+    for (;;) {
+        if (ring_.Pop(item)) {
+            if (item.discontinuity) {
+                receiver_->Reset();
+            }
+            receiver_->HandleSamples(item.timestamp, std::move(item.buffer));
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        sleeping_.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (ring_.Size() == 0) {
+            if (halt_)
+                break;
+            cond_.wait(lock);
+        }
+        sleeping_.store(false, std::memory_order_relaxed);
+    }
 }
 
 static inline bool SyncWordMatch(std::uint64_t word, std::uint64_t expected) {
@@ -148,11 +434,11 @@ static inline bool SyncWordMatch(std::uint64_t word, std::uint64_t expected) {
 }
 
 #ifdef AUTO_CENTER
-// check that there is a valid sync word starting at 'phase'
+// check that there is a valid sync word starting at 'dphi'
 // that matches the sync word 'pattern'. Return a pair:
 // first element is true if the sync word looks OK; second
 // element has the dphi threshold to use for bit slicing
-static inline std::pair<bool, std::int16_t> CheckSyncWord(PhaseBuffer::const_iterator phase, std::uint64_t pattern) {
+static inline std::pair<bool, std::int16_t> CheckSyncWord(PhaseDiffBuffer::const_iterator dphi, std::uint64_t pattern) {
     const unsigned MAX_SYNC_ERRORS = 4;
 
     std::int32_t dphi_zero_total = 0;
@@ -164,13 +450,13 @@ static inline std::pair<bool, std::int16_t> CheckSyncWord(PhaseBuffer::const_ite
     // take the mean of the two as our central value
 
     for (unsigned i = 0; i < SYNC_BITS; ++i) {
-        auto dphi = PhaseDifference(phase[i * 2], phase[i * 2 + 1]);
+        auto d = dphi[i * 2];
         if (pattern & (1UL << (35 - i))) {
             ++one_bits;
-            dphi_one_total += dphi;
+            dphi_one_total += d;
         } else {
             ++zero_bits;
-            dphi_zero_total += dphi;
+            dphi_zero_total += d;
         }
     }
 
@@ -182,13 +468,13 @@ static inline std::pair<bool, std::int16_t> CheckSyncWord(PhaseBuffer::const_ite
     // recheck sync word using our center value
     unsigned error_bits = 0;
     for (unsigned i = 0; i < SYNC_BITS; ++i) {
-        auto dphi = PhaseDifference(phase[i * 2], phase[i * 2 + 1]);
+        auto d = dphi[i * 2];
 
         if (pattern & (1UL << (35 - i))) {
-            if (dphi < center)
+            if (d < center)
                 ++error_bits;
         } else {
-            if (dphi > center)
+            if (d > center)
                 ++error_bits;
         }
     }
@@ -197,66 +483,115 @@ static inline std::pair<bool, std::int16_t> CheckSyncWord(PhaseBuffer::const_ite
 }
 #endif
 
-// demodulate 'bytes' bytes from samples at 'phase' using 'center' as the bit
-// slicing threshold
-static inline std::pair<Bytes, std::vector<std::size_t>> DemodBits(PhaseBuffer::const_iterator phase, unsigned bytes, std::int16_t zero_slice, std::int16_t one_slice) {
-    std::pair<Bytes, std::vector<std::size_t>> result_pair;
-    auto &result = result_pair.first;
-    auto &erasures = result_pair.second;
-
-    result.reserve(bytes);
+// demodulate 'bytes' bytes from the phase differences at 'dphi' into 'raw',
+// using 'zero_slice' and 'one_slice' as the bit slicing thresholds; each bit
+// uses one phase difference, taken from every other sample. Bytes containing
+// bits between the two thresholds are listed in 'erasures'.
+static inline void DemodBits(PhaseDiffBuffer::const_iterator dphi, unsigned bytes, std::int16_t zero_slice, std::int16_t one_slice, MessageBuffer &raw, ErasureList &erasures) {
+    erasures.count = 0;
 
     for (unsigned i = 0; i < bytes; ++i) {
         std::uint8_t b = 0;
         bool erasure = false;
-        if (PhaseDifference(phase[0], phase[1]) > one_slice)
-            b |= 0x80;
-        else if (PhaseDifference(phase[0], phase[1]) > zero_slice)
-            erasure = true;
-        if (PhaseDifference(phase[2], phase[3]) > one_slice)
-            b |= 0x40;
-        else if (PhaseDifference(phase[2], phase[3]) > zero_slice)
-            erasure = true;
-        if (PhaseDifference(phase[4], phase[5]) > one_slice)
-            b |= 0x20;
-        else if (PhaseDifference(phase[4], phase[5]) > zero_slice)
-            erasure = true;
-        if (PhaseDifference(phase[6], phase[7]) > one_slice)
-            b |= 0x10;
-        else if (PhaseDifference(phase[6], phase[7]) > zero_slice)
-            erasure = true;
-        if (PhaseDifference(phase[8], phase[9]) > one_slice)
-            b |= 0x08;
-        else if (PhaseDifference(phase[8], phase[9]) > zero_slice)
-            erasure = true;
-        if (PhaseDifference(phase[10], phase[11]) > one_slice)
-            b |= 0x04;
-        else if (PhaseDifference(phase[10], phase[11]) > zero_slice)
-            erasure = true;
-        if (PhaseDifference(phase[12], phase[13]) > one_slice)
-            b |= 0x02;
-        else if (PhaseDifference(phase[12], phase[13]) > zero_slice)
-            erasure = true;
-        if (PhaseDifference(phase[14], phase[15]) > one_slice)
-            b |= 0x01;
-        else if (PhaseDifference(phase[14], phase[15]) > zero_slice)
-            erasure = true;
-        result.push_back(b);
+        for (unsigned bit = 0; bit < 8; ++bit) {
+            const auto d = dphi[bit * 2];
+            b = (b << 1) | (d > one_slice ? 1 : 0);
+            erasure |= (d <= one_slice && d > zero_slice);
+        }
+        raw[i] = b;
         if (erasure)
-            erasures.push_back(i);
-        phase += 16;
+            erasures.index[erasures.count++] = i;
+        dphi += 16;
     }
+}
+
+// Bit-reverse the low `bits` bits of `word`
+static constexpr std::uint64_t ReverseBits(std::uint64_t word, unsigned bits) { return bits == 0 ? 0 : ((word & 1) << (bits - 1)) | ReverseBits(word >> 1, bits - 1); }
+
+// The sync search packs bits with the oldest bit in the LSB, so it compares
+// against bit-reversed sync words
+static constexpr std::uint64_t DOWNLINK_SYNC_WORD_REV = ReverseBits(DOWNLINK_SYNC_WORD, SYNC_BITS);
+static constexpr std::uint64_t UPLINK_SYNC_WORD_REV = ReverseBits(UPLINK_SYNC_WORD, SYNC_BITS);
+static constexpr std::uint64_t SYNC_MASK = ((((std::uint64_t)1) << SYNC_BITS) - 1);
+
+static_assert((DOWNLINK_SYNC_WORD ^ UPLINK_SYNC_WORD) == SYNC_MASK, "sync search assumes the uplink sync word is the complement of the downlink sync word");
+
+// Read 128 phase differences from `dphi` and return the sign bits (1 if the
+// difference is positive) of the even-numbered ones in `even` and the
+// odd-numbered ones in `odd`. Bit N of each result comes from pair N.
+static inline void PackSignBits(const std::int16_t *dphi, std::uint64_t &even, std::uint64_t &odd) {
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    even = odd = 0;
+    for (unsigned i = 0; i < 128; i += 32) {
+        const auto v0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(dphi + i));
+        const auto v1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(dphi + i + 8));
+        const auto v2 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(dphi + i + 16));
+        const auto v3 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(dphi + i + 24));
+
+        // split each vector into its even (low half of each 32-bit lane,
+        // sign-extended) and odd (high half) elements
+        const auto e01 = _mm_packs_epi32(_mm_srai_epi32(_mm_slli_epi32(v0, 16), 16), _mm_srai_epi32(_mm_slli_epi32(v1, 16), 16));
+        const auto e23 = _mm_packs_epi32(_mm_srai_epi32(_mm_slli_epi32(v2, 16), 16), _mm_srai_epi32(_mm_slli_epi32(v3, 16), 16));
+        const auto o01 = _mm_packs_epi32(_mm_srai_epi32(v0, 16), _mm_srai_epi32(v1, 16));
+        const auto o23 = _mm_packs_epi32(_mm_srai_epi32(v2, 16), _mm_srai_epi32(v3, 16));
+
+        const auto e = _mm_packs_epi16(_mm_cmpgt_epi16(e01, zero), _mm_cmpgt_epi16(e23, zero));
+        const auto o = _mm_packs_epi16(_mm_cmpgt_epi16(o01, zero), _mm_cmpgt_epi16(o23, zero));
+        even |= (std::uint64_t)(std::uint16_t)_mm_movemask_epi8(e) << (i / 2);
+        odd |= (std::uint64_t)(std::uint16_t)_mm_movemask_epi8(o) << (i / 2);
+    }
+#else
+    even = odd = 0;
+    for (unsigned i = 0; i < 64; ++i) {
+        even |= (std::uint64_t)(dphi[i * 2] > 0 ? 1 : 0) << i;
+        odd |= (std::uint64_t)(dphi[i * 2 + 1] > 0 ? 1 : 0) << i;
+    }
+#endif
+}
 
-    return result_pair;
+// Return the SYNC_BITS-bit window of a packed bit stream that ends at bit
+// `i` of `current`, where `previous` holds the 64 bits before `current`
+static inline std::uint64_t SyncWindow(std::uint64_t previous, std::uint64_t current, unsigned i) {
+    if (i >= SYNC_BITS - 1)
+        return (current >> (i - (SYNC_BITS - 1))) & SYNC_MASK;
+    else
+        return ((current << (SYNC_BITS - 1 - i)) | (previous >> (64 - (SYNC_BITS - 1) + i))) & SYNC_MASK;
+}
+
+// Hardware popcount makes a large difference to SyncCandidates, so on x86
+// build a popcnt version alongside the baseline one and pick at load time
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(__POPCNT__)
+#define SYNC_CANDIDATES_TARGET __attribute__((target_clones("popcnt", "default")))
+#else
+#define SYNC_CANDIDATES_TARGET
+#endif
+
+// Test all 64 windows ending in `current` against both sync words at once.
+// Returns a mask with bit N set if the window ending at bit N might be a sync
+// word (it is within 4 bits of either the downlink or uplink word).
+// As the two sync words are complements, a window that differs from the
+// downlink word in N bits differs from the uplink word in SYNC_BITS-N bits,
+// so one popcount per window covers both.
+SYNC_CANDIDATES_TARGET static std::uint64_t SyncCandidates(std::uint64_t previous, std::uint64_t current) {
+    std::uint64_t candidates = 0;
+    for (unsigned i = 0; i < 64; ++i) {
+        const unsigned errors = __builtin_popcountll(SyncWindow(previous, current, i) ^ DOWNLINK_SYNC_WORD_REV);
+        candidates |= (std::uint64_t)(errors - 5 > SYNC_BITS - 10) << i;
+    }
+    return candidates;
 }
 
 unsigned TwoMegDemodulator::NumTrailingSamples() { return (SYNC_BITS + UPLINK_BITS) * 2; }
 
-// Try to demodulate messages from `begin` .. `end` and return a list of
-// messages. Messages that start near the end of the range may not be
-// demodulated (less than (SYNC_BITS + UPLINK_BITS)*2 before the end of the
-// buffer)
-std::vector<Demodulator::Message> TwoMegDemodulator::Demodulate(PhaseBuffer::const_iterator begin, PhaseBuffer::const_iterator end) {
+// Search for sync words in `begin` .. `end`. For each sync word found, call
+// `handler(start, downlink)` where `start` is the position of the first
+// sample of the sync word. If the handler returns an iterator, the search
+// resumes from that position (typically the end of a decoded message);
+// if it returns boost::none, the search continues from the next sample.
+// Sync words that start near the end of the range (less than
+// (SYNC_BITS + UPLINK_BITS)*2 before the end of the buffer) are not reported.
+template <class Handler> void TwoMegDemodulator::SearchSync(PhaseDiffBuffer::const_iterator begin, PhaseDiffBuffer::const_iterator end, Handler handler) {
     // We expect samples at twice the UAT bitrate.
     // We look at phase difference between pairs of adjacent samples, i.e.
     //  sample 1 - sample 0   -> sync0
@@ -265,159 +600,300 @@ std::vector<Demodulator::Message> TwoMegDemodulator::Demodulate(PhaseBuffer::con
     //  sample 4 - sample 3   -> sync1
     // ...
     //
-    // We accumulate bits into two buffers, sync0 and sync1.
-    // Then we compare those buffers to the expected 36-bit sync word that
-    // should be at the start of each UAT frame. When (if) we find it,
-    // that tells us which sample to start decoding from.
+    // We pack the signs of these into two bit streams, sync0 and sync1,
+    // 64 bits at a time. Then we compare every 36-bit window of those streams
+    // to the expected sync word that should be at the start of each UAT
+    // frame. When (if) we find it, that tells us which sample to start
+    // decoding from.
+    //
+    // Almost all windows are noise, so the comparison is done for a whole
+    // 64-bit word of windows in one go (SyncCandidates); only the rare
+    // windows that are close to a sync word are looked at individually.
 
     // Stop when we run out of remaining samples for a max-sized frame.
     // Arrange for our caller to pass the trailing data back to us next time;
     // ensure we don't consume any partial sync word we might be part-way
     // through. This means we don't need to maintain state between calls.
-
-    std::vector<Demodulator::Message> messages;
+    // (The trailing samples also mean that it is safe for PackSignBits to
+    // read past `limit`.)
 
     const int trailing_samples = (SYNC_BITS + UPLINK_BITS) * 2;
     if (std::distance(begin, end) < trailing_samples) {
-        return messages;
+        return;
     }
 
     const auto limit = end - trailing_samples;
 
-    unsigned sync_bits = 0;
-    std::uint64_t sync0 = 0, sync1 = 0;
-    const std::uint64_t SYNC_MASK = ((((std::uint64_t)1) << SYNC_BITS) - 1);
-
-    for (auto probe = begin; probe < limit; probe += 2) {
-        auto d0 = PhaseDifference(probe[0], probe[1]);
-        auto d1 = PhaseDifference(probe[1], probe[2]);
-
-        sync0 = ((sync0 << 1) | (d0 > 0 ? 1 : 0)) & SYNC_MASK;
-        sync1 = ((sync1 << 1) | (d1 > 0 ? 1 : 0)) & SYNC_MASK;
-
-        if (++sync_bits < SYNC_BITS)
-            continue; // haven't fully populated sync0/1 yet
-
-        // see if we have (the start of) a valid sync word
-        // when we find a match, try to demodulate both with that match
-        // and with the next position, and pick the one with fewer
-        // errors.
-        if (SyncWordMatch(sync0, DOWNLINK_SYNC_WORD)) {
-            auto start = probe - SYNC_BITS * 2 + 2;
-            auto message = DemodBest(start, true /* downlink */);
-            if (message) {
-                probe = message->end - 2;
-                sync_bits = 0;
-                messages.emplace_back(std::move(message.value()));
-                continue;
+    // `from` is where the bit streams start: the start of the buffer, or the
+    // end of the last decoded message
+    auto from = begin;
+    while (from < limit) {
+        // pair N is dphi[from + N*2] (sync0) and dphi[from + N*2 + 1] (sync1)
+        const std::ptrdiff_t pairs = (std::distance(from, limit) + 1) / 2;
+
+        std::uint64_t previous0 = 0, previous1 = 0;
+        bool resumed = false;
+        for (std::ptrdiff_t base = 0; base < pairs && !resumed; base += 64) {
+            std::uint64_t current0, current1;
+            PackSignBits(&*(from + base * 2), current0, current1);
+
+            std::uint64_t valid = ~(std::uint64_t)0;
+            if (base == 0)
+                valid <<= SYNC_BITS - 1; // haven't fully populated sync0/1 yet
+            if (pairs - base < 64)
+                valid &= (((std::uint64_t)1) << (pairs - base)) - 1;
+
+            auto candidates = (SyncCandidates(previous0, current0) | SyncCandidates(previous1, current1)) & valid;
+            while (candidates && !resumed) {
+                const unsigned i = __builtin_ctzll(candidates);
+                candidates &= candidates - 1;
+
+                const auto probe = from + (base + i) * 2;
+                const auto sync0 = SyncWindow(previous0, current0, i);
+                const auto sync1 = SyncWindow(previous1, current1, i);
+
+                // see if we have (the start of) a valid sync word
+                boost::optional<PhaseDiffBuffer::const_iterator> resume;
+                if (!resume && SyncWordMatch(sync0, DOWNLINK_SYNC_WORD_REV))
+                    resume = handler(probe - SYNC_BITS * 2 + 2, true /* downlink */);
+                if (!resume && SyncWordMatch(sync1, DOWNLINK_SYNC_WORD_REV))
+                    resume = handler(probe - SYNC_BITS * 2 + 3, true /* downlink */);
+                if (!resume && SyncWordMatch(sync0, UPLINK_SYNC_WORD_REV))
+                    resume = handler(probe - SYNC_BITS * 2 + 2, false /* !downlink */);
+                if (!resume && SyncWordMatch(sync1, UPLINK_SYNC_WORD_REV))
+                    resume = handler(probe - SYNC_BITS * 2 + 3, false /* !downlink */);
+
+                if (resume) {
+                    // start again with empty sync0/1 from the resume point
+                    from = *resume;
+                    resumed = true;
+                }
             }
-        }
 
-        if (SyncWordMatch(sync1, DOWNLINK_SYNC_WORD)) {
-            auto start = probe - SYNC_BITS * 2 + 3;
-            auto message = DemodBest(start, true /* downlink */);
-            if (message) {
-                probe = message->end - 2;
-                sync_bits = 0;
-                messages.emplace_back(std::move(message.value()));
-                continue;
-            }
-        }
-
-        if (SyncWordMatch(sync0, UPLINK_SYNC_WORD)) {
-            auto start = probe - SYNC_BITS * 2 + 2;
-            auto message = DemodBest(start, false /* !downlink */);
-            if (message) {
-                probe = message->end - 2;
-                sync_bits = 0;
-                messages.emplace_back(std::move(message.value()));
-                continue;
-            }
+            previous0 = current0;
+            previous1 = current1;
         }
 
-        if (SyncWordMatch(sync1, UPLINK_SYNC_WORD)) {
-            auto start = probe - SYNC_BITS * 2 + 3;
-            auto message = DemodBest(start, false /* !downlink */);
-            if (message) {
-                probe = message->end - 2;
-                sync_bits = 0;
-                messages.emplace_back(std::move(message.value()));
-                continue;
-            }
-        }
+        if (!resumed)
+            break;
     }
+}
+
+// Try to demodulate messages from `begin` .. `end` and return a list of
+// messages. Messages that start near the end of the range may not be
+// demodulated (less than (SYNC_BITS + UPLINK_BITS)*2 before the end of the
+// buffer)
+std::vector<Demodulator::Message> TwoMegDemodulator::Demodulate(PhaseDiffBuffer::const_iterator begin, PhaseDiffBuffer::const_iterator end) {
+    std::vector<Demodulator::Message> messages;
+
+    // when we find a match, try to demodulate both with that match
+    // and with the next position, and pick the one with fewer
+    // errors.
+    SearchSync(begin, end, [this, &messages](PhaseDiffBuffer::const_iterator start, bool downlink) -> boost::optional<PhaseDiffBuffer::const_iterator> {
+        auto message = DemodBest(start, downlink);
+        if (!message)
+            return boost::none;
+
+        auto message_end = message->end;
+        messages.emplace_back(std::move(message.value()));
+        return message_end;
+    });
 
     return messages;
 }
 
-boost::optional<Demodulator::Message> TwoMegDemodulator::DemodBest(PhaseBuffer::const_iterator start, bool downlink) {
-    auto message0 = downlink ? DemodOneDownlink(start) : DemodOneUplink(start);
-    auto message1 = downlink ? DemodOneDownlink(start + 1) : DemodOneUplink(start + 1);
+void TwoMegDemodulator::FindSync(PhaseDiffBuffer::const_iterator begin, PhaseDiffBuffer::const_iterator end, std::vector<SyncCandidate> &candidates) {
+    candidates.clear();
 
-    if (!message0 && !message1)
+    SearchSync(begin, end, [&candidates](PhaseDiffBuffer::const_iterator start, bool downlink) -> boost::optional<PhaseDiffBuffer::const_iterator> {
+        candidates.push_back({start, downlink});
         return boost::none;
+    });
+}
 
-    unsigned errors0 = (message0 ? message0->corrected_errors : 9999);
-    unsigned errors1 = (message1 ? message1->corrected_errors : 9999);
+boost::optional<Demodulator::Message> TwoMegDemodulator::DemodBest(PhaseDiffBuffer::const_iterator start, bool downlink) {
+    ++(downlink ? Stats::Global().downlink_attempts : Stats::Global().uplink_attempts);
+
+    auto &scratch0 = scratch_[0];
+    auto &scratch1 = scratch_[1];
+    bool success0 = downlink ? DemodOneDownlink(start, scratch0) : DemodOneUplink(start, scratch0);
+    bool success1 = downlink ? DemodOneDownlink(start + 1, scratch1) : DemodOneUplink(start + 1, scratch1);
+
+    if (!success0 && !success1)
+        return boost::none;
 
-    if (errors0 <= errors1)
-        return message0; // should be move-eligible
+    unsigned errors0 = (success0 ? scratch0.corrected.errors : 9999);
+    unsigned errors1 = (success1 ? scratch1.corrected.errors : 9999);
+
+    // only the winning alignment is copied out of the scratch space
+    const auto message_start = (errors0 <= errors1 ? start : start + 1);
+    const auto &corrected = (errors0 <= errors1 ? scratch0.corrected : scratch1.corrected);
+
+    unsigned bits;
+    if (!downlink)
+        bits = UPLINK_BITS;
+    else if (corrected.size == DOWNLINK_LONG_DATA_BYTES)
+        bits = DOWNLINK_LONG_BITS;
     else
-        return message1; // should be move-eligible
+        bits = DOWNLINK_SHORT_BITS;
+
+    return Demodulator::Message{Bytes(corrected.data.begin(), corrected.data.begin() + corrected.size), corrected.errors, message_start, message_start + (SYNC_BITS + bits) * 2};
 }
 
-boost::optional<Demodulator::Message> TwoMegDemodulator::DemodOneDownlink(PhaseBuffer::const_iterator start) {
+bool TwoMegDemodulator::DemodOneDownlink(PhaseDiffBuffer::const_iterator start, Scratch &scratch) {
 #ifdef AUTO_CENTER
     auto sync = CheckSyncWord(start, DOWNLINK_SYNC_WORD);
     if (!sync.first) {
         // Sync word had errors
-        return boost::none;
+        return false;
     }
 
-    auto result = DemodBits(start + SYNC_BITS * 2, DOWNLINK_LONG_BYTES, sync.second, sync.second);
+    DemodBits(start + SYNC_BITS * 2, DOWNLINK_LONG_BYTES, sync.second, sync.second, scratch.raw, scratch.erasures);
 #else
-    auto result = DemodBits(start + SYNC_BITS * 2, DOWNLINK_LONG_BYTES, 0, 0);
+    DemodBits(start + SYNC_BITS * 2, DOWNLINK_LONG_BYTES, 0, 0, scratch.raw, scratch.erasures);
 #endif
-    auto &raw = result.first;
-    auto &erasures = result.second;
-
-    bool success;
-    Bytes corrected;
-    unsigned errors;
-    std::tie(success, corrected, errors) = fec_.CorrectDownlink(raw, erasures);
-    if (!success) {
-        // Error correction failed
-        return boost::none;
-    }
 
-    auto bits = (corrected.size() == DOWNLINK_LONG_DATA_BYTES ? DOWNLINK_LONG_BITS : DOWNLINK_SHORT_BITS);
-    return Demodulator::Message{std::move(corrected), errors, start, start + (SYNC_BITS + bits) * 2};
+    return fec_.CorrectDownlink(scratch.raw, scratch.erasures, scratch.corrected);
 }
 
-boost::optional<Demodulator::Message> TwoMegDemodulator::DemodOneUplink(PhaseBuffer::const_iterator start) {
+bool TwoMegDemodulator::DemodOneUplink(PhaseDiffBuffer::const_iterator start, Scratch &scratch) {
 #ifdef AUTO_CENTER
     auto sync = CheckSyncWord(start, UPLINK_SYNC_WORD);
     if (!sync.first) {
         // Sync word had errors
-        return boost::none;
+        return false;
     }
 
-    auto result = DemodBits(start + SYNC_BITS * 2, UPLINK_BYTES, sync.second, sync.second);
+    DemodBits(start + SYNC_BITS * 2, UPLINK_BYTES, sync.second, sync.second, scratch.raw, scratch.erasures);
 #else
-    auto result = DemodBits(start + SYNC_BITS * 2, UPLINK_BYTES, 0, 0);
+    DemodBits(start + SYNC_BITS * 2, UPLINK_BYTES, 0, 0, scratch.raw, scratch.erasures);
 #endif
-    auto &raw = result.first;
-    auto &erasures = result.second;
 
-    bool success;
-    Bytes corrected;
-    unsigned errors;
-    std::tie(success, corrected, errors) = fec_.CorrectUplink(raw, erasures);
+    return fec_.CorrectUplink(scratch.raw, scratch.erasures, scratch.corrected);
+}
 
-    if (!success) {
-        // Error correction failed
-        return boost::none;
+//
+// ParallelDemodulator
+//
+
+ParallelDemodulator::ParallelDemodulator(unsigned threads) {
+    threads = std::max(1U, threads);
+    for (unsigned i = 0; i < threads; ++i) {
+        demodulators_.emplace_back(new TwoMegDemodulator());
+    }
+
+    // chunk 0 is always handled by the calling thread
+    for (unsigned i = 1; i < threads; ++i) {
+        threads_.emplace_back(&ParallelDemodulator::WorkerThread, this, i);
+    }
+}
+
+ParallelDemodulator::~ParallelDemodulator() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    halt_ = true;
+    lock.unlock();
+    work_cond_.notify_all();
+
+    for (auto &t : threads_) {
+        t.join();
     }
+}
+
+unsigned ParallelDemodulator::NumTrailingSamples() { return demodulators_[0]->NumTrailingSamples(); }
+
+void ParallelDemodulator::WorkerThread(unsigned index) {
+    std::uint64_t seen = 0;
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+        work_cond_.wait(lock, [this, &seen] { return halt_ || generation_ != seen; });
+        if (halt_)
+            return;
+
+        seen = generation_;
+        if (index >= chunks_.size())
+            continue; // not needed for this buffer
 
-    return Demodulator::Message{std::move(corrected), errors, start, start + (SYNC_BITS + UPLINK_BITS) * 2};
+        auto &chunk = chunks_[index];
+        lock.unlock();
+        chunk.messages = demodulators_[index]->Demodulate(chunk.begin, chunk.end);
+        lock.lock();
+
+        if (--pending_ == 0)
+            done_cond_.notify_one();
+    }
+}
+
+std::vector<Demodulator::Message> ParallelDemodulator::Demodulate(PhaseDiffBuffer::const_iterator begin, PhaseDiffBuffer::const_iterator end) {
+    // TwoMegDemodulator searches for sync words that end before
+    // end - trailing_samples, and only reports a sync word once it has seen
+    // all SYNC_BITS of it. So chunk N searches the range
+    //
+    //   [ boundary(N) - overlap .. boundary(N+1) )
+    //
+    // and is also given trailing_samples beyond its end so that it can
+    // demodulate a maximum-length message that starts there. The overlap
+    // lets chunk N see the whole of a sync word that straddles boundary(N).
+    // Boundaries are kept at an even sample offset so that each chunk pairs
+    // up samples the same way a single pass over the whole buffer would.
+
+    const std::ptrdiff_t trailing_samples = NumTrailingSamples();
+    const std::ptrdiff_t overlap = SYNC_BITS * 2;
+    const std::ptrdiff_t min_chunk_size = 16384; // don't bother splitting below this
+
+    const auto total = std::distance(begin, end);
+    const auto search_size = total - trailing_samples;
+    if (search_size <= 0) {
+        return {};
+    }
+
+    const std::ptrdiff_t max_chunks = demodulators_.size();
+    const auto n_chunks = std::max<std::ptrdiff_t>(1, std::min(max_chunks, search_size / min_chunk_size));
+    if (n_chunks == 1) {
+        return demodulators_[0]->Demodulate(begin, end);
+    }
+
+    // round up, so that the chunks cover all of search_size
+    const auto chunk_size = ((search_size + n_chunks - 1) / n_chunks + 1) & ~1;
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    chunks_.resize(n_chunks);
+    for (std::ptrdiff_t i = 0; i < n_chunks; ++i) {
+        const auto search_start = std::max<std::ptrdiff_t>(0, i * chunk_size - overlap);
+        const auto search_end = std::min(search_size, (i + 1) * chunk_size);
+        chunks_[i].begin = begin + search_start;
+        chunks_[i].end = begin + search_end + trailing_samples;
+        chunks_[i].messages.clear();
+    }
+    pending_ = n_chunks - 1;
+    ++generation_;
+    lock.unlock();
+    work_cond_.notify_all();
+
+    chunks_[0].messages = demodulators_[0]->Demodulate(chunks_[0].begin, chunks_[0].end);
+
+    lock.lock();
+    done_cond_.wait(lock, [this] { return pending_ == 0; });
+    lock.unlock();
+
+    // Merge the results in start order. A message may be found by two
+    // adjacent chunks, or a later chunk may find something inside a message
+    // that an earlier chunk decoded (which a single pass would have skipped
+    // over); drop anything that starts before the end of the previous message.
+    std::vector<Message> merged;
+    for (auto &chunk : chunks_) {
+        std::move(chunk.messages.begin(), chunk.messages.end(), std::back_inserter(merged));
+        chunk.messages.clear();
+    }
+    std::stable_sort(merged.begin(), merged.end(), [](const Message &a, const Message &b) { return a.begin < b.begin; });
+
+    std::vector<Message> messages;
+    messages.reserve(merged.size());
+    for (auto &message : merged) {
+        if (!messages.empty() && message.begin < messages.back().end)
+            continue;
+        messages.emplace_back(std::move(message));
+    }
+
+    return messages;
 }
@@ -7,13 +7,21 @@
 #ifndef DUMP978_DEMODULATOR_H
 #define DUMP978_DEMODULATOR_H
 
+#include <atomic>
+#include <condition_variable>
 #include <functional>
+#include <mutex>
+#include <thread>
 #include <vector>
 
+#include "bounded_queue.h"
 #include "common.h"
 #include "convert.h"
 #include "fec.h"
 #include "message_source.h"
+#include "sample_buffer.h"
+#include "spsc_ring.h"
+#include "squelch.h"
 #include "uat_message.h"
 
 namespace flightaware::uat {
@@ -23,12 +31,12 @@ namespace flightaware::uat {
         struct Message {
             Bytes payload;
             unsigned corrected_errors;
-            PhaseBuffer::const_iterator begin;
-            PhaseBuffer::const_iterator end;
+            PhaseDiffBuffer::const_iterator begin;
+            PhaseDiffBuffer::const_iterator end;
         };
 
         virtual ~Demodulator() {}
-        virtual std::vector<Message> Demodulate(PhaseBuffer::const_iterator begin, PhaseBuffer::const_iterator end) = 0;
+        virtual std::vector<Message> Demodulate(PhaseDiffBuffer::const_iterator begin, PhaseDiffBuffer::const_iterator end) = 0;
 
         virtual unsigned NumTrailingSamples() = 0;
 
@@ -38,36 +46,211 @@ namespace flightaware::uat {
 
     class TwoMegDemodulator : public Demodulator {
       public:
-        std::vector<Message> Demodulate(PhaseBuffer::const_iterator begin, PhaseBuffer::const_iterator end) override;
+        // A possible start of message found by the sync word search
+        struct SyncCandidate {
+            PhaseDiffBuffer::const_iterator start;
+            bool downlink;
+        };
+
+        std::vector<Message> Demodulate(PhaseDiffBuffer::const_iterator begin, PhaseDiffBuffer::const_iterator end) override;
         unsigned NumTrailingSamples() override;
 
+        // Search `begin` .. `end` for sync words without trying to demodulate
+        // the data that follows them. `candidates` is replaced with the
+        // candidates found, in order of their start position (reusing its
+        // storage); the same trailing-sample rules as Demodulate apply.
+        void FindSync(PhaseDiffBuffer::const_iterator begin, PhaseDiffBuffer::const_iterator end, std::vector<SyncCandidate> &candidates);
+
+        // Demodulate and error-correct a message whose sync word starts at or
+        // just after `begin`, returning the better of the two alignments.
+        boost::optional<Message> DemodBest(PhaseDiffBuffer::const_iterator begin, bool downlink);
+
       private:
-        boost::optional<Message> DemodBest(PhaseBuffer::const_iterator begin, bool downlink);
-        boost::optional<Message> DemodOneDownlink(PhaseBuffer::const_iterator begin);
-        boost::optional<Message> DemodOneUplink(PhaseBuffer::const_iterator begin);
+        template <class Handler> void SearchSync(PhaseDiffBuffer::const_iterator begin, PhaseDiffBuffer::const_iterator end, Handler handler);
+
+        // Scratch space for demodulating and correcting one alignment of a
+        // message, reused between candidates so that false syncs (the vast
+        // majority of candidates) do not allocate
+        struct Scratch {
+            MessageBuffer raw;
+            ErasureList erasures;
+            CorrectedMessage corrected;
+        };
+
+        bool DemodOneDownlink(PhaseDiffBuffer::const_iterator begin, Scratch &scratch);
+        bool DemodOneUplink(PhaseDiffBuffer::const_iterator begin, Scratch &scratch);
+
+        std::array<Scratch, 2> scratch_;
+    };
+
+    // A Demodulator for multicore machines. Each buffer is split into
+    // several chunks, overlapping by enough that no message is lost at chunk
+    // boundaries, which are demodulated concurrently by TwoMegDemodulator;
+    // the results are merged and de-duplicated by start sample.
+    class ParallelDemodulator : public Demodulator {
+      public:
+        // Demodulate using up to `threads` threads, including the calling thread
+        ParallelDemodulator(unsigned threads);
+        ~ParallelDemodulator();
+
+        std::vector<Message> Demodulate(PhaseDiffBuffer::const_iterator begin, PhaseDiffBuffer::const_iterator end) override;
+        unsigned NumTrailingSamples() override;
+
+      private:
+        struct Chunk {
+            PhaseDiffBuffer::const_iterator begin;
+            PhaseDiffBuffer::const_iterator end;
+            std::vector<Message> messages;
+        };
+
+        void WorkerThread(unsigned index);
+
+        std::vector<std::unique_ptr<TwoMegDemodulator>> demodulators_;
+        std::vector<Chunk> chunks_;
+
+        std::mutex mutex_;
+        std::condition_variable work_cond_;
+        std::condition_variable done_cond_;
+        std::uint64_t generation_ = 0;
+        unsigned pending_ = 0;
+        bool halt_ = false;
+
+        std::vector<std::thread> threads_;
     };
 
     class Receiver : public MessageSource {
       public:
-        virtual void HandleSamples(std::uint64_t timestamp, Bytes::const_iterator begin, Bytes::const_iterator end) = 0;
+        // Demodulate the samples in `buffer`, which directly follow those of
+        // the previous call. The receiver prepends the tail of the previous
+        // buffer to `buffer` (see SampleBuffer::Prepend) and works on it in
+        // place, so the caller must not reuse it until it is released.
+        virtual void HandleSamples(std::uint64_t timestamp, SampleBuffer::Pointer buffer) = 0;
+
+        // The number of samples carried over from the end of each buffer to
+        // the start of the next; buffers with at least this much headroom
+        // never need to be reallocated by Prepend.
+        virtual std::size_t TrailingSamples() = 0;
+
+        // Discard any samples carried over from the previous buffer, because
+        // the next buffer does not directly follow it
+        virtual void Reset() = 0;
+
+        // Finish processing any samples that have been handed to HandleSamples
+        // but not yet demodulated. HandleSamples must not be called afterwards.
+        virtual void Stop() {}
     };
 
     class SingleThreadReceiver : public Receiver {
       public:
-        SingleThreadReceiver(SampleFormat format);
+        // If `demod_threads` is more than 1, each block is demodulated
+        // using a ParallelDemodulator with that many threads. With a
+        // `squelch`, only the spans of each block that it passes are
+        // converted and demodulated.
+        SingleThreadReceiver(SampleFormat format, unsigned demod_threads = 1, Squelch::Pointer squelch = nullptr);
 
-        void HandleSamples(std::uint64_t timestamp, Bytes::const_iterator begin, Bytes::const_iterator end) override;
+        void HandleSamples(std::uint64_t timestamp, SampleBuffer::Pointer buffer) override;
+        std::size_t TrailingSamples() override { return demodulator_->NumTrailingSamples(); }
+        void Reset() override { tail_.clear(); }
 
       private:
         SampleConverter::Pointer converter_;
         std::unique_ptr<Demodulator> demodulator_;
+        Squelch::Pointer squelch_;
 
-        Bytes samples_;
-        std::size_t saved_samples_ = 0;
+        Bytes tail_;
+        PhaseDiffBuffer dphi_;
+        std::vector<Squelch::Span> spans_;
+    };
+
+    // A Receiver that splits the receive chain into stages that run on their
+    // own threads, connected by bounded queues:
+    //
+    //   HandleSamples (caller's thread) -> conversion -> sync search -> FEC
+    //
+    // There is a single conversion thread and a single sync search thread;
+    // error correction can be spread over several threads, each of which
+    // handles a whole block at a time. Messages are dispatched in block order
+    // regardless of which FEC thread decoded them. A `squelch` runs in the
+    // conversion stage, and later stages see only the spans it passes.
+    class PipelinedReceiver : public Receiver {
+      public:
+        PipelinedReceiver(SampleFormat format, unsigned fec_threads = 1, Squelch::Pointer squelch = nullptr, std::size_t queue_depth = 4);
+        ~PipelinedReceiver();
+
+        void HandleSamples(std::uint64_t timestamp, SampleBuffer::Pointer buffer) override;
+        std::size_t TrailingSamples() override { return trailing_samples_; }
+        void Reset() override { tail_.clear(); }
+        void Stop() override;
+
+      private:
+        struct Block;
+        typedef std::shared_ptr<Block> BlockPointer;
+
+        void ConvertThread();
+        void SyncThread();
+        void FECThread();
+
+        SampleConverter::Pointer converter_;
+        Squelch::Pointer squelch_;
+        unsigned trailing_samples_;
+
+        Bytes tail_;
+        std::uint64_t next_sequence_ = 0;
+
+        // Blocks not currently in the pipeline, with their buffers still
+        // allocated; there are enough for every queue slot and every thread,
+        // so in steady state no Block storage is allocated per block
+        BoundedQueue<BlockPointer> free_blocks_;
+        BoundedQueue<BlockPointer> convert_queue_;
+        BoundedQueue<BlockPointer> sync_queue_;
+        BoundedQueue<BlockPointer> fec_queue_;
 
-        PhaseBuffer phase_;
+        std::mutex dispatch_mutex_;
+        std::condition_variable dispatch_cond_;
+        std::uint64_t next_dispatch_ = 0;
+
+        std::vector<std::thread> threads_;
+        bool stopped_ = false;
     };
 
+    // A Receiver that decouples the sample source from demodulation. The
+    // caller's thread (typically an SDR rx thread) only places each buffer on
+    // a lock-free ring; a separate thread takes buffers off the ring and
+    // passes them to another Receiver. HandleSamples never blocks: if the
+    // ring is full the buffer is dropped and counted, and the next buffer
+    // that fits is treated as a discontinuity.
+    class QueuedReceiver : public Receiver {
+      public:
+        QueuedReceiver(std::shared_ptr<Receiver> receiver, std::size_t depth);
+        ~QueuedReceiver();
+
+        void HandleSamples(std::uint64_t timestamp, SampleBuffer::Pointer buffer) override;
+        std::size_t TrailingSamples() override { return receiver_->TrailingSamples(); }
+        void Reset() override;
+        void Stop() override;
+
+      private:
+        struct Item {
+            std::uint64_t timestamp;
+            SampleBuffer::Pointer buffer;
+            bool discontinuity;
+        };
+
+        void DemodThread();
+
+        std::shared_ptr<Receiver> receiver_;
+        SpscRing<Item> ring_;
+        bool dropped_ = false; // producer side: a buffer was dropped since the last successful push
+
+        // used only to wake the demodulation thread when the ring was empty
+        std::mutex mutex_;
+        std::condition_variable cond_;
+        std::atomic<bool> sleeping_{false};
+        std::atomic<bool> halt_{false};
+
+        std::thread thread_;
+        bool stopped_ = false;
+    };
 }; // namespace flightaware::uat
 
 #endif
@@ -9,21 +9,29 @@
 #include <boost/program_options.hpp>
 #include <boost/regex.hpp>
 
+#include <atomic>
+#include <chrono>
+#include <exception>
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <thread>
 
 #include "convert.h"
 #include "demodulator.h"
 #include "exception.h"
+#include "iq_recording.h"
 #include "message_dispatch.h"
 #include "sample_source.h"
 #include "soapy_source.h"
 #include "socket_output.h"
+#include "stats.h"
 
 using namespace flightaware::uat;
 
 namespace po = boost::program_options;
 using boost::asio::ip::tcp;
+using boost::asio::ip::udp;
 
 struct listen_option {
     std::string host;
@@ -32,17 +40,18 @@ struct listen_option {
 
 SampleFormat format;
 
-// Specializations of validate for --xxx-port
+// Specializations of validate for --xxx-port and --udp-output: [host:]port,
+// where an IPv6 address host is written in brackets, [addr]:port
 void validate(boost::any &v, const std::vector<std::string> &values, listen_option *target_type, int) {
     po::validators::check_first_occurrence(v);
     const std::string &s = po::validators::get_single_string(values);
 
-    static const boost::regex r("(?:([^:]+):)?(\\d+)");
+    static const boost::regex r("(?:\\[([^\\]]+)\\]:|([^:\\[\\]]+):)?(\\d+)");
     boost::smatch match;
     if (boost::regex_match(s, match, r)) {
         listen_option o;
-        o.host = match[1];
-        o.port = match[2];
+        o.host = match[1].matched ? match[1] : match[2];
+        o.port = match[3];
         v = boost::any(o);
     } else {
         throw po::validation_error(po::validation_error::invalid_option_value);
@@ -72,6 +81,28 @@ namespace flightaware::uat {
     }
 } // namespace flightaware::uat
 
+// Specializations of validate for --output-overflow
+namespace flightaware::uat {
+    void validate(boost::any &v, const std::vector<std::string> &values, OverflowPolicy *target_type, int) {
+        po::validators::check_first_occurrence(v);
+        const std::string &s = po::validators::get_single_string(values);
+
+        // clang-format off
+        static std::map<std::string, OverflowPolicy> policies = {
+            {"drop-newest", OverflowPolicy::DROP_NEWEST},
+            {"drop-oldest", OverflowPolicy::DROP_OLDEST},
+            {"disconnect", OverflowPolicy::DISCONNECT}
+        };
+        // clang-format on
+
+        auto entry = policies.find(s);
+        if (entry == policies.end())
+            throw po::validation_error(po::validation_error::invalid_option_value);
+
+        v = boost::any(entry->second);
+    }
+} // namespace flightaware::uat
+
 #define EXIT_NO_RESTART (64)
 
 static int realmain(int argc, char **argv) {
@@ -84,7 +115,7 @@ static int realmain(int argc, char **argv) {
         ("version", "show version")
         ("raw-stdout", "write raw messages to stdout")
         ("json-stdout", "write decoded json to stdout")
-        ("format", po::value<SampleFormat>(), "set sample format")
+        ("format", po::value<SampleFormat>(), "set sample format (not needed for a --file written by --record-iq)")
         ("stdin", "read sample data from stdin")
         ("file", po::value<std::string>(), "read sample data from a file")
         ("file-throttle", "throttle file input to realtime")
@@ -95,8 +126,25 @@ static int realmain(int argc, char **argv) {
         ("sdr-antenna", po::value<std::string>(), "set SDR antenna name")
         ("sdr-stream-settings", po::value<std::string>(), "set SDR stream key-value settings")
         ("sdr-device-settings", po::value<std::string>(), "set SDR device key-value settings")
+        ("record-iq", po::value<std::string>(), "record compressed sample data to this file; it can be replayed with --file")
+        ("receiver-threads", po::value<unsigned>()->default_value(1), "number of demodulation threads; 1 demodulates on the sample input thread, 3 or more runs a pipeline of conversion, sync search, and N-2 error correction threads")
+        ("demod-threads", po::value<unsigned>()->default_value(1), "number of threads used to demodulate each block of samples in parallel (only with --receiver-threads 1)")
+        ("squelch", po::value<double>(), "only demodulate sample spans whose power rises at least this many dB above the adaptive noise floor (3 is a reasonable starting point); off by default")
+        ("io-threads", po::value<unsigned>()->default_value(1), "number of threads that handle network clients, timers and file input")
+        ("stats-file", po::value<std::string>(), "periodically write receiver statistics as JSON to this file")
+        ("stats-interval", po::value<unsigned>()->default_value(60), "interval between writes of --stats-file, in seconds")
+        ("sample-queue-depth", po::value<unsigned>()->default_value(32), "with --sdr, number of sample blocks to queue between the SDR and demodulation; blocks that arrive when the queue is full are dropped. 0 demodulates on the SDR thread")
         ("raw-port", po::value<std::vector<listen_option>>(), "listen for connections on [host:]port and provide raw messages")
-        ("json-port", po::value<std::vector<listen_option>>(), "listen for connections on [host:]port and provide decoded json");
+        ("json-port", po::value<std::vector<listen_option>>(), "listen for connections on [host:]port and provide decoded json")
+        ("binary-port", po::value<std::vector<listen_option>>(), "listen for connections on [host:]port and provide raw messages in a compact length-prefixed binary format")
+        ("raw-gzip-port", po::value<std::vector<listen_option>>(), "listen for connections on [host:]port and provide raw messages as a gzip stream")
+        ("json-gzip-port", po::value<std::vector<listen_option>>(), "listen for connections on [host:]port and provide decoded json as a gzip stream")
+        ("gzip-latency", po::value<unsigned>()->default_value(500), "longest time, in milliseconds, that a --raw-gzip-port or --json-gzip-port client's data is held back so that it compresses better; 0 sends every batch at once")
+        ("udp-output", po::value<std::vector<listen_option>>(), "send raw messages in the --binary-port format as sequence-numbered UDP datagrams to host:port; host may be a multicast group, and an IPv6 address is written as [addr]:port")
+        ("udp-ttl", po::value<unsigned>()->default_value(1), "time-to-live of multicast --udp-output datagrams")
+        ("output-backlog", po::value<unsigned>()->default_value(4096), "maximum data, in kB, queued for a --raw-port, --json-port, --binary-port or compressed port client that is not keeping up, or waiting to be sent to a --udp-output address; 0 is unlimited")
+        ("output-backlog-messages", po::value<unsigned>()->default_value(0), "maximum number of messages queued for a --raw-port, --json-port, --binary-port or compressed port client that is not keeping up; 0 is unlimited")
+        ("output-overflow", po::value<OverflowPolicy>(), "what to do when a client's backlog is full: drop-newest (leave new messages out of its output until it catches up; the default), drop-oldest (discard the oldest queued messages to make room), or disconnect");
     // clang-format on
 
     po::variables_map opts;
@@ -143,6 +191,18 @@ static int realmain(int argc, char **argv) {
         assert("impossible case" && false);
     }
 
+    auto io_thread_count = opts["io-threads"].as<unsigned>();
+    if (io_thread_count == 0) {
+        std::cerr << "--io-threads must be at least 1" << std::endl;
+        return EXIT_NO_RESTART;
+    }
+
+    auto receiver_threads = opts["receiver-threads"].as<unsigned>();
+    if (receiver_threads == 0 || receiver_threads == 2) {
+        std::cerr << "--receiver-threads must be 1, or 3 or more" << std::endl;
+        return EXIT_NO_RESTART;
+    }
+
     auto create_output_port = [&](std::string option, SocketListener::ConnectionFactory factory) -> bool {
         if (!opts.count(option)) {
             return true;
@@ -178,39 +238,109 @@ static int realmain(int argc, char **argv) {
         return ok;
     };
 
-    auto raw_ok = create_output_port("raw-port", &RawOutput::Create);
-    auto json_ok = create_output_port("json-port", &JsonOutput::Create);
-    if (!raw_ok || !json_ok) {
+    // each format is encoded once per batch, however many clients there are
+    auto raw_encoder = RawEncoder::Create();
+    auto json_encoder = JsonEncoder::Create();
+    auto binary_encoder = BinaryEncoder::Create();
+
+    OutputLimits limits;
+    limits.max_backlog_bytes = opts["output-backlog"].as<unsigned>() * std::size_t(1024);
+    limits.max_backlog_messages = opts["output-backlog-messages"].as<unsigned>();
+    if (opts.count("output-overflow")) {
+        limits.policy = opts["output-overflow"].as<OverflowPolicy>();
+    }
+
+    OutputCompression uncompressed;
+    OutputCompression gzip;
+    gzip.enabled = true;
+    gzip.latency = std::chrono::milliseconds(opts["gzip-latency"].as<unsigned>());
+
+    using std::placeholders::_1;
+    using std::placeholders::_2;
+    auto raw_ok = create_output_port("raw-port", std::bind(&RawOutput::Create, _1, _2, raw_encoder, limits, uncompressed));
+    auto json_ok = create_output_port("json-port", std::bind(&JsonOutput::Create, _1, _2, json_encoder, limits, uncompressed));
+    auto binary_ok = create_output_port("binary-port", std::bind(&BinaryOutput::Create, _1, _2, binary_encoder, limits));
+    auto raw_gzip_ok = create_output_port("raw-gzip-port", std::bind(&RawOutput::Create, _1, _2, raw_encoder, limits, gzip));
+    auto json_gzip_ok = create_output_port("json-gzip-port", std::bind(&JsonOutput::Create, _1, _2, json_encoder, limits, gzip));
+    if (!raw_ok || !json_ok || !binary_ok || !raw_gzip_ok || !json_gzip_ok) {
         return 1;
     }
 
-    if (opts.count("raw-stdout")) {
-        dispatch.AddClient([](SharedMessageVector messages) {
-            for (const auto &message : *messages) {
-                std::cout << message << std::endl;
+    if (opts.count("udp-output")) {
+        for (auto l : opts["udp-output"].as<std::vector<listen_option>>()) {
+            if (l.host.empty()) {
+                std::cerr << "udp-output: a host is required, as host:port" << std::endl;
+                return EXIT_NO_RESTART;
             }
-        });
+
+            udp::resolver udp_resolver(io_service);
+            boost::system::error_code ec;
+            auto i = udp_resolver.resolve(udp::resolver::query(l.host, l.port), ec);
+            if (ec) {
+                std::cerr << "udp-output: could not resolve " << l.host << ":" << l.port << ": " << ec.message() << std::endl;
+                return 1;
+            }
+
+            const udp::endpoint endpoint = *i;
+            try {
+                auto output = UdpOutput::Create(io_service, endpoint, binary_encoder, opts["udp-ttl"].as<unsigned>(), limits.max_backlog_bytes);
+                output->Start();
+                dispatch.AddClient(std::bind(&UdpOutput::Write, output, _1));
+                std::cerr << "udp-output: sending datagrams to " << endpoint << std::endl;
+            } catch (boost::system::system_error &err) {
+                std::cerr << "udp-output: could not send to " << endpoint << ": " << err.what() << std::endl;
+                return 1;
+            }
+        }
+    }
+
+    if (opts.count("raw-stdout")) {
+        dispatch.AddClient([raw_encoder](SharedMessageBatch batch) { std::cout << raw_encoder->Encode(*batch)->data << std::flush; });
     }
 
     if (opts.count("json-stdout")) {
-        dispatch.AddClient([](SharedMessageVector messages) {
-            for (const auto &message : *messages) {
-                if (message.Type() == MessageType::DOWNLINK_SHORT || message.Type() == MessageType::DOWNLINK_LONG) {
-                    std::cout << AdsbMessage(message).ToJson() << std::endl;
-                }
-            }
-        });
+        dispatch.AddClient([json_encoder](SharedMessageBatch batch) { std::cout << json_encoder->Encode(*batch)->data << std::flush; });
     }
 
     source->Init();
     auto format = source->Format();
 
-    auto receiver = std::make_shared<SingleThreadReceiver>(format);
+    Squelch::Pointer squelch;
+    if (opts.count("squelch")) {
+        squelch = Squelch::Create(format, opts["squelch"].as<double>());
+    }
+
+    std::shared_ptr<Receiver> receiver;
+    if (receiver_threads == 1) {
+        receiver = std::make_shared<SingleThreadReceiver>(format, opts["demod-threads"].as<unsigned>(), std::move(squelch));
+    } else {
+        receiver = std::make_shared<PipelinedReceiver>(format, receiver_threads - 2, std::move(squelch));
+    }
+
+    // Decouple SDR reads from demodulation so that a slow block costs a
+    // counted, dropped block rather than a driver overrun. File and stdin
+    // input can simply wait for the receiver.
+    auto sample_queue_depth = opts["sample-queue-depth"].as<unsigned>();
+    if (opts.count("sdr") && sample_queue_depth > 0) {
+        receiver = std::make_shared<QueuedReceiver>(receiver, sample_queue_depth);
+    }
     receiver->SetConsumer(std::bind(&MessageDispatch::Dispatch, &dispatch, std::placeholders::_1));
 
-    bool saw_error = false;
+    IqRecorder::Pointer recorder;
+    if (opts.count("record-iq")) {
+        // only a live SDR has overruns to avoid by dropping blocks
+        recorder = IqRecorder::Create(opts["record-iq"].as<std::string>(), format, opts.count("sdr") > 0);
+        recorder->Start();
+    }
+
+    // set from the sample source and signal handlers, which may run on
+    // any io thread
+    std::atomic<bool> saw_error{false};
 
-    source->SetConsumer([&io_service, &saw_error, receiver](std::uint64_t timestamp, const Bytes &buffer, const boost::system::error_code &ec) {
+    // the recorder shares buffers with the receiver, relying on this
+    // headroom so that they are never reallocated
+    source->SetHeadroom(receiver->TrailingSamples());
+    source->SetConsumer([&io_service, &saw_error, receiver, recorder, format](std::uint64_t timestamp, SampleBuffer::Pointer buffer, const boost::system::error_code &ec) {
         if (ec) {
             if (ec == boost::asio::error::eof) {
                 std::cerr << "Sample source reports EOF" << std::endl;
@@ -220,10 +350,23 @@ static int realmain(int argc, char **argv) {
             }
             io_service.stop();
         } else {
-            receiver->HandleSamples(timestamp, buffer.begin(), buffer.end());
+            auto &stats = Stats::Global();
+            stats.samples_received += buffer->Size() / BytesPerSample(format);
+            ++stats.sample_blocks;
+            if (recorder) {
+                recorder->Record(timestamp, buffer);
+            }
+            receiver->HandleSamples(timestamp, std::move(buffer));
         }
     });
 
+    StatsWriter::Pointer stats_writer;
+    if (opts.count("stats-file")) {
+        auto interval = std::max(1U, opts["stats-interval"].as<unsigned>());
+        stats_writer = StatsWriter::Create(io_service, opts["stats-file"].as<std::string>(), std::chrono::seconds(interval));
+        stats_writer->Start();
+    }
+
     boost::asio::signal_set signals(io_service, SIGINT, SIGTERM);
     signals.async_wait([&io_service, &saw_error](const boost::system::error_code &ec, int signum) {
         std::cerr << "Caught signal " << signum << ", exiting" << std::endl;
@@ -233,9 +376,74 @@ static int realmain(int argc, char **argv) {
 
     source->Start();
 
-    io_service.run();
+    // Each SocketOutput and SocketListener serializes its own work on a
+    // strand, so the io_service can run on a pool of threads, with this
+    // thread as one of them. An exception escaping a pool thread stops
+    // everything and is rethrown here.
+    std::vector<std::thread> io_threads;
+    std::exception_ptr io_exception;
+    std::mutex io_exception_mutex;
+    for (unsigned i = 1; i < io_thread_count; ++i) {
+        io_threads.emplace_back([&io_service, &io_exception, &io_exception_mutex]() {
+            try {
+                io_service.run();
+            } catch (...) {
+                std::unique_lock<std::mutex> lock(io_exception_mutex);
+                if (!io_exception) {
+                    io_exception = std::current_exception();
+                }
+                io_service.stop();
+            }
+        });
+    }
+
+    try {
+        io_service.run();
+    } catch (...) {
+        io_service.stop();
+        for (auto &t : io_threads) {
+            t.join();
+        }
+        throw;
+    }
+
+    for (auto &t : io_threads) {
+        t.join();
+    }
+    if (io_exception) {
+        std::rethrow_exception(io_exception);
+    }
 
+    // Stopping the receiver finishes any queued sample blocks, and the
+    // resulting messages are posted to the outputs' strands. Run the
+    // io_service again until the outputs go quiet so that they are
+    // actually sent. Idle must outlast --gzip-latency, or data held back in
+    // a compressor would never be flushed.
     source->Stop();
+    receiver->Stop();
+
+    const auto flush_idle = std::chrono::milliseconds(100) + (opts.count("raw-gzip-port") || opts.count("json-gzip-port") ? gzip.latency : std::chrono::milliseconds(0));
+    const auto flush_deadline = std::chrono::steady_clock::now() + flush_idle + std::chrono::seconds(5);
+    io_service.reset();
+    for (auto last_work = std::chrono::steady_clock::now(); !io_service.stopped();) {
+        const auto now = std::chrono::steady_clock::now();
+        if (now >= flush_deadline) {
+            break;
+        } else if (io_service.poll() > 0) {
+            last_work = now;
+        } else if (now - last_work >= flush_idle) {
+            break;
+        } else {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+
+    if (recorder) {
+        recorder->Stop();
+    }
+    if (stats_writer) {
+        stats_writer->Stop();
+    }
 
     if (saw_error) {
         std::cerr << "Abnormal exit" << std::endl;
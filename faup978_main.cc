@@ -25,15 +25,16 @@ struct connect_option {
     std::string port;
 };
 
-// Specializations of validate for --connect
+// Specializations of validate for --connect and --udp: [host:]port, where
+// an IPv6 address host is written in brackets, [addr]:port
 void validate(boost::any &v, const std::vector<std::string> &values, connect_option *target_type, int) {
     po::validators::check_first_occurrence(v);
     const std::string &s = po::validators::get_single_string(values);
 
-    static const boost::regex r("(?:([^:]+):)?(\\d+)");
+    static const boost::regex r("(?:\\[([^\\]]+)\\]:|([^:\\[\\]]+):)?(\\d+)");
     boost::smatch match;
     if (boost::regex_match(s, match, r)) {
-        v = boost::any(connect_option{match[1], match[2]});
+        v = boost::any(connect_option{match[1].matched ? match[1] : match[2], match[3]});
     } else {
         throw po::validation_error(po::validation_error::invalid_option_value);
     }
@@ -49,7 +50,10 @@ static int realmain(int argc, char **argv) {
     desc.add_options()
         ("help", "produce help message")
         ("version", "show version")
-        ("connect", po::value<connect_option>(), "connect to host:port for raw UAT data");
+        ("connect", po::value<connect_option>(), "connect to host:port for raw UAT data")
+        ("binary", "the --connect port provides the binary format of dump978-fa --binary-port, not the raw text format")
+        ("gzip", "the --connect port provides a gzip stream, as from dump978-fa --raw-gzip-port")
+        ("udp", po::value<connect_option>(), "instead of --connect, receive the datagrams of dump978-fa --udp-output on [group:]port, joining the group if it is a multicast address; write an IPv6 group as [addr]:port");
     // clang-format on
 
     po::variables_map opts;
@@ -74,13 +78,19 @@ static int realmain(int argc, char **argv) {
         return EXIT_NO_RESTART;
     }
 
-    if (!opts.count("connect")) {
-        std::cerr << "--connect option is required" << std::endl;
+    if (!opts.count("connect") && !opts.count("udp")) {
+        std::cerr << "--connect or --udp option is required" << std::endl;
         return EXIT_NO_RESTART;
     }
 
-    auto connect = opts["connect"].as<connect_option>();
-    auto input = RawInput::Create(io_service, connect.host, connect.port);
+    SocketInput::Pointer input;
+    if (opts.count("udp")) {
+        auto udp = opts["udp"].as<connect_option>();
+        input = UdpInput::Create(io_service, udp.host, udp.port);
+    } else {
+        auto connect = opts["connect"].as<connect_option>();
+        input = opts.count("binary") ? BinaryInput::Create(io_service, connect.host, connect.port, std::chrono::milliseconds(0), opts.count("gzip")) : RawInput::Create(io_service, connect.host, connect.port, std::chrono::milliseconds(0), opts.count("gzip"));
+    }
     auto reporter = Reporter::Create(io_service);
 
     input->SetConsumer(std::bind(&Reporter::HandleMessages, reporter, std::placeholders::_1));
@@ -5,6 +5,12 @@
 #include "fec.h"
 #include "uat_protocol.h"
 
+#include <algorithm>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <tmmintrin.h>
+#endif
+
 extern "C" {
 #include "fec/rs.h"
 }
@@ -14,17 +20,55 @@ using namespace flightaware::uat::fec;
 
 FEC::FEC(void) {
     rs_downlink_short_ = ::init_rs_char(
-        /* symsize */ 8, /* gfpoly */ DOWNLINK_SHORT_POLY, /* fcr */ 120,
-        /* prim */ 1, /* nroots */ DOWNLINK_SHORT_ROOTS,
+        /* symsize */ 8, /* gfpoly */ DOWNLINK_SHORT_POLY, /* fcr */ FCR,
+        /* prim */ PRIM, /* nroots */ DOWNLINK_SHORT_ROOTS,
         /* pad */ DOWNLINK_SHORT_PAD);
     rs_downlink_long_ = ::init_rs_char(
-        /* symsize */ 8, /* gfpoly */ DOWNLINK_LONG_POLY, /* fcr */ 120,
-        /* prim */ 1, /* nroots */ DOWNLINK_LONG_ROOTS,
+        /* symsize */ 8, /* gfpoly */ DOWNLINK_LONG_POLY, /* fcr */ FCR,
+        /* prim */ PRIM, /* nroots */ DOWNLINK_LONG_ROOTS,
         /* pad */ DOWNLINK_LONG_PAD);
     rs_uplink_ = ::init_rs_char(/* symsize */ 8, /* gfpoly */ UPLINK_BLOCK_POLY,
-                                /* fcr */ 120, /* prim */ 1,
+                                /* fcr */ FCR, /* prim */ PRIM,
                                 /* nroots */ UPLINK_BLOCK_ROOTS,
                                 /* pad */ UPLINK_BLOCK_PAD);
+
+    // Build GF(256) multiply-by-root tables for the syndrome check
+    static_assert(DOWNLINK_SHORT_POLY == UPLINK_BLOCK_POLY && DOWNLINK_LONG_POLY == UPLINK_BLOCK_POLY, "syndrome tables assume all codes use the same field");
+    static_assert(DOWNLINK_SHORT_ROOTS <= UPLINK_BLOCK_ROOTS && DOWNLINK_LONG_ROOTS <= UPLINK_BLOCK_ROOTS, "syndrome tables are sized for the uplink code");
+
+    std::array<unsigned, 255> alpha_to; // alpha^i
+    std::array<unsigned, 256> index_of; // log_alpha(x), for x != 0
+    unsigned sr = 1;
+    for (unsigned i = 0; i < 255; ++i) {
+        alpha_to[i] = sr;
+        index_of[sr] = i;
+        sr <<= 1;
+        if (sr & 0x100)
+            sr ^= UPLINK_BLOCK_POLY;
+    }
+
+    // multiply x by alpha^log_c
+    auto gf_mul = [&alpha_to, &index_of](unsigned x, unsigned log_c) -> std::uint8_t { return x ? alpha_to[(index_of[x] + log_c) % 255] : 0; };
+
+    for (unsigned i = 0; i < UPLINK_BLOCK_ROOTS; ++i) {
+        const unsigned root = (FCR + i * PRIM) % 255;
+        const unsigned join = (root * (UPLINK_BLOCK_BYTES / 2)) % 255;
+        for (unsigned x = 0; x < 256; ++x) {
+            syndrome_mul_[i][x] = gf_mul(x, root);
+        }
+        for (unsigned n = 0; n < 16; ++n) {
+            uplink_step_[i].lo[n] = gf_mul(n, root);
+            uplink_step_[i].hi[n] = gf_mul(n << 4, root);
+            uplink_join_[i].lo[n] = gf_mul(n, join);
+            uplink_join_[i].hi[n] = gf_mul(n << 4, join);
+        }
+    }
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    use_ssse3_ = __builtin_cpu_supports("ssse3");
+#else
+    use_ssse3_ = false;
+#endif
 }
 
 FEC::~FEC(void) {
@@ -33,32 +77,127 @@ FEC::~FEC(void) {
     ::free_rs_char(rs_uplink_);
 }
 
-std::tuple<bool, Bytes, unsigned> FEC::CorrectDownlink(const Bytes &raw, const std::vector<std::size_t> &erasures) {
-    using R = std::tuple<bool, Bytes, unsigned>;
+bool FEC::IsCodeword(const std::uint8_t *data, std::size_t n, unsigned nroots) const {
+    // Evaluate data(x) at each root of the generator polynomial (Horner's
+    // rule, one table lookup per byte per root)
+    std::array<std::uint8_t, UPLINK_BLOCK_ROOTS> syndromes{};
+    for (std::size_t j = 0; j < n; ++j) {
+        for (unsigned i = 0; i < nroots; ++i) {
+            syndromes[i] = syndrome_mul_[i][syndromes[i]] ^ data[j];
+        }
+    }
 
-    if (raw.size() != DOWNLINK_LONG_BYTES) {
-        return R{false, {}, 0};
+    std::uint8_t any = 0;
+    for (unsigned i = 0; i < nroots; ++i) {
+        any |= syndromes[i];
     }
+    return (any == 0);
+}
+
+unsigned FEC::UplinkCodewords(const MessageBuffer &raw) const {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    if (use_ssse3_)
+        return UplinkCodewordsSSSE3(raw);
+#endif
+    return UplinkCodewordsScalar(raw);
+}
+
+unsigned FEC::UplinkCodewordsScalar(const MessageBuffer &raw) const {
+    // as IsCodeword, for all blocks at once; raw[j * BLOCKS + block] is byte
+    // j of each block, so no deinterleaving is needed
+    std::array<std::array<std::uint8_t, UPLINK_BLOCK_ROOTS>, UPLINK_BLOCKS_PER_FRAME> syndromes{};
+    for (unsigned j = 0; j < UPLINK_BLOCK_BYTES; ++j) {
+        for (unsigned block = 0; block < UPLINK_BLOCKS_PER_FRAME; ++block) {
+            const auto data = raw[j * UPLINK_BLOCKS_PER_FRAME + block];
+            auto &s = syndromes[block];
+            for (unsigned i = 0; i < UPLINK_BLOCK_ROOTS; ++i) {
+                s[i] = syndrome_mul_[i][s[i]] ^ data;
+            }
+        }
+    }
+
+    unsigned codewords = 0;
+    for (unsigned block = 0; block < UPLINK_BLOCKS_PER_FRAME; ++block) {
+        std::uint8_t any = 0;
+        for (auto s : syndromes[block]) {
+            any |= s;
+        }
+        if (!any)
+            codewords |= 1 << block;
+    }
+    return codewords;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+__attribute__((target("ssse3"))) static inline __m128i GFMultiply(__m128i x, const std::array<std::uint8_t, 16> &lo, const std::array<std::uint8_t, 16> &hi) {
+    const auto mask = _mm_set1_epi8(0x0F);
+    const auto lo_table = _mm_loadu_si128(reinterpret_cast<const __m128i *>(lo.data()));
+    const auto hi_table = _mm_loadu_si128(reinterpret_cast<const __m128i *>(hi.data()));
+    return _mm_xor_si128(_mm_shuffle_epi8(lo_table, _mm_and_si128(x, mask)), _mm_shuffle_epi8(hi_table, _mm_and_si128(_mm_srli_epi16(x, 4), mask)));
+}
 
-    if (erasures.size() > DOWNLINK_LONG_ROOTS) {
+__attribute__((target("ssse3"))) unsigned FEC::UplinkCodewordsSSSE3(const MessageBuffer &raw) const {
+    // Each vector holds one syndrome for all six blocks, twice over: lanes
+    // 0-5 accumulate the first half of each block (bytes 0..45), lanes 8-13
+    // the second half (bytes 46..91). Every lane is multiplied by the same
+    // root at each step, so a single pair of nibble tables serves them all.
+    // The halves are joined at the end: S = S_first * root^46 + S_second.
+    // Lanes 6, 7, 14 and 15 carry junk and are ignored.
+    const unsigned HALF = UPLINK_BLOCK_BYTES / 2;
+    const unsigned STRIDE = UPLINK_BLOCKS_PER_FRAME;
+    static_assert(UPLINK_BLOCK_BYTES % 2 == 0 && UPLINK_BLOCKS_PER_FRAME <= 8, "lane layout assumes even-length blocks and at most 8 blocks");
+
+    // Gather the data once, in the lane layout, for reuse by every root.
+    // The final step is copied, as an 8-byte load there would overrun.
+    __m128i data[HALF];
+    for (unsigned j = 0; j < HALF - 1; ++j) {
+        data[j] = _mm_unpacklo_epi64(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(&raw[j * STRIDE])), _mm_loadl_epi64(reinterpret_cast<const __m128i *>(&raw[(j + HALF) * STRIDE])));
+    }
+    alignas(16) std::array<std::uint8_t, 16> last{};
+    std::copy(&raw[(HALF - 1) * STRIDE], &raw[HALF * STRIDE], last.begin());
+    std::copy(&raw[(2 * HALF - 1) * STRIDE], &raw[2 * HALF * STRIDE], last.begin() + 8);
+    data[HALF - 1] = _mm_load_si128(reinterpret_cast<const __m128i *>(last.data()));
+
+    auto any = _mm_setzero_si128();
+    for (unsigned i = 0; i < UPLINK_BLOCK_ROOTS; ++i) {
+        const auto &step = uplink_step_[i];
+        auto s = _mm_setzero_si128();
+        for (unsigned j = 0; j < HALF; ++j) {
+            s = _mm_xor_si128(GFMultiply(s, step.lo, step.hi), data[j]);
+        }
+
+        const auto joined = _mm_xor_si128(GFMultiply(s, uplink_join_[i].lo, uplink_join_[i].hi), _mm_srli_si128(s, 8));
+        any = _mm_or_si128(any, joined);
+    }
+
+    const unsigned zero_lanes = _mm_movemask_epi8(_mm_cmpeq_epi8(any, _mm_setzero_si128()));
+    return zero_lanes & ((1U << UPLINK_BLOCKS_PER_FRAME) - 1);
+}
+#endif
+
+bool FEC::CorrectDownlink(const MessageBuffer &raw, const ErasureList &erasures, CorrectedMessage &out) {
+    if (erasures.count > DOWNLINK_LONG_ROOTS) {
         // too many
-        return R{false, {}, 0};
+        return false;
     }
 
     // Try decoding as a Long UAT.
-    Bytes corrected;
-    std::copy(raw.begin(), raw.end(), std::back_inserter(corrected));
+    auto &corrected = out.data;
+    std::copy(raw.begin(), raw.begin() + DOWNLINK_LONG_BYTES, corrected.begin());
 
     int erasures_array[DOWNLINK_LONG_ROOTS];
-    for (std::size_t i = 0; i < erasures.size(); ++i) {
-        erasures_array[i] = erasures[i] + DOWNLINK_LONG_PAD;
-        corrected[erasures[i]] = 0;
+    for (std::size_t i = 0; i < erasures.count; ++i) {
+        erasures_array[i] = erasures.index[i] + DOWNLINK_LONG_PAD;
+        corrected[erasures.index[i]] = 0;
     }
-    int n_corrected = ::decode_rs_char(rs_downlink_long_, corrected.data(), erasures_array, erasures.size());
+    // If the data is already a codeword, decode_rs_char would return 0
+    // without changing anything, so skip it
+    int n_corrected = IsCodeword(corrected.data(), DOWNLINK_LONG_BYTES, DOWNLINK_LONG_ROOTS) ? 0 : ::decode_rs_char(rs_downlink_long_, corrected.data(), erasures_array, erasures.count);
     if (n_corrected >= 0 && n_corrected <= DOWNLINK_LONG_ROOTS && (corrected[0] >> 3) != 0) {
         // Valid long frame.
-        corrected.resize(DOWNLINK_LONG_DATA_BYTES);
-        return R{true, std::move(corrected), n_corrected};
+        out.size = DOWNLINK_LONG_DATA_BYTES;
+        out.errors = n_corrected;
+        return true;
     }
 
     // Retry as Basic UAT
@@ -67,7 +206,8 @@ std::tuple<bool, Bytes, unsigned> FEC::CorrectDownlink(const Bytes &raw, const s
 
     // Only pass in erasures that lie within the short message length
     int short_erasures = 0;
-    for (auto e : erasures) {
+    for (std::size_t i = 0; i < erasures.count; ++i) {
+        auto e = erasures.index[i];
         if (e < DOWNLINK_SHORT_BYTES) {
             if (short_erasures < DOWNLINK_SHORT_ROOTS) {
                 erasures_array[short_erasures] = e + DOWNLINK_SHORT_PAD;
@@ -78,71 +218,77 @@ std::tuple<bool, Bytes, unsigned> FEC::CorrectDownlink(const Bytes &raw, const s
 
     if (short_erasures > DOWNLINK_SHORT_ROOTS) {
         // too many
-        return R{false, {}, 0};
+        return false;
     }
 
-    n_corrected = ::decode_rs_char(rs_downlink_short_, corrected.data(), erasures_array, short_erasures);
+    n_corrected = IsCodeword(corrected.data(), DOWNLINK_SHORT_BYTES, DOWNLINK_SHORT_ROOTS) ? 0 : ::decode_rs_char(rs_downlink_short_, corrected.data(), erasures_array, short_erasures);
     if (n_corrected >= 0 && n_corrected <= DOWNLINK_SHORT_ROOTS && (corrected[0] >> 3) == 0) {
         // Valid short frame
-        corrected.resize(DOWNLINK_SHORT_DATA_BYTES);
-        return R{true, std::move(corrected), n_corrected};
+        out.size = DOWNLINK_SHORT_DATA_BYTES;
+        out.errors = n_corrected;
+        return true;
     }
 
     // Failed.
-    return R{false, {}, 0};
+    return false;
 }
 
-std::tuple<bool, Bytes, unsigned> FEC::CorrectUplink(const Bytes &raw, const std::vector<std::size_t> &erasures) {
-    using R = std::tuple<bool, Bytes, unsigned>;
-
-    if (raw.size() != UPLINK_BYTES) {
-        return R{false, {}, 0};
-    }
-
+bool FEC::CorrectUplink(const MessageBuffer &raw, const ErasureList &erasures, CorrectedMessage &out) {
     // uplink messages consist of 6 blocks, interleaved; each block consists of a
     // data section then an ECC section; we need to deinterleave, check/correct
     // the data, then join the blocks removing the ECC sections.
-    unsigned total_errors = 0;
-    Bytes corrected;
-    Bytes blockdata;
+    //
+    // Bucket the erasures by block first, so that a message with too many
+    // erasures in any block is rejected before any decoding is done.
+    int block_erasures[UPLINK_BLOCKS_PER_FRAME][UPLINK_BLOCK_ROOTS];
+    int num_erasures[UPLINK_BLOCKS_PER_FRAME] = {0};
+    for (std::size_t i = 0; i < erasures.count; ++i) {
+        auto index = erasures.index[i];
+        auto block = index % UPLINK_BLOCKS_PER_FRAME;
+        if (num_erasures[block] >= UPLINK_BLOCK_ROOTS) {
+            // too many erasures in this block
+            return false;
+        }
+        block_erasures[block][num_erasures[block]++] = index / UPLINK_BLOCKS_PER_FRAME + UPLINK_BLOCK_PAD;
+    }
 
-    corrected.reserve(UPLINK_DATA_BYTES);
-    blockdata.resize(UPLINK_BLOCK_BYTES);
+    // Deinterleave the data sections of all blocks in a single pass over
+    // `raw`; this is the final result for every block that has no errors.
+    for (unsigned i = 0; i < UPLINK_BLOCK_DATA_BYTES; ++i) {
+        for (unsigned block = 0; block < UPLINK_BLOCKS_PER_FRAME; ++block) {
+            out.data[block * UPLINK_BLOCK_DATA_BYTES + i] = raw[i * UPLINK_BLOCKS_PER_FRAME + block];
+        }
+    }
+
+    // Only blocks that are not already codewords go to the full decoder
+    const unsigned codewords = UplinkCodewords(raw);
+
+    unsigned total_errors = 0;
+    std::array<std::uint8_t, UPLINK_BLOCK_BYTES> blockdata;
 
     for (unsigned block = 0; block < UPLINK_BLOCKS_PER_FRAME; ++block) {
+        if (codewords & (1U << block))
+            continue;
+
         // deinterleave
         for (unsigned i = 0; i < UPLINK_BLOCK_BYTES; ++i) {
             blockdata[i] = raw[i * UPLINK_BLOCKS_PER_FRAME + block];
         }
 
-        // build erasures for this block
-        int block_erasures[UPLINK_BLOCK_ROOTS];
-        int num_erasures = 0;
-        for (auto index : erasures) {
-            if (index % UPLINK_BLOCKS_PER_FRAME == block) {
-                if (num_erasures < UPLINK_BLOCK_ROOTS)
-                    block_erasures[num_erasures] = index / UPLINK_BLOCKS_PER_FRAME + UPLINK_BLOCK_PAD;
-                num_erasures++;
-            }
-        }
-
-        // too many erasures in this block?
-        if (num_erasures > UPLINK_BLOCK_ROOTS) {
-            return R{false, {}, 0};
-        }
-
         // error-correct
-        int n_corrected = ::decode_rs_char(rs_uplink_, blockdata.data(), block_erasures, num_erasures);
+        int n_corrected = ::decode_rs_char(rs_uplink_, blockdata.data(), block_erasures[block], num_erasures[block]);
         if (n_corrected < 0 || n_corrected > UPLINK_BLOCK_ROOTS) {
             // Failed
-            return R{false, {}, 0};
+            return false;
         }
 
         total_errors += n_corrected;
 
         // copy the data into the right place
-        std::copy(blockdata.begin(), blockdata.begin() + UPLINK_BLOCK_DATA_BYTES, std::back_inserter(corrected));
+        std::copy(blockdata.begin(), blockdata.begin() + UPLINK_BLOCK_DATA_BYTES, out.data.begin() + block * UPLINK_BLOCK_DATA_BYTES);
     }
 
-    return R{true, std::move(corrected), total_errors};
+    out.size = UPLINK_DATA_BYTES;
+    out.errors = total_errors;
+    return true;
 }
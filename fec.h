@@ -7,11 +7,31 @@
 #ifndef UAT_FEC_H
 #define UAT_FEC_H
 
-#include <tuple>
+#include <array>
 
 #include "common.h"
+#include "uat_protocol.h"
 
 namespace flightaware::uat {
+    // A caller-owned buffer large enough to hold any raw (demodulated) or
+    // corrected message, so that error correction needs no heap allocation.
+    typedef std::array<std::uint8_t, UPLINK_BYTES> MessageBuffer;
+
+    // A caller-owned list of erasures: indexes into a raw MessageBuffer of
+    // bytes that should be treated as unreliable. Only the first `count`
+    // entries of `index` are used.
+    struct ErasureList {
+        std::array<std::uint16_t, UPLINK_BYTES> index;
+        std::size_t count = 0;
+    };
+
+    // The output of error correction.
+    struct CorrectedMessage {
+        MessageBuffer data; // corrected data with FEC bits removed
+        std::size_t size;   // number of valid bytes in `data`
+        unsigned errors;    // number of errors corrected
+    };
+
     // Deinterleaving and error-correction of UAT messages.
     // This delegates to the "fec" library (in fec/) for the actual Reed-Solomon
     // error-correction work.
@@ -20,30 +40,53 @@ namespace flightaware::uat {
         FEC();
         ~FEC();
 
-        // Given DOWNLINK_LONG_BYTES of demodulated data, returns a tuple of:
-        //    bool     - true if the message is good, false if it was uncorrectable.
-        //    Bytes    - a buffer containing the corrected data with FEC bits removed;
-        //               this will be either DOWNLINK_SHORT_DATA_BYTES or
-        //               DOWNLINK_LONG_DATA_BYTES in size depending on the detected
-        //               message type. Empty if the message was uncorrectable.
-        //    unsigned - the number of errors corrected. 0 if the message was
-        //    uncorrectable
-        // `erasures` is an optional vector of indexes into `raw` that should be
-        // handled as erasures
-        std::tuple<bool, Bytes, unsigned> CorrectDownlink(const Bytes &raw, const std::vector<std::size_t> &erasures = {});
-
-        // Given UPLINK_BYTES of demodulated data, returns a tuple of:
-        //    bool     - true if the message is good, false if it was uncorrectable.
-        //    Bytes    - a buffer containing the deinterleaved, corrected data with
-        //               FEC bits removed; this will be exactly UPLINK_DATA_BYTES
-        //               in size.  Empty if the message was uncorrectable.
-        //    unsigned - the number of errors corrected. 0 if the message was
-        //    uncorrectable
-        // `erasures` is an optional vector of indexes into `raw` that should be
-        // handled as erasures
-        std::tuple<bool, Bytes, unsigned> CorrectUplink(const Bytes &raw, const std::vector<std::size_t> &erasures = {});
+        // Given DOWNLINK_LONG_BYTES of demodulated data in `raw`, try to
+        // correct it. Returns true if the message is good, and fills in `out`:
+        // out.size will be either DOWNLINK_SHORT_DATA_BYTES or
+        // DOWNLINK_LONG_DATA_BYTES depending on the detected message type.
+        // Returns false if the message was uncorrectable (`out` is then
+        // undefined). `erasures` lists indexes into `raw` that should be
+        // handled as erasures.
+        bool CorrectDownlink(const MessageBuffer &raw, const ErasureList &erasures, CorrectedMessage &out);
+
+        // Given UPLINK_BYTES of demodulated data in `raw`, try to
+        // deinterleave and correct it. Returns true if the message is good,
+        // and fills in `out`: out.size will be exactly UPLINK_DATA_BYTES.
+        // Returns false if the message was uncorrectable (`out` is then
+        // undefined). `erasures` lists indexes into `raw` that should be
+        // handled as erasures.
+        bool CorrectUplink(const MessageBuffer &raw, const ErasureList &erasures, CorrectedMessage &out);
 
       private:
+        // Return true if all `nroots` syndromes of the `n` bytes at `data` are
+        // zero, i.e. the data is already a valid codeword. This is much
+        // cheaper than decode_rs_char, which need only run if it fails.
+        bool IsCodeword(const std::uint8_t *data, std::size_t n, unsigned nroots) const;
+
+        // Return a mask with bit N set if uplink block N of the (still
+        // interleaved) `raw` data is already a valid codeword. All blocks are
+        // checked together, straight from the interleaved data.
+        unsigned UplinkCodewords(const MessageBuffer &raw) const;
+        unsigned UplinkCodewordsScalar(const MessageBuffer &raw) const;
+        unsigned UplinkCodewordsSSSE3(const MessageBuffer &raw) const;
+
+        // syndrome_mul_[i][x] is x * alpha^(FCR + i*PRIM) in GF(256)
+        std::array<std::array<std::uint8_t, 256>, fec::UPLINK_BLOCK_ROOTS> syndrome_mul_;
+
+        // Multiply-by-constant tables split by nibble, for use with a vector
+        // byte shuffle: x * c == lo[x & 15] ^ hi[x >> 4]
+        struct NibbleTables {
+            std::array<std::uint8_t, 16> lo;
+            std::array<std::uint8_t, 16> hi;
+        };
+
+        // For UplinkCodewordsSSSE3: multiply by alpha^(FCR + i*PRIM) (one
+        // Horner step), and by that raised to the power of half a block
+        // (joining the syndromes of the two halves of a block)
+        std::array<NibbleTables, fec::UPLINK_BLOCK_ROOTS> uplink_step_;
+        std::array<NibbleTables, fec::UPLINK_BLOCK_ROOTS> uplink_join_;
+        bool use_ssse3_;
+
         void *rs_uplink_;
         void *rs_downlink_short_;
         void *rs_downlink_long_;
@@ -0,0 +1,450 @@
+// Copyright (c) 2019, FlightAware LLC.
+// All rights reserved.
+// Licensed under the 2-clause BSD license; see the LICENSE file
+
+#include "iq_recording.h"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <iostream>
+#include <type_traits>
+
+#include <boost/asio/error.hpp>
+
+#include "exception.h"
+#include "stats.h"
+
+using namespace flightaware::uat;
+
+namespace {
+    const char FILE_MAGIC[8] = {'U', 'A', 'T', '9', '7', '8', 'I', 'Q'};
+    const char BLOCK_MAGIC[4] = {'I', 'Q', 'B', 'K'};
+    const char INDEX_MAGIC[4] = {'I', 'Q', 'I', 'X'};
+    const char TRAILER_MAGIC[8] = {'I', 'Q', 'I', 'N', 'D', 'E', 'X', '\0'};
+
+    const std::uint32_t VERSION_1 = 1;
+    const std::size_t FILE_HEADER_SIZE = 32;
+    const std::size_t BLOCK_HEADER_SIZE = 32;
+
+    const std::uint8_t ENCODING_STORED = 0;
+    const std::uint8_t ENCODING_PACKED = 1;
+
+    const std::size_t GROUP_SIZE = 64;
+    const std::uint8_t GROUP_DELTA = 0x80;
+
+    std::uint32_t FormatCode(SampleFormat format) {
+        switch (format) {
+        case SampleFormat::CU8:
+            return 1;
+        case SampleFormat::CS8:
+            return 2;
+        case SampleFormat::CS16H:
+            return 3;
+        case SampleFormat::CF32H:
+            return 4;
+        default:
+            return 0;
+        }
+    }
+
+    SampleFormat FormatFromCode(std::uint32_t code) {
+        switch (code) {
+        case 1:
+            return SampleFormat::CU8;
+        case 2:
+            return SampleFormat::CS8;
+        case 3:
+            return SampleFormat::CS16H;
+        case 4:
+            return SampleFormat::CF32H;
+        default:
+            return SampleFormat::UNKNOWN;
+        }
+    }
+
+    void Put32(Bytes &out, std::uint32_t v) {
+        for (unsigned i = 0; i < 4; ++i)
+            out.push_back((v >> (8 * i)) & 0xFF);
+    }
+
+    void Put64(Bytes &out, std::uint64_t v) {
+        for (unsigned i = 0; i < 8; ++i)
+            out.push_back((v >> (8 * i)) & 0xFF);
+    }
+
+    std::uint32_t Get32(const std::uint8_t *p) { return (std::uint32_t)p[0] | ((std::uint32_t)p[1] << 8) | ((std::uint32_t)p[2] << 16) | ((std::uint32_t)p[3] << 24); }
+
+    std::uint64_t Get64(const std::uint8_t *p) { return (std::uint64_t)Get32(p) | ((std::uint64_t)Get32(p + 4) << 32); }
+
+    // Pack the low `width` bits of each of `values`, LSB first
+    void PackBits(const std::uint32_t *values, std::size_t count, unsigned width, Bytes &out) {
+        std::uint64_t bits = 0;
+        unsigned nbits = 0;
+        for (std::size_t j = 0; j < count; ++j) {
+            bits |= (std::uint64_t)values[j] << nbits;
+            nbits += width;
+            while (nbits >= 8) {
+                out.push_back(bits & 0xFF);
+                bits >>= 8;
+                nbits -= 8;
+            }
+        }
+        if (nbits > 0) {
+            out.push_back(bits & 0xFF);
+        }
+    }
+
+    unsigned BitWidth(std::uint32_t value) { return value ? 32 - __builtin_clz(value) : 0; }
+
+    // Encode `n` components of type T (uint8_t or uint16_t), appending the
+    // result to `out`. Each group starts with a byte holding the packed bit
+    // width, with GROUP_DELTA set if the group is delta-encoded; a
+    // frame-of-reference group follows that with its base value. `bias` is
+    // XORed into every component first, so that signed formats can flip
+    // their sign bit and be ordered like unsigned ones.
+    template <typename T> void EncodeGroups(const T *in, std::size_t n, T bias, Bytes &out) {
+        typedef typename std::make_signed<T>::type S;
+
+        T previous[2] = {0, 0};
+        std::array<std::uint32_t, GROUP_SIZE> deltas;
+        std::array<std::uint32_t, GROUP_SIZE> offsets;
+
+        for (std::size_t i = 0; i < n; i += GROUP_SIZE) {
+            const std::size_t count = std::min(GROUP_SIZE, n - i);
+
+            // GROUP_SIZE is even, so j & 1 selects I or Q
+            std::uint32_t all_deltas = 0;
+            T low = in[i] ^ bias, high = low;
+            for (std::size_t j = 0; j < count; ++j) {
+                const T value = in[i + j] ^ bias;
+                const std::int32_t delta = (S)(T)(value - previous[j & 1]);
+                previous[j & 1] = value;
+                deltas[j] = ((std::uint32_t)delta << 1) ^ (std::uint32_t)(delta >> 31);
+                all_deltas |= deltas[j];
+                low = std::min(low, value);
+                high = std::max(high, value);
+            }
+
+            // the frame-of-reference base costs sizeof(T) bytes
+            const unsigned delta_width = BitWidth(all_deltas);
+            const unsigned offset_width = BitWidth(high - low);
+            if (count * delta_width <= count * offset_width + 8 * sizeof(T)) {
+                out.push_back(GROUP_DELTA | delta_width);
+                PackBits(deltas.data(), count, delta_width, out);
+            } else {
+                out.push_back(offset_width);
+                for (unsigned k = 0; k < sizeof(T); ++k)
+                    out.push_back((low >> (8 * k)) & 0xFF);
+                for (std::size_t j = 0; j < count; ++j)
+                    offsets[j] = (T)(in[i + j] ^ bias) - low;
+                PackBits(offsets.data(), count, offset_width, out);
+            }
+        }
+    }
+
+    // Reverse EncodeGroups, writing exactly `n` components to `out`. Returns
+    // false if `in` .. `end` is not a valid encoding of that many components.
+    template <typename T> bool DecodeGroups(const std::uint8_t *in, const std::uint8_t *end, T bias, T *out, std::size_t n) {
+        T previous[2] = {0, 0};
+
+        for (std::size_t i = 0; i < n; i += GROUP_SIZE) {
+            const std::size_t count = std::min(GROUP_SIZE, n - i);
+
+            if (in == end)
+                return false;
+            const bool delta = (*in & GROUP_DELTA);
+            const unsigned width = (*in++ & ~GROUP_DELTA);
+            if (width > 8 * sizeof(T))
+                return false;
+
+            T base = 0;
+            if (!delta) {
+                if ((std::size_t)(end - in) < sizeof(T))
+                    return false;
+                for (unsigned k = 0; k < sizeof(T); ++k)
+                    base |= (T)(*in++ << (8 * k));
+            }
+
+            if ((std::size_t)(end - in) < (count * width + 7) / 8)
+                return false;
+
+            const std::uint32_t mask = (1U << width) - 1;
+            std::uint64_t bits = 0;
+            unsigned nbits = 0;
+            for (std::size_t j = 0; j < count; ++j) {
+                while (nbits < width) {
+                    bits |= (std::uint64_t)*in++ << nbits;
+                    nbits += 8;
+                }
+
+                const std::uint32_t packed = bits & mask;
+                bits >>= width;
+                nbits -= width;
+
+                T value;
+                if (delta) {
+                    value = previous[j & 1] + (T)((packed >> 1) ^ (0U - (packed & 1)));
+                } else {
+                    value = base + packed;
+                }
+                previous[j & 1] = value;
+                out[i + j] = value ^ bias;
+            }
+        }
+
+        return in == end;
+    }
+
+    boost::system::error_code DamagedError() { return boost::system::errc::make_error_code(boost::system::errc::bad_message); }
+
+    boost::system::error_code ErrnoError() { return boost::system::error_code(errno, boost::system::system_category()); }
+} // namespace
+
+bool IqRecordingWriter::Open(const boost::filesystem::path &path, SampleFormat format, unsigned sample_rate, boost::system::error_code &ec) {
+    stream_.open(path.native(), std::ios::binary | std::ios::trunc);
+    if (!stream_.good()) {
+        ec = ErrnoError();
+        stream_.close();
+        return false;
+    }
+
+    format_ = format;
+    bytes_per_sample_ = BytesPerSample(format);
+    offset_ = 0;
+    samples_ = 0;
+    index_.clear();
+
+    header_.clear();
+    header_.insert(header_.end(), FILE_MAGIC, FILE_MAGIC + sizeof(FILE_MAGIC));
+    Put32(header_, VERSION_1);
+    Put32(header_, FormatCode(format));
+    Put32(header_, sample_rate);
+    header_.resize(FILE_HEADER_SIZE, 0);
+
+    stream_.write(reinterpret_cast<const char *>(header_.data()), header_.size());
+    if (!stream_.good()) {
+        ec = ErrnoError();
+        stream_.close();
+        return false;
+    }
+
+    offset_ = header_.size();
+    return true;
+}
+
+bool IqRecordingWriter::WriteBlock(std::uint64_t timestamp, std::uint64_t hardware_time, const std::uint8_t *begin, const std::uint8_t *end, boost::system::error_code &ec) {
+    const std::size_t samples = std::distance(begin, end) / bytes_per_sample_;
+    const std::size_t size = samples * bytes_per_sample_;
+
+    payload_.clear();
+    switch (format_) {
+    case SampleFormat::CU8:
+        EncodeGroups<std::uint8_t>(begin, size, 0, payload_);
+        break;
+
+    case SampleFormat::CS8:
+        EncodeGroups<std::uint8_t>(begin, size, 0x80, payload_);
+        break;
+
+    case SampleFormat::CS16H:
+        EncodeGroups<std::uint16_t>(reinterpret_cast<const std::uint16_t *>(begin), size / 2, 0x8000, payload_);
+        break;
+
+    default:
+        break;
+    }
+
+    std::uint8_t encoding = ENCODING_PACKED;
+    if (payload_.empty() || payload_.size() >= size) {
+        encoding = ENCODING_STORED;
+        payload_.assign(begin, begin + size);
+    }
+
+    header_.clear();
+    header_.insert(header_.end(), BLOCK_MAGIC, BLOCK_MAGIC + sizeof(BLOCK_MAGIC));
+    Put32(header_, samples);
+    Put64(header_, timestamp);
+    Put64(header_, hardware_time);
+    header_.push_back(encoding);
+    header_.resize(28, 0);
+    Put32(header_, payload_.size());
+
+    stream_.write(reinterpret_cast<const char *>(header_.data()), header_.size());
+    stream_.write(reinterpret_cast<const char *>(payload_.data()), payload_.size());
+    if (!stream_.good()) {
+        ec = ErrnoError();
+        return false;
+    }
+
+    index_.push_back({offset_, samples_, timestamp});
+    offset_ += header_.size() + payload_.size();
+    samples_ += samples;
+    return true;
+}
+
+void IqRecordingWriter::Close() {
+    if (!stream_.is_open()) {
+        return;
+    }
+
+    Bytes index;
+    index.insert(index.end(), INDEX_MAGIC, INDEX_MAGIC + sizeof(INDEX_MAGIC));
+    Put32(index, index_.size());
+    for (const auto &entry : index_) {
+        Put64(index, entry.offset);
+        Put64(index, entry.sample);
+        Put64(index, entry.timestamp);
+    }
+    Put64(index, offset_);
+    index.insert(index.end(), TRAILER_MAGIC, TRAILER_MAGIC + sizeof(TRAILER_MAGIC));
+
+    stream_.write(reinterpret_cast<const char *>(index.data()), index.size());
+    stream_.close();
+    index_.clear();
+}
+
+//
+//
+//
+
+bool IqRecordingReader::IsRecording(const boost::filesystem::path &path) {
+    std::ifstream stream(path.native(), std::ios::binary);
+    char magic[sizeof(FILE_MAGIC)];
+    stream.read(magic, sizeof(magic));
+    return stream.good() && std::equal(magic, magic + sizeof(magic), FILE_MAGIC);
+}
+
+bool IqRecordingReader::Open(const boost::filesystem::path &path, boost::system::error_code &ec) {
+    stream_.open(path.native(), std::ios::binary);
+    if (!stream_.good()) {
+        ec = ErrnoError();
+        stream_.close();
+        return false;
+    }
+
+    std::array<std::uint8_t, FILE_HEADER_SIZE> header;
+    stream_.read(reinterpret_cast<char *>(header.data()), header.size());
+    if (!stream_.good() || !std::equal(FILE_MAGIC, FILE_MAGIC + sizeof(FILE_MAGIC), header.begin()) || Get32(&header[8]) != VERSION_1) {
+        ec = DamagedError();
+        stream_.close();
+        return false;
+    }
+
+    format_ = FormatFromCode(Get32(&header[12]));
+    sample_rate_ = Get32(&header[16]);
+    bytes_per_sample_ = BytesPerSample(format_);
+    if (format_ == SampleFormat::UNKNOWN) {
+        ec = DamagedError();
+        stream_.close();
+        return false;
+    }
+
+    return true;
+}
+
+SampleBuffer::Pointer IqRecordingReader::ReadBlock(SampleBufferPool &pool, std::uint64_t &timestamp, boost::system::error_code &ec) {
+    std::array<std::uint8_t, BLOCK_HEADER_SIZE> header;
+    stream_.read(reinterpret_cast<char *>(header.data()), header.size());
+
+    // the index follows the last block; a recording that was cut short
+    // just ends, possibly partway through a block
+    if (stream_.gcount() < (std::streamsize)sizeof(BLOCK_MAGIC) || std::equal(INDEX_MAGIC, INDEX_MAGIC + sizeof(INDEX_MAGIC), header.begin())) {
+        ec = boost::asio::error::eof;
+        return nullptr;
+    }
+    if (!std::equal(BLOCK_MAGIC, BLOCK_MAGIC + sizeof(BLOCK_MAGIC), header.begin())) {
+        ec = DamagedError();
+        return nullptr;
+    }
+    if (!stream_.good()) {
+        ec = boost::asio::error::eof;
+        return nullptr;
+    }
+
+    const std::size_t samples = Get32(&header[4]);
+    const std::size_t size = samples * bytes_per_sample_;
+    const std::uint8_t encoding = header[24];
+    const std::size_t payload_size = Get32(&header[28]);
+
+    payload_.resize(payload_size);
+    stream_.read(reinterpret_cast<char *>(payload_.data()), payload_size);
+    if ((std::size_t)stream_.gcount() < payload_size) {
+        ec = boost::asio::error::eof;
+        return nullptr;
+    }
+
+    auto block = pool.Get(size);
+    bool ok;
+    if (encoding == ENCODING_STORED) {
+        ok = (payload_size == size);
+        if (ok) {
+            std::copy(payload_.begin(), payload_.end(), block->Data());
+        }
+    } else if (encoding == ENCODING_PACKED && format_ == SampleFormat::CU8) {
+        ok = DecodeGroups<std::uint8_t>(payload_.data(), payload_.data() + payload_size, 0, block->Data(), size);
+    } else if (encoding == ENCODING_PACKED && format_ == SampleFormat::CS8) {
+        ok = DecodeGroups<std::uint8_t>(payload_.data(), payload_.data() + payload_size, 0x80, block->Data(), size);
+    } else if (encoding == ENCODING_PACKED && format_ == SampleFormat::CS16H) {
+        ok = DecodeGroups<std::uint16_t>(payload_.data(), payload_.data() + payload_size, 0x8000, reinterpret_cast<std::uint16_t *>(block->Data()), size / 2);
+    } else {
+        ok = false;
+    }
+
+    if (!ok) {
+        ec = DamagedError();
+        return nullptr;
+    }
+
+    block->SetSize(size);
+    block->SetHardwareTime(Get64(&header[16]));
+    timestamp = Get64(&header[8]);
+    return block;
+}
+
+//
+//
+//
+
+void IqRecorder::Start() {
+    boost::system::error_code ec;
+    if (!writer_.Open(path_, format_, sample_rate_, ec)) {
+        throw config_error(path_.native() + ": could not create recording: " + ec.message());
+    }
+
+    writer_thread_ = std::thread(&IqRecorder::WriterThread, this);
+}
+
+void IqRecorder::Stop() {
+    queue_.Close();
+    if (writer_thread_.joinable()) {
+        writer_thread_.join();
+    }
+    writer_.Close();
+}
+
+void IqRecorder::Record(std::uint64_t timestamp, SampleBuffer::Pointer buffer) {
+    if (!drop_when_full_) {
+        queue_.Push({timestamp, std::move(buffer)});
+    } else if (!queue_.TryPush({timestamp, std::move(buffer)})) {
+        ++Stats::Global().blocks_record_dropped;
+    }
+}
+
+void IqRecorder::WriterThread() {
+    bool failed = false;
+    Item item;
+    while (queue_.Pop(item)) {
+        if (!failed) {
+            const auto *samples = item.buffer->Samples();
+            boost::system::error_code ec;
+            if (!writer_.WriteBlock(item.timestamp, item.buffer->HardwareTime(), samples, samples + item.buffer->Size(), ec)) {
+                std::cerr << path_.native() << ": recording stopped: " << ec.message() << std::endl;
+                failed = true;
+            }
+        }
+
+        // return the buffer to its pool promptly
+        item.buffer.reset();
+    }
+}
@@ -0,0 +1,185 @@
+// -*- c++ -*-
+
+// Copyright (c) 2019, FlightAware LLC.
+// All rights reserved.
+// Licensed under the 2-clause BSD license; see the LICENSE file
+
+#ifndef DUMP978_IQ_RECORDING_H
+#define DUMP978_IQ_RECORDING_H
+
+#include <fstream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/system/error_code.hpp>
+
+#include "bounded_queue.h"
+#include "common.h"
+#include "convert.h"
+#include "sample_buffer.h"
+
+// Compressed recordings of raw sample data.
+//
+// A recording is a sequence of independently compressed blocks, one per
+// block of samples delivered by the sample source, each carrying the
+// timestamps of that block so that a replay reproduces the original message
+// times. Layout (all integers little-endian):
+//
+//   file header, 32 bytes
+//     0   8  magic "UAT978IQ"
+//     8   4  version (1)
+//     12  4  sample format: 1 = CU8, 2 = CS8, 3 = CS16H, 4 = CF32H
+//     16  4  sample rate, Hz
+//     20  12 reserved, zero
+//
+//   block header, 32 bytes, followed by the payload
+//     0   4  magic "IQBK"
+//     4   4  number of samples
+//     8   8  timestamp of the first sample, milliseconds since the Unix epoch
+//     16  8  SDR hardware timestamp of the first sample, nanoseconds, or 0
+//     24  1  encoding: 0 = stored, 1 = packed
+//     25  3  reserved, zero
+//     28  4  payload size, bytes
+//
+//   index, after the last block
+//     0   4  magic "IQIX"
+//     4   4  number of entries
+//     8  24n per block: file offset of the block header (8), number of
+//            samples before the block (8), timestamp (8)
+//
+//   trailer, 16 bytes at the very end of the file
+//     0   8  file offset of the index
+//     8   8  magic "IQINDEX\0"
+//
+// The index and trailer are written when the recording is closed; a
+// recording that was cut short has neither, but every complete block in it
+// is still readable. IqRecordingReader reads blocks in order and does not
+// use the index yet; it is there for tools that want to seek.
+//
+// Packed encoding splits the I and Q components of the integer formats into
+// groups of 64 and bit-packs each group at the width of its largest value,
+// after either replacing each component with its zigzag-encoded difference
+// from the same component of the previous sample (delta), or subtracting the
+// smallest value in the group (frame of reference), whichever is smaller.
+// SDR noise occupies only the low few bits of each sample, so most of each
+// sample's bits never need storing; decoding is a shift and an add per
+// component. Blocks that would not shrink, and all CF32H blocks, are stored
+// as-is in host byte order.
+
+namespace flightaware::uat {
+    class IqRecordingWriter {
+      public:
+        IqRecordingWriter() {}
+        ~IqRecordingWriter() { Close(); }
+
+        IqRecordingWriter(const IqRecordingWriter &) = delete;
+        IqRecordingWriter &operator=(const IqRecordingWriter &) = delete;
+
+        // Create a new recording at `path`, replacing any existing file
+        bool Open(const boost::filesystem::path &path, SampleFormat format, unsigned sample_rate, boost::system::error_code &ec);
+
+        // Compress and append one block of samples
+        bool WriteBlock(std::uint64_t timestamp, std::uint64_t hardware_time, const std::uint8_t *begin, const std::uint8_t *end, boost::system::error_code &ec);
+
+        // Write the index and trailer and close the file
+        void Close();
+
+      private:
+        struct IndexEntry {
+            std::uint64_t offset;
+            std::uint64_t sample;
+            std::uint64_t timestamp;
+        };
+
+        std::ofstream stream_;
+        SampleFormat format_;
+        unsigned bytes_per_sample_;
+        std::uint64_t offset_ = 0;  // current file size
+        std::uint64_t samples_ = 0; // samples written so far
+        std::vector<IndexEntry> index_;
+        Bytes header_;
+        Bytes payload_;
+    };
+
+    class IqRecordingReader {
+      public:
+        IqRecordingReader() {}
+
+        IqRecordingReader(const IqRecordingReader &) = delete;
+        IqRecordingReader &operator=(const IqRecordingReader &) = delete;
+
+        // Return true if `path` starts with a recording file header
+        static bool IsRecording(const boost::filesystem::path &path);
+
+        // Open a recording and read its file header
+        bool Open(const boost::filesystem::path &path, boost::system::error_code &ec);
+        void Close() { stream_.close(); }
+
+        SampleFormat Format() const { return format_; }
+        unsigned SampleRate() const { return sample_rate_; }
+
+        // Decode the next block into a buffer from `pool`, setting
+        // `timestamp` to its recorded timestamp. Returns nullptr with `ec` set
+        // to eof at the end of the recording, or to another error if the file
+        // is damaged.
+        SampleBuffer::Pointer ReadBlock(SampleBufferPool &pool, std::uint64_t &timestamp, boost::system::error_code &ec);
+
+      private:
+        std::ifstream stream_;
+        SampleFormat format_ = SampleFormat::UNKNOWN;
+        unsigned sample_rate_ = 0;
+        unsigned bytes_per_sample_ = 0;
+        Bytes payload_;
+    };
+
+    // Tees sample blocks into a recording. Blocks are queued by reference
+    // and compressed and written on a separate thread. With
+    // `drop_when_full`, for a live SDR, a slow disk never holds up the
+    // sample source: if the queue fills, blocks are left out of the
+    // recording and counted in Stats::blocks_record_dropped. Otherwise, for
+    // file and stdin input, Record waits for room, so the recording is
+    // complete. A queued buffer is shared with the receiver, so it must
+    // have enough headroom that the receiver's Prepend never reallocates it.
+    class IqRecorder : public std::enable_shared_from_this<IqRecorder> {
+      public:
+        typedef std::shared_ptr<IqRecorder> Pointer;
+
+        // factory method, this class must always be constructed via make_shared
+        static Pointer Create(const boost::filesystem::path &path, SampleFormat format, bool drop_when_full, unsigned sample_rate = 2083333, std::size_t queue_depth = 64) { return Pointer(new IqRecorder(path, format, drop_when_full, sample_rate, queue_depth)); }
+
+        ~IqRecorder() { Stop(); }
+
+        // Create the recording file and start the writer thread. Throws
+        // config_error if the file cannot be created.
+        void Start();
+
+        // Write out everything queued so far and close the recording
+        void Stop();
+
+        // Queue a block for recording, dropping it or waiting if the queue
+        // is full, according to `drop_when_full`
+        void Record(std::uint64_t timestamp, SampleBuffer::Pointer buffer);
+
+      private:
+        IqRecorder(const boost::filesystem::path &path, SampleFormat format, bool drop_when_full, unsigned sample_rate, std::size_t queue_depth) : path_(path), format_(format), drop_when_full_(drop_when_full), sample_rate_(sample_rate), queue_(queue_depth) {}
+
+        void WriterThread();
+
+        struct Item {
+            std::uint64_t timestamp;
+            SampleBuffer::Pointer buffer;
+        };
+
+        boost::filesystem::path path_;
+        SampleFormat format_;
+        bool drop_when_full_;
+        unsigned sample_rate_;
+        IqRecordingWriter writer_;
+        BoundedQueue<Item> queue_;
+        std::thread writer_thread_;
+    };
+}; // namespace flightaware::uat
+
+#endif
@@ -4,77 +4,48 @@
 
 #include "message_dispatch.h"
 
-#include <boost/thread/locks.hpp>
-#include <mutex>
+#include <atomic>
 
 using namespace flightaware::uat;
 
-MessageDispatch::MessageDispatch() : next_handle_(0), busy_(0) {}
+MessageDispatch::MessageDispatch() : next_handle_(0), clients_(std::make_shared<const ClientList>()) {}
 
 MessageDispatch::Handle MessageDispatch::AddClient(MessageHandler handler) {
-    std::unique_lock<std::recursive_mutex> lock(mutex_);
+    std::unique_lock<std::mutex> lock(update_mutex_);
 
     Handle h = next_handle_++;
-    clients_[h] = {handler, false};
+    auto updated = std::make_shared<ClientList>(*std::atomic_load(&clients_));
+    updated->emplace_back(h, handler);
+    std::atomic_store(&clients_, std::shared_ptr<const ClientList>(std::move(updated)));
     return h;
 }
 
 void MessageDispatch::RemoveClient(Handle h) {
-    std::unique_lock<std::recursive_mutex> lock(mutex_);
-
-    auto i = clients_.find(h);
-    if (i == clients_.end())
-        return;
-
-    i->second.deleted = true;
-    PurgeDeadClients();
-}
-
-template <typename T> class BusyCounter {
-  public:
-    BusyCounter(T &var) : var_(var), owned_(true) { ++var_; }
-
-    BusyCounter(const T &) = delete;
-    BusyCounter &operator=(const T &) = delete;
-
-    ~BusyCounter() { release(); }
-
-    void release() {
-        if (owned_) {
-            --var_;
-            owned_ = false;
-        }
+    std::unique_lock<std::mutex> lock(update_mutex_);
+
+    auto current = std::atomic_load(&clients_);
+    auto updated = std::make_shared<ClientList>();
+    updated->reserve(current->size());
+    for (const auto &client : *current) {
+        if (client.first != h)
+            updated->push_back(client);
     }
 
-  private:
-    T &var_;
-    bool owned_;
-};
-
-void MessageDispatch::Dispatch(SharedMessageVector messages) {
-    std::unique_lock<std::recursive_mutex> lock(mutex_);
-
-    BusyCounter<unsigned> counter(busy_);
-    for (auto i = clients_.begin(); i != clients_.end(); ++i) {
-        Client &c = i->second;
-        if (!c.deleted)
-            c.handler(messages);
+    if (updated->size() != current->size()) {
+        std::atomic_store(&clients_, std::shared_ptr<const ClientList>(std::move(updated)));
     }
-    counter.release();
-
-    PurgeDeadClients();
 }
 
-void MessageDispatch::PurgeDeadClients() {
-    // caller must lock!
-    if (busy_)
+void MessageDispatch::Dispatch(SharedMessageVector messages) {
+    // the snapshot stays valid for as long as we hold it, whatever
+    // AddClient / RemoveClient do meanwhile
+    const auto snapshot = std::atomic_load(&clients_);
+    if (snapshot->empty()) {
         return;
+    }
 
-    for (auto i = clients_.begin(); i != clients_.end();) {
-        Client &c = i->second;
-        if (c.deleted)
-            clients_.erase(i++);
-        else
-            ++i;
+    const auto batch = std::make_shared<const MessageBatch>(std::move(messages));
+    for (const auto &client : *snapshot) {
+        client.second(batch);
     }
 }
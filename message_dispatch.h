@@ -7,18 +7,75 @@
 #ifndef MESSAGE_DISPATCH_H
 #define MESSAGE_DISPATCH_H
 
-#include <atomic>
+#include <array>
 #include <functional>
-#include <map>
+#include <memory>
 #include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
 
 #include "uat_message.h"
 
 namespace flightaware::uat {
+    // A batch of messages as handed to dispatch clients. It has a slot for
+    // the encoded form of the batch in each output format, filled by
+    // whichever client asks for that format first, so the batch is encoded
+    // once per format however many clients share it and whatever threads
+    // they run on (see MessageEncoder).
+    class MessageBatch {
+      public:
+        enum class Format : unsigned { RAW = 0, JSON = 1, BINARY = 2 };
+        static const std::size_t FORMAT_COUNT = 3;
+
+        struct Encoded {
+            std::string data;
+            std::size_t messages; // number of messages in `data`
+        };
+        typedef std::shared_ptr<const Encoded> EncodedBuffer;
+
+        explicit MessageBatch(SharedMessageVector messages) : messages_(std::move(messages)) {}
+
+        MessageBatch(const MessageBatch &) = delete;
+        MessageBatch &operator=(const MessageBatch &) = delete;
+
+        const MessageVector &Messages() const { return *messages_; }
+
+        // Return the batch encoded in `format`, calling `encode` to produce
+        // it if this is the first request for that format. Thread-safe:
+        // concurrent callers for one format wait for the first to finish,
+        // while other formats proceed independently.
+        EncodedBuffer Encode(Format format, const std::function<EncodedBuffer()> &encode) const {
+            auto &slot = slots_[static_cast<unsigned>(format)];
+            std::call_once(slot.once, [&slot, &encode]() { slot.buffer = encode(); });
+            return slot.buffer;
+        }
+
+      private:
+        struct Slot {
+            std::once_flag once;
+            EncodedBuffer buffer;
+        };
+
+        SharedMessageVector messages_;
+        mutable std::array<Slot, FORMAT_COUNT> slots_;
+    };
+
+    typedef std::shared_ptr<const MessageBatch> SharedMessageBatch;
+
+    // Fans out message batches to a changing set of clients.
+    //
+    // The client list is an immutable snapshot that Dispatch picks up with a
+    // single atomic load and then walks without any locking; AddClient and
+    // RemoveClient build a new snapshot and publish it atomically, so the
+    // receiver thread is never held up by clients connecting and
+    // disconnecting. As a consequence, a dispatch that was already in
+    // progress when RemoveClient returns may still call the removed
+    // client's handler once.
     class MessageDispatch {
       public:
         typedef unsigned Handle;
-        typedef std::function<void(SharedMessageVector)> MessageHandler;
+        typedef std::function<void(SharedMessageBatch)> MessageHandler;
 
         MessageDispatch();
         MessageDispatch(const MessageDispatch &) = delete;
@@ -27,22 +84,15 @@ namespace flightaware::uat {
         Handle AddClient(MessageHandler handler);
         void RemoveClient(Handle client);
 
+        // Wrap `messages` in a MessageBatch and hand it to each client
         void Dispatch(SharedMessageVector messages);
 
-      protected:
-        void PurgeDeadClients();
-
       private:
-        std::recursive_mutex mutex_;
-        Handle next_handle_;
-        unsigned busy_;
-
-        struct Client {
-            MessageHandler handler;
-            bool deleted;
-        };
+        typedef std::vector<std::pair<Handle, MessageHandler>> ClientList;
 
-        std::map<Handle, Client> clients_;
+        std::mutex update_mutex_; // serializes AddClient and RemoveClient
+        Handle next_handle_;
+        std::shared_ptr<const ClientList> clients_; // only accessed via std::atomic_load / std::atomic_store
     };
 }; // namespace flightaware::uat
 
@@ -0,0 +1,60 @@
+// Copyright (c) 2019, FlightAware LLC.
+// All rights reserved.
+// Licensed under the 2-clause BSD license; see the LICENSE file
+
+#include "sample_buffer.h"
+
+#include <algorithm>
+#include <cassert>
+
+using namespace flightaware::uat;
+
+void SampleBuffer::Prepend(const std::uint8_t *begin, const std::uint8_t *end) {
+    const std::size_t n = std::distance(begin, end);
+    if (owner_ && n <= headroom_) {
+        assert(std::equal(begin, end, base_ - n));
+        prefix_ = n;
+        return;
+    }
+
+    if (n > headroom_) {
+        Bytes grown(n + Capacity());
+        std::copy(base_, base_ + size_, grown.begin() + n);
+        storage_.swap(grown);
+        owner_.reset();
+        headroom_ = n;
+        base_ = storage_.data() + headroom_;
+    }
+
+    std::copy(begin, end, storage_.begin() + (headroom_ - n));
+    prefix_ = n;
+}
+
+SampleBuffer::Pointer SampleBufferPool::Get(std::size_t capacity) {
+    capacity = std::max(capacity, capacity_);
+    std::unique_ptr<SampleBuffer> buffer;
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!free_.empty()) {
+        buffer = std::move(free_.back());
+        free_.pop_back();
+    }
+    lock.unlock();
+
+    // an oversized request replaces a pooled buffer that is too small, so
+    // the pool settles at the largest size asked for
+    if (!buffer || buffer->Capacity() < capacity) {
+        buffer.reset(new SampleBuffer(capacity, headroom_));
+    }
+
+    auto self(shared_from_this());
+    return SampleBuffer::Pointer(buffer.release(), [self](SampleBuffer *released) { self->Release(released); });
+}
+
+void SampleBufferPool::Release(SampleBuffer *buffer) {
+    buffer->SetSize(0);
+    buffer->SetHardwareTime(0);
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    free_.emplace_back(buffer);
+}
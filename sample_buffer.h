@@ -0,0 +1,122 @@
+// -*- c++ -*-
+
+// Copyright (c) 2019, FlightAware LLC.
+// All rights reserved.
+// Licensed under the 2-clause BSD license; see the LICENSE file
+
+#ifndef DUMP978_SAMPLE_BUFFER_H
+#define DUMP978_SAMPLE_BUFFER_H
+
+#include <cassert>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "common.h"
+
+namespace flightaware::uat {
+    // A block of raw sample data with spare room in front of it. A sample
+    // source reads directly into Data(); the receiver then copies the tail of
+    // the previous block into the spare room with Prepend, and demodulates
+    // the whole of begin() .. end() in place.
+    //
+    // A buffer can instead be a read-only view of sample data owned by
+    // something else, such as a memory-mapped file. The samples immediately
+    // in front of a view are already the ones that preceded it, so Prepend
+    // does not need to copy anything.
+    class SampleBuffer {
+      public:
+        typedef std::shared_ptr<SampleBuffer> Pointer;
+
+        SampleBuffer(std::size_t capacity, std::size_t headroom) : storage_(headroom + capacity), base_(storage_.data() + headroom), headroom_(headroom) {}
+
+        // A view of `size` bytes at `data`, where the `preceding` bytes before
+        // `data` hold the samples that came before it. `owner` keeps the
+        // underlying memory alive for the lifetime of the view.
+        SampleBuffer(const std::uint8_t *data, std::size_t size, std::size_t preceding, std::shared_ptr<const void> owner) : base_(data), headroom_(preceding), size_(size), owner_(owner) {}
+
+        SampleBuffer(const SampleBuffer &) = delete;
+        SampleBuffer &operator=(const SampleBuffer &) = delete;
+
+        // Where a source should write up to Capacity() bytes of sample data
+        // (not for views)
+        std::uint8_t *Data() {
+            assert(!owner_);
+            return storage_.data() + headroom_;
+        }
+        std::size_t Capacity() const { return owner_ ? size_ : storage_.size() - headroom_; }
+
+        // Set the number of bytes written to Data(); this also discards
+        // anything previously prepended
+        void SetSize(std::size_t size) {
+            assert(!owner_ && size <= Capacity());
+            size_ = size;
+            prefix_ = 0;
+        }
+
+        // The number of bytes written to Data()
+        std::size_t Size() const { return size_; }
+
+        // The sample data written by the source, excluding anything
+        // prepended. This is safe to read from another thread while the
+        // receiver prepends, provided the buffer has enough headroom that
+        // Prepend never reallocates it.
+        const std::uint8_t *Samples() const { return base_; }
+
+        // The SDR's own timestamp for the first sample, in nanoseconds, or 0
+        // if the source does not provide one
+        std::uint64_t HardwareTime() const { return hardware_time_; }
+        void SetHardwareTime(std::uint64_t ns) { hardware_time_ = ns; }
+
+        // Copy `begin` .. `end` immediately in front of the sample data. If
+        // there is not enough spare room, the buffer is reallocated with more;
+        // as buffers are pooled, this only happens the first time round. A
+        // view just extends itself backwards over the preceding samples
+        // (which must match `begin` .. `end`), unless there are too few of
+        // them, in which case it becomes an ordinary buffer holding a copy.
+        void Prepend(const std::uint8_t *begin, const std::uint8_t *end);
+
+        // The sample data, including any prepended data
+        const std::uint8_t *begin() const { return base_ - prefix_; }
+        const std::uint8_t *end() const { return base_ + size_; }
+
+      private:
+        Bytes storage_;             // empty for a view
+        const std::uint8_t *base_;  // start of the sample data
+        std::size_t headroom_;      // bytes available in front of base_
+        std::size_t prefix_ = 0;    // bytes prepended in front of base_
+        std::size_t size_ = 0;      // bytes of sample data at base_
+        std::uint64_t hardware_time_ = 0;
+        std::shared_ptr<const void> owner_; // set for a view
+    };
+
+    // A pool of SampleBuffers of the same size. Buffers are handed out as
+    // reference-counted pointers and return to the pool when the last
+    // reference is dropped, on whatever thread that happens. The pool grows
+    // if every buffer is in use, so after a short warm-up a source and
+    // receiver pass sample data around without allocating or copying it.
+    class SampleBufferPool : public std::enable_shared_from_this<SampleBufferPool> {
+      public:
+        typedef std::shared_ptr<SampleBufferPool> Pointer;
+
+        // factory method, this class must always be constructed via make_shared
+        static Pointer Create(std::size_t capacity, std::size_t headroom) { return Pointer(new SampleBufferPool(capacity, headroom)); }
+
+        // Return an empty buffer with space for at least the pool's capacity,
+        // or for `capacity` bytes if that is larger
+        SampleBuffer::Pointer Get(std::size_t capacity = 0);
+
+      private:
+        SampleBufferPool(std::size_t capacity, std::size_t headroom) : capacity_(capacity), headroom_(headroom) {}
+
+        void Release(SampleBuffer *buffer);
+
+        std::size_t capacity_;
+        std::size_t headroom_;
+
+        std::mutex mutex_;
+        std::vector<std::unique_ptr<SampleBuffer>> free_;
+    };
+}; // namespace flightaware::uat
+
+#endif
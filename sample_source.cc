@@ -3,82 +3,247 @@
 // Licensed under the 2-clause BSD license; see the LICENSE file
 
 #include "sample_source.h"
+#include "exception.h"
 
+#include <algorithm>
 #include <chrono>
 #include <iostream>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 using namespace flightaware::uat;
 
+// A read-only mapping of a whole file
+struct FileSampleSource::Mapping {
+    Mapping(const std::uint8_t *data_, std::size_t size_) : data(data_), size(size_) {}
+    ~Mapping() { ::munmap(const_cast<std::uint8_t *>(data), size); }
+
+    const std::uint8_t *data;
+    std::size_t size;
+};
+
+// Map `path`, returning nullptr if that is not possible (e.g. it is a pipe
+// or an empty file) so that the caller can fall back to reading it
+std::shared_ptr<FileSampleSource::Mapping> FileSampleSource::MapFile(const boost::filesystem::path &path) {
+    int fd = ::open(path.native().c_str(), O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+
+    struct stat st;
+    if (::fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        ::close(fd);
+        return nullptr;
+    }
+
+    void *data = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) {
+        return nullptr;
+    }
+
+    // we read the whole file once, front to back
+    ::madvise(data, st.st_size, MADV_SEQUENTIAL);
+    return std::make_shared<Mapping>(static_cast<const std::uint8_t *>(data), st.st_size);
+}
+
+FileSampleSource::~FileSampleSource() { Stop(); }
+
+void FileSampleSource::Init() {
+    is_recording_ = IqRecordingReader::IsRecording(path_);
+    if (is_recording_) {
+        boost::system::error_code ec;
+        if (!recording_.Open(path_, ec)) {
+            throw config_error(path_.native() + ": " + ec.message());
+        }
+        recording_.Close();
+
+        if (format_ != SampleFormat::UNKNOWN && format_ != recording_.Format()) {
+            throw config_error("--format does not match the sample format of the recording");
+        }
+        if (recording_.SampleRate() != samples_per_second_) {
+            throw config_error("recording has an unsupported sample rate of " + std::to_string(recording_.SampleRate()) + " Hz");
+        }
+        format_ = recording_.Format();
+    } else if (format_ == SampleFormat::UNKNOWN) {
+        throw config_error("--format must be specified when using a file input");
+    }
+
+    alignment_ = BytesPerSample(format_);
+    bytes_per_second_ = samples_per_second_ * alignment_;
+}
+
 void FileSampleSource::Start() {
-    stream_.open(path_.native());
-    if (!stream_.good()) {
-        auto ec = boost::system::error_code(errno, boost::system::system_category());
-        stream_.close();
-        DispatchError(ec);
-        return;
+    offset_ = 0;
+    if (is_recording_) {
+        boost::system::error_code ec;
+        if (!recording_.Open(path_, ec)) {
+            DispatchError(ec);
+            return;
+        }
+        pool_ = CreatePool(samples_per_block_);
+    } else {
+        mapping_ = MapFile(path_);
+        if (!mapping_) {
+            stream_.open(path_.native());
+            if (!stream_.good()) {
+                auto ec = boost::system::error_code(errno, boost::system::system_category());
+                stream_.close();
+                DispatchError(ec);
+                return;
+            }
+            pool_ = CreatePool(samples_per_block_);
+        }
     }
 
+    open_ = true;
     next_block_ = std::chrono::steady_clock::now();
-    timestamp_ = 1; // always use synthetic timestamps for file sources
+    timestamp_ = 1; // synthetic timestamps for raw sample files
 
-    auto self = std::static_pointer_cast<FileSampleSource>(shared_from_this());
-    service_.post(std::bind(&FileSampleSource::ReadBlock, self, boost::system::error_code()));
+    if (throttle_) {
+        auto self = std::static_pointer_cast<FileSampleSource>(shared_from_this());
+        service_.post(std::bind(&FileSampleSource::ReadBlock, self, boost::system::error_code()));
+    } else {
+        // keep the io_service running while the read thread is active
+        work_.reset(new boost::asio::io_service::work(service_));
+        halt_ = false;
+        read_thread_ = std::thread(&FileSampleSource::ReadThread, this);
+    }
 }
 
 void FileSampleSource::Stop() {
     timer_.cancel();
-    if (stream_.is_open()) {
-        stream_.close();
+    halt_ = true;
+    if (read_thread_.joinable()) {
+        read_thread_.join();
+    }
+    work_.reset();
+
+    if (open_) {
+        CloseFile();
         DispatchError(boost::asio::error::eof);
     }
 }
 
+void FileSampleSource::CloseFile() {
+    open_ = false;
+    mapping_.reset();
+    stream_.close();
+    recording_.Close();
+}
+
+SampleBuffer::Pointer FileSampleSource::NextBlock(std::uint64_t &timestamp, boost::system::error_code &ec) {
+    if (is_recording_) {
+        return recording_.ReadBlock(*pool_, timestamp, ec);
+    }
+
+    // synthetic timestamps for raw sample files
+    auto block = NextRawBlock(ec);
+    if (block) {
+        timestamp = timestamp_;
+        timestamp_ += (block->Size() * 1000ULL / bytes_per_second_);
+    }
+    return block;
+}
+
+SampleBuffer::Pointer FileSampleSource::NextRawBlock(boost::system::error_code &ec) {
+    const std::size_t block_bytes = samples_per_block_ * alignment_;
+
+    if (mapping_) {
+        std::size_t size = std::min(block_bytes, mapping_->size - offset_);
+        size -= size % alignment_;
+        if (size == 0) {
+            ec = boost::asio::error::eof;
+            return nullptr;
+        }
+
+        // start paging in the blocks after this one while it is demodulated
+        const std::size_t page_size = ::sysconf(_SC_PAGESIZE);
+        const std::size_t ahead = (offset_ + size) & ~(page_size - 1);
+        const std::size_t ahead_end = std::min(mapping_->size, offset_ + size + 4 * block_bytes);
+        if (ahead_end > ahead) {
+            ::madvise(const_cast<std::uint8_t *>(mapping_->data) + ahead, ahead_end - ahead, MADV_WILLNEED);
+        }
+
+        auto block = std::make_shared<SampleBuffer>(mapping_->data + offset_, size, offset_, mapping_);
+        offset_ += size;
+        return block;
+    }
+
+    if (stream_.eof()) {
+        ec = boost::asio::error::eof;
+        return nullptr;
+    }
+
+    auto block = pool_->Get();
+    stream_.read(reinterpret_cast<char *>(block->Data()), block->Capacity());
+    if (stream_.bad()) {
+        ec = boost::system::error_code(errno, boost::system::system_category());
+        return nullptr;
+    }
+
+    block->SetSize(stream_.gcount() - (stream_.gcount() % alignment_));
+    if (block->Size() == 0) {
+        ec = boost::asio::error::eof;
+        return nullptr;
+    }
+
+    return block;
+}
+
+// Unthrottled: dispatch blocks back to back on this thread
+void FileSampleSource::ReadThread() {
+    while (!halt_) {
+        boost::system::error_code ec;
+        std::uint64_t timestamp;
+        auto block = NextBlock(timestamp, ec);
+        if (!block) {
+            CloseFile();
+            DispatchError(ec);
+            break;
+        }
+
+        DispatchBuffer(timestamp, std::move(block));
+    }
+}
+
+// Throttled: dispatch one block from the io_service, then wait until it is
+// time for the next one
 void FileSampleSource::ReadBlock(const boost::system::error_code &ec) {
     if (ec) {
         if (ec == boost::asio::error::operation_aborted) {
             return;
         }
 
-        stream_.close();
+        CloseFile();
         DispatchError(ec);
         return;
     }
 
-    if (!stream_.is_open()) {
+    if (!open_) {
         return;
     }
 
-    block_.resize(block_.capacity());
-    stream_.read(reinterpret_cast<char *>(block_.data()), block_.size());
-
-    if (stream_.bad()) {
-        auto ec = boost::system::error_code(errno, boost::system::system_category());
-        stream_.close();
-        DispatchError(ec);
+    boost::system::error_code read_ec;
+    std::uint64_t timestamp;
+    auto block = NextBlock(timestamp, read_ec);
+    if (!block) {
+        CloseFile();
+        DispatchError(read_ec);
         return;
     }
 
-    block_.resize(stream_.gcount() - (stream_.gcount() % alignment_));
-    if (!block_.empty()) {
-        DispatchBuffer(timestamp_, block_);
-        timestamp_ += (block_.size() * 1000ULL / bytes_per_second_);
-    }
-
-    if (stream_.eof()) {
-        stream_.close();
-        DispatchError(boost::asio::error::eof);
-        return;
-    }
+    const auto block_size = block->Size();
+    DispatchBuffer(timestamp, std::move(block));
 
     auto self = std::static_pointer_cast<FileSampleSource>(shared_from_this());
-    if (throttle_) {
-        auto delay = std::chrono::nanoseconds(1000000000ULL * block_.size() / bytes_per_second_);
-        next_block_ += delay;
-        timer_.expires_at(next_block_);
-        timer_.async_wait(std::bind(&FileSampleSource::ReadBlock, self, std::placeholders::_1));
-    } else {
-        service_.post(std::bind(&FileSampleSource::ReadBlock, self, boost::system::error_code()));
-    }
+    auto delay = std::chrono::nanoseconds(1000000000ULL * block_size / bytes_per_second_);
+    next_block_ += delay;
+    timer_.expires_at(next_block_);
+    timer_.async_wait(std::bind(&FileSampleSource::ReadBlock, self, std::placeholders::_1));
 }
 
 //
@@ -87,6 +252,7 @@ void FileSampleSource::ReadBlock(const boost::system::error_code &ec) {
 
 void StdinSampleSource::Start() {
     stream_.assign(::dup(STDIN_FILENO));
+    pool_ = CreatePool(samples_per_block_);
     ScheduleRead();
 }
 
@@ -102,8 +268,12 @@ void StdinSampleSource::ScheduleRead() {
         return;
     }
 
+    // start the new buffer with any partial sample left over from last time
+    block_ = pool_->Get();
+    std::copy(partial_.begin(), partial_.begin() + used_, block_->Data());
+
     auto self = shared_from_this();
-    stream_.async_read_some(boost::asio::buffer(block_.data() + used_, block_.size() - used_), [this, self](const boost::system::error_code &ec, std::size_t bytes_transferred) {
+    stream_.async_read_some(boost::asio::buffer(block_->Data() + used_, block_->Capacity() - used_), [this, self](const boost::system::error_code &ec, std::size_t bytes_transferred) {
         if (ec) {
             if (ec == boost::asio::error::operation_aborted) {
                 return;
@@ -122,16 +292,15 @@ void StdinSampleSource::ScheduleRead() {
         auto start_of_block = end_of_block - (std::chrono::milliseconds(1000) * bytes_transferred / samples_per_second_ / alignment_);
         std::uint64_t timestamp = std::chrono::duration_cast<std::chrono::milliseconds>(start_of_block - unix_epoch).count();
 
-        // fixme, don't copy!
         auto trailing_bytes = used_ % alignment_;
         auto leading_bytes = used_ - trailing_bytes;
 
-        Bytes buffer;
-        buffer.resize(leading_bytes);
-        std::copy(block_.begin(), block_.begin() + leading_bytes, buffer.begin());
-        std::copy(block_.begin() + leading_bytes, block_.end(), block_.begin());
+        std::copy(block_->Data() + leading_bytes, block_->Data() + used_, partial_.begin());
         used_ = trailing_bytes;
-        DispatchBuffer(timestamp, buffer);
+        block_->SetSize(leading_bytes);
+        if (leading_bytes > 0) {
+            DispatchBuffer(timestamp, std::move(block_));
+        }
         ScheduleRead();
     });
 }
@@ -7,10 +7,13 @@
 #ifndef DUMP978_SAMPLE_SOURCE_H
 #define DUMP978_SAMPLE_SOURCE_H
 
+#include <array>
+#include <atomic>
 #include <chrono>
 #include <fstream>
 #include <functional>
 #include <memory>
+#include <thread>
 
 #include <boost/asio/io_service.hpp>
 #include <boost/asio/posix/stream_descriptor.hpp>
@@ -20,12 +23,14 @@
 
 #include "common.h"
 #include "convert.h"
+#include "iq_recording.h"
+#include "sample_buffer.h"
 
 namespace flightaware::uat {
     class SampleSource : public std::enable_shared_from_this<SampleSource> {
       public:
         typedef std::shared_ptr<SampleSource> Pointer;
-        typedef std::function<void(std::uint64_t, const Bytes &, const boost::system::error_code &ec)> Consumer;
+        typedef std::function<void(std::uint64_t, SampleBuffer::Pointer, const boost::system::error_code &ec)> Consumer;
 
         virtual ~SampleSource() {}
 
@@ -36,62 +41,102 @@ namespace flightaware::uat {
 
         void SetConsumer(Consumer consumer) { consumer_ = consumer; }
 
+        // Leave room for this many samples in front of each buffer passed to
+        // the consumer, so that it can prepend the tail of the previous buffer
+        // without copying the new one. Must be called before Start.
+        void SetHeadroom(std::size_t samples) { headroom_samples_ = samples; }
+
       protected:
         SampleSource() {}
 
-        void DispatchBuffer(std::uint64_t timestamp, const Bytes &buffer) {
+        // Return a pool of buffers that can each hold `samples` samples, with
+        // the requested headroom
+        SampleBufferPool::Pointer CreatePool(std::size_t samples) {
+            const auto bytes_per_sample = BytesPerSample(Format());
+            return SampleBufferPool::Create(samples * bytes_per_sample, headroom_samples_ * bytes_per_sample);
+        }
+
+        void DispatchBuffer(std::uint64_t timestamp, SampleBuffer::Pointer buffer) {
             if (consumer_) {
-                consumer_(timestamp, buffer, boost::system::error_code());
+                consumer_(timestamp, std::move(buffer), boost::system::error_code());
             }
         }
 
         void DispatchError(const boost::system::error_code &ec) {
             if (consumer_) {
-                consumer_(0, Bytes(), ec);
+                consumer_(0, SampleBuffer::Pointer(), ec);
             }
         }
 
       private:
         Consumer consumer_;
+        std::size_t headroom_samples_ = 0;
     };
 
+    // Reads samples from a file. Where possible the file is memory-mapped
+    // and the consumer is given read-only views of the mapping, so sample
+    // data is never copied; otherwise it is read into pooled buffers.
+    // A compressed recording made with --record-iq is recognized by its
+    // header, which also supplies the sample format; its blocks are decoded
+    // into pooled buffers and carry their recorded timestamps.
+    // Without --file-throttle, blocks are read and dispatched on a dedicated
+    // thread as fast as the consumer accepts them; with it, they are paced
+    // to realtime from the io_service.
     class FileSampleSource : public SampleSource {
       public:
         static SampleSource::Pointer Create(boost::asio::io_service &service, const boost::filesystem::path &path, const boost::program_options::variables_map &options = boost::program_options::variables_map(), std::size_t samples_per_second = 2083333, std::size_t samples_per_block = 524288) { return Pointer(new FileSampleSource(service, path, options, samples_per_second, samples_per_block)); }
 
-        void Init() override {}
+        ~FileSampleSource();
+
+        void Init() override;
         void Start() override;
         void Stop() override;
         SampleFormat Format() override { return format_; }
 
       private:
-        FileSampleSource(boost::asio::io_service &service, const boost::filesystem::path &path, const boost::program_options::variables_map &options, std::size_t samples_per_second, std::size_t samples_per_block) : service_(service), path_(path), timer_(service) {
-            if (!options.count("format")) {
-                throw std::runtime_error("--format must be specified when using a file input");
-            }
-
+        FileSampleSource(boost::asio::io_service &service, const boost::filesystem::path &path, const boost::program_options::variables_map &options, std::size_t samples_per_second, std::size_t samples_per_block) : service_(service), path_(path), samples_per_second_(samples_per_second), samples_per_block_(samples_per_block), timer_(service) {
             throttle_ = (options.count("file-throttle") > 0);
 
-            format_ = options["format"].as<SampleFormat>();
-            alignment_ = BytesPerSample(format_);
-            bytes_per_second_ = samples_per_second * alignment_;
-            block_.reserve(samples_per_block * alignment_);
+            // may be left unset for a recording, see Init
+            format_ = (options.count("format") ? options["format"].as<SampleFormat>() : SampleFormat::UNKNOWN);
         }
 
+        struct Mapping;
+        static std::shared_ptr<Mapping> MapFile(const boost::filesystem::path &path);
+
+        // Return the next block of samples and its timestamp, or nullptr with
+        // `ec` set at the end of the file or on error
+        SampleBuffer::Pointer NextBlock(std::uint64_t &timestamp, boost::system::error_code &ec);
+        SampleBuffer::Pointer NextRawBlock(boost::system::error_code &ec);
+        void CloseFile();
+
         void ReadBlock(const boost::system::error_code &ec);
+        void ReadThread();
 
         boost::asio::io_service &service_;
         boost::filesystem::path path_;
         SampleFormat format_;
         unsigned alignment_;
         bool throttle_;
+        std::size_t samples_per_second_;
         std::size_t bytes_per_second_;
+        std::size_t samples_per_block_;
+        bool is_recording_ = false;
+
+        std::shared_ptr<Mapping> mapping_; // if the file could be mapped
+        std::size_t offset_ = 0;           // next byte of the mapping to dispatch
+        std::ifstream stream_;             // if it could not
+        IqRecordingReader recording_;      // if it is a recording
+        SampleBufferPool::Pointer pool_;
+        bool open_ = false; // started and not yet at EOF
 
-        std::ifstream stream_;
         boost::asio::steady_timer timer_;
         std::chrono::steady_clock::time_point next_block_;
-        Bytes block_;
-        std::uint64_t timestamp_;
+        std::uint64_t timestamp_; // synthetic timestamp of the next block, if not a recording
+
+        std::thread read_thread_;
+        std::atomic<bool> halt_{false};
+        std::unique_ptr<boost::asio::io_service::work> work_;
     };
 
     class StdinSampleSource : public SampleSource {
@@ -104,14 +149,13 @@ namespace flightaware::uat {
         SampleFormat Format() override { return format_; }
 
       private:
-        StdinSampleSource(boost::asio::io_service &service, const boost::program_options::variables_map &options, std::size_t samples_per_second, std::size_t samples_per_block) : service_(service), samples_per_second_(samples_per_second), stream_(service), used_(0) {
+        StdinSampleSource(boost::asio::io_service &service, const boost::program_options::variables_map &options, std::size_t samples_per_second, std::size_t samples_per_block) : service_(service), samples_per_second_(samples_per_second), samples_per_block_(samples_per_block), stream_(service), used_(0) {
             if (!options.count("format")) {
                 throw std::runtime_error("--format must be specified when using a file input");
             }
 
             format_ = options["format"].as<SampleFormat>();
             alignment_ = BytesPerSample(format_);
-            block_.reserve(samples_per_block * alignment_);
         }
 
         void ScheduleRead();
@@ -120,9 +164,12 @@ namespace flightaware::uat {
         SampleFormat format_;
         unsigned alignment_;
         std::size_t samples_per_second_;
+        std::size_t samples_per_block_;
         boost::asio::posix::stream_descriptor stream_;
-        Bytes block_;
-        std::size_t used_;
+        SampleBufferPool::Pointer pool_;
+        SampleBuffer::Pointer block_;     // buffer being read into
+        std::array<std::uint8_t, 8> partial_; // trailing partial sample from the previous read
+        std::size_t used_;                // bytes of partial_ that are valid
     };
 }; // namespace flightaware::uat
 
@@ -4,6 +4,7 @@
 
 #include "soapy_source.h"
 #include "exception.h"
+#include "stats.h"
 
 #include <iomanip>
 #include <iostream>
@@ -309,19 +310,19 @@ void SoapySampleSource::Run() {
     const auto bytes_per_element = BytesPerSample(format_);
     const auto elements = std::max<size_t>(65536, device_->getStreamMTU(stream_.get()));
 
-    Bytes block;
-    block.reserve(elements * bytes_per_element);
+    auto pool = CreatePool(elements);
 
     const auto overflow_report_interval = std::chrono::milliseconds(15000);
     auto last_overflow_report = std::chrono::steady_clock::now();
     unsigned overflow_count = 0;
 
     while (!halt_) {
-        void *buffs[1] = {block.data()};
+        // read directly into a pooled buffer that is handed on to the receiver
+        auto block = pool->Get();
+        void *buffs[1] = {block->Data()};
         int flags = 0;
         long long time_ns;
 
-        block.resize(elements * bytes_per_element);
         auto elements_read = device_->readStream(stream_.get(), buffs, elements, flags, time_ns,
                                                  /* timeout, microseconds */ 5000000);
         if (halt_) {
@@ -332,6 +333,7 @@ void SoapySampleSource::Run() {
             if (elements_read == SOAPY_SDR_OVERFLOW) {
                 std::cerr << "SoapySDR: overflow" << std::endl;
                 ++overflow_count;
+                ++Stats::Global().blocks_dropped;
             } else {
                 DispatchError(boost::system::error_code{elements_read, soapysdr_category});
                 break;
@@ -351,7 +353,10 @@ void SoapySampleSource::Run() {
             continue;
         }
 
-        block.resize(elements_read * bytes_per_element);
+        block->SetSize(elements_read * bytes_per_element);
+        if (flags & SOAPY_SDR_HAS_TIME) {
+            block->SetHardwareTime(time_ns);
+        }
 
         // work out a starting timestamp
         static auto unix_epoch = std::chrono::system_clock::from_time_t(0);
@@ -359,6 +364,6 @@ void SoapySampleSource::Run() {
         auto start_of_block = end_of_block - (std::chrono::milliseconds(1000) * elements / 2083333);
         std::uint64_t timestamp = std::chrono::duration_cast<std::chrono::milliseconds>(start_of_block - unix_epoch).count();
 
-        DispatchBuffer(timestamp, block);
+        DispatchBuffer(timestamp, std::move(block));
     }
 }
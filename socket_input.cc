@@ -4,14 +4,24 @@
 
 #include "socket_input.h"
 
+#include <boost/asio/ip/multicast.hpp>
+#include <boost/asio/ip/v6_only.hpp>
+
 using namespace flightaware::uat;
 using boost::asio::ip::tcp;
+using boost::asio::ip::udp;
 
 #include <iostream>
 
-RawInput::RawInput(boost::asio::io_service &service, const std::string &host, const std::string &port_or_service, std::chrono::milliseconds reconnect_interval) : service_(service), host_(host), port_or_service_(port_or_service), reconnect_interval_(reconnect_interval), resolver_(service), socket_(service), reconnect_timer_(service), used_(0) { readbuf_.resize(8192); }
+StreamInput::StreamInput(boost::asio::io_service &service, const std::string &host, const std::string &port_or_service, std::chrono::milliseconds reconnect_interval, bool compressed) : used_(0), service_(service), host_(host), port_or_service_(port_or_service), reconnect_interval_(reconnect_interval), resolver_(service), socket_(service), reconnect_timer_(service) {
+    readbuf_.resize(8192);
+    if (compressed) {
+        inflater_.reset(new Inflater());
+        compressed_buf_.resize(8192);
+    }
+}
 
-void RawInput::Start() {
+void StreamInput::Start() {
     auto self(shared_from_this());
 
     std::cerr << "Connecting to " << host_ << ":" << port_or_service_ << std::endl;
@@ -29,12 +39,12 @@ void RawInput::Start() {
     });
 }
 
-void RawInput::Stop() {
+void StreamInput::Stop() {
     reconnect_timer_.cancel();
     socket_.close();
 }
 
-void RawInput::TryNextEndpoint(const boost::system::error_code &last_error) {
+void StreamInput::TryNextEndpoint(const boost::system::error_code &last_error) {
     if (next_endpoint_ == tcp::resolver::iterator()) {
         // No more addresses to try
         HandleError(last_error);
@@ -46,6 +56,9 @@ void RawInput::TryNextEndpoint(const boost::system::error_code &last_error) {
     socket_.async_connect(endpoint, [this, self, endpoint](const boost::system::error_code &ec) {
         if (!ec) {
             std::cerr << "Connected to " << endpoint << std::endl;
+            if (inflater_) {
+                inflater_->Reset(); // each connection is a new stream
+            }
             ScheduleRead();
         } else if (ec == boost::asio::error::operation_aborted) {
             return;
@@ -57,7 +70,7 @@ void RawInput::TryNextEndpoint(const boost::system::error_code &last_error) {
     });
 }
 
-void RawInput::ScheduleRead() {
+void StreamInput::ScheduleRead() {
     auto self(shared_from_this());
 
     if (used_ >= readbuf_.size()) {
@@ -65,6 +78,22 @@ void RawInput::ScheduleRead() {
         return;
     }
 
+    if (inflater_) {
+        socket_.async_read_some(boost::asio::buffer(compressed_buf_), [this, self](const boost::system::error_code &ec, std::size_t len) {
+            if (ec) {
+                HandleError(ec);
+                return;
+            }
+
+            if (!Inflate(len)) {
+                HandleError(boost::asio::error::make_error_code(boost::asio::error::invalid_argument));
+                return;
+            }
+            ScheduleRead();
+        });
+        return;
+    }
+
     socket_.async_read_some(boost::asio::buffer(readbuf_.data() + used_, readbuf_.size() - used_), [this, self](const boost::system::error_code &ec, std::size_t len) {
         if (ec) {
             HandleError(ec);
@@ -72,12 +101,46 @@ void RawInput::ScheduleRead() {
         }
 
         used_ += len;
-        ParseBuffer();
+        if (!ParseBuffer()) {
+            HandleError(boost::asio::error::make_error_code(boost::asio::error::invalid_argument));
+            return;
+        }
         ScheduleRead();
     });
 }
 
-void RawInput::HandleError(const boost::system::error_code &ec) {
+// Inflate the first `len` bytes of compressed_buf_ into readbuf_, parsing
+// whenever it fills up
+bool StreamInput::Inflate(std::size_t len) {
+    std::size_t offset = 0;
+    for (;;) {
+        const std::size_t space = readbuf_.size() - used_;
+        std::size_t consumed, produced;
+        if (!inflater_->Decompress(compressed_buf_.data() + offset, len - offset, consumed, reinterpret_cast<std::uint8_t *>(readbuf_.data()) + used_, space, produced)) {
+            std::cerr << "compressed input: " << inflater_->Error() << std::endl;
+            return false;
+        }
+
+        offset += consumed;
+        used_ += produced;
+        if (!ParseBuffer()) {
+            return false;
+        }
+
+        // stop once the input is used up and the inflater had room to
+        // write everything it was holding
+        if (offset >= len && produced < space) {
+            return true;
+        }
+
+        if (used_ >= readbuf_.size()) {
+            std::cerr << "compressed input: message too long" << std::endl;
+            return false;
+        }
+    }
+}
+
+void StreamInput::HandleError(const boost::system::error_code &ec) {
     if (ec == boost::asio::error::operation_aborted) {
         return;
     }
@@ -101,7 +164,7 @@ void RawInput::HandleError(const boost::system::error_code &ec) {
     }
 }
 
-void RawInput::ParseBuffer() {
+bool RawInput::ParseBuffer() {
     SharedMessageVector messages;
 
     auto sol = readbuf_.begin();
@@ -131,6 +194,7 @@ void RawInput::ParseBuffer() {
     if (messages) {
         DispatchMessages(messages);
     }
+    return true;
 }
 
 static inline int hexvalue(char c) {
@@ -257,3 +321,177 @@ boost::optional<RawMessage> RawInput::ParseLine(const std::string &line) {
 
     return RawMessage(std::move(payload), t, rs, rssi);
 }
+
+// Parse the complete binary frames in `start` .. `end`, appending their
+// messages to `messages`. Returns the start of the first incomplete frame,
+// or nullptr if a frame has a length that can't be right.
+static const std::uint8_t *ParseBinaryFrames(const std::uint8_t *start, const std::uint8_t *end, std::size_t max_frame_size, SharedMessageVector &messages) {
+    while (end - start >= 2) {
+        const std::size_t frame_size = 2 + ((start[0] << 8) | start[1]);
+        if (frame_size < BINARY_FRAME_HEADER_BYTES || frame_size > max_frame_size) {
+            std::cerr << "binary input: bad frame length " << frame_size << std::endl;
+            return nullptr;
+        }
+        if ((std::size_t)(end - start) < frame_size)
+            break;
+
+        auto message = ParseBinaryFrame(start, frame_size);
+        if (message) {
+            if (!messages) {
+                messages = std::make_shared<MessageVector>();
+            }
+            messages->emplace_back(std::move(message));
+        } else {
+            std::cerr << "warning: skipped binary frame of unknown type " << (int)start[2] << " with length " << frame_size << std::endl;
+        }
+        start += frame_size;
+    }
+
+    return start;
+}
+
+bool BinaryInput::ParseBuffer() {
+    SharedMessageVector messages;
+
+    auto start = reinterpret_cast<const std::uint8_t *>(readbuf_.data());
+    auto end = start + used_;
+    auto rest = ParseBinaryFrames(start, end, readbuf_.size(), messages);
+    if (!rest) {
+        return false;
+    }
+
+    used_ = std::distance(rest, end);
+    std::copy(rest, end, reinterpret_cast<std::uint8_t *>(readbuf_.data()));
+    if (messages) {
+        DispatchMessages(messages);
+    }
+    return true;
+}
+
+//////////////
+
+void UdpInput::Start() {
+    // resolve the group (or the IPv6 wildcard address) and the port together
+    udp::resolver resolver(service_);
+    udp::resolver::query query(group_.empty() ? "::" : group_, port_);
+    boost::system::error_code ec;
+    auto it = resolver.resolve(query, ec);
+    if (ec) {
+        HandleError(ec);
+        return;
+    }
+
+    const udp::endpoint endpoint = *it;
+    const bool multicast = endpoint.address().is_multicast();
+
+    // bind a multicast receiver to the wildcard address so that several
+    // consumers on one host can share the port
+    const udp::endpoint local = multicast ? udp::endpoint(endpoint.protocol(), endpoint.port()) : endpoint;
+    auto open_and_bind = [this, multicast](const udp::endpoint &local, boost::system::error_code &ec) {
+        socket_.open(local.protocol(), ec);
+        if (!ec && local.protocol() == udp::v6() && local.address().is_unspecified())
+            socket_.set_option(boost::asio::ip::v6_only(false), ec); // IPv4 datagrams too
+        if (!ec && multicast)
+            socket_.set_option(boost::asio::socket_base::reuse_address(true), ec);
+        if (!ec)
+            socket_.bind(local, ec);
+        if (ec)
+            socket_.close();
+    };
+
+    open_and_bind(local, ec);
+    if (ec && group_.empty()) {
+        // no IPv6 on this host
+        open_and_bind(udp::endpoint(udp::v4(), local.port()), ec);
+    }
+    if (!ec && multicast)
+        socket_.set_option(boost::asio::ip::multicast::join_group(endpoint.address()), ec);
+    if (ec) {
+        HandleError(ec);
+        return;
+    }
+
+    std::cerr << "Receiving UDP datagrams on " << (multicast ? endpoint : socket_.local_endpoint()) << std::endl;
+    ScheduleRead();
+}
+
+void UdpInput::Stop() { socket_.close(); }
+
+void UdpInput::ScheduleRead() {
+    auto self(shared_from_this());
+    socket_.async_receive_from(boost::asio::buffer(datagram_), sender_, [this, self](const boost::system::error_code &ec, std::size_t len) {
+        if (ec) {
+            HandleError(ec);
+            return;
+        }
+
+        HandleDatagram(len);
+        ScheduleRead();
+    });
+}
+
+void UdpInput::HandleDatagram(std::size_t size) {
+    std::uint32_t session, sequence;
+    if (!ParseDatagramHeader(datagram_.data(), size, session, sequence)) {
+        std::cerr << "udp input: ignored a datagram from " << sender_ << " with no valid header" << std::endl;
+        return;
+    }
+
+    CheckSequence(session, sequence);
+
+    // datagrams hold whole frames, so anything left over is damage
+    SharedMessageVector messages;
+    auto end = datagram_.data() + size;
+    auto rest = ParseBinaryFrames(datagram_.data() + UDP_DATAGRAM_HEADER_BYTES, end, size, messages);
+    if (rest != end) {
+        std::cerr << "udp input: discarded a truncated frame from " << sender_ << std::endl;
+    }
+    if (messages) {
+        DispatchMessages(messages);
+    }
+}
+
+void UdpInput::CheckSequence(std::uint32_t session, std::uint32_t sequence) {
+    ++datagrams_;
+
+    if (!have_sequence_ || session != session_) {
+        if (have_sequence_) {
+            std::cerr << "udp input: " << sender_ << " started a new session" << std::endl;
+        }
+        have_sequence_ = true;
+        session_ = session;
+        next_sequence_ = sequence + 1;
+        return;
+    }
+
+    // serial number arithmetic, so the sequence number can wrap
+    const auto gap = (std::int32_t)(sequence - next_sequence_);
+    if (gap < 0) {
+        // already counted as lost when the datagrams after it arrived
+        ++reordered_;
+        return;
+    }
+
+    lost_ += gap;
+    next_sequence_ = sequence + 1;
+
+    if (lost_ > reported_lost_) {
+        const auto now = std::chrono::steady_clock::now();
+        if (reported_lost_ == 0 || now - last_report_ >= std::chrono::minutes(1)) {
+            std::cerr << "udp input: lost " << (lost_ - reported_lost_) << " datagrams; " << lost_ << " of " << (datagrams_ - reordered_ + lost_) << " lost and " << reordered_ << " late or duplicated since start" << std::endl;
+            reported_lost_ = lost_;
+            last_report_ = now;
+        }
+    }
+}
+
+void UdpInput::HandleError(const boost::system::error_code &ec) {
+    if (ec == boost::asio::error::operation_aborted) {
+        return;
+    }
+    socket_.close();
+
+    if (error_handler_) {
+        error_handler_(ec);
+    }
+}
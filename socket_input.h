@@ -7,35 +7,61 @@
 #ifndef SOCKET_INPUT_H
 #define SOCKET_INPUT_H
 
+#include <chrono>
 #include <memory>
 #include <string>
 
 #include <boost/asio/io_service.hpp>
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/ip/udp.hpp>
 #include <boost/asio/steady_timer.hpp>
 
+#include "compression.h"
 #include "message_source.h"
 
 namespace flightaware::uat {
-    class RawInput : public MessageSource, public std::enable_shared_from_this<RawInput> {
+    // Base class for inputs that receive messages from dump978-fa over the
+    // network and dispatch them
+    class SocketInput : public MessageSource, public std::enable_shared_from_this<SocketInput> {
       public:
-        typedef std::shared_ptr<RawInput> Pointer;
+        typedef std::shared_ptr<SocketInput> Pointer;
         typedef std::function<void(const boost::system::error_code &)> ErrorHandler;
 
-        static Pointer Create(boost::asio::io_service &service, const std::string &host, const std::string &port_or_service, std::chrono::milliseconds reconnect_interval = std::chrono::milliseconds(0)) { return Pointer(new RawInput(service, host, port_or_service, reconnect_interval)); }
-
-        void Start();
-        void Stop();
+        virtual void Start() = 0;
+        virtual void Stop() = 0;
 
         void SetErrorHandler(ErrorHandler handler) { error_handler_ = handler; }
 
-      private:
-        RawInput(boost::asio::io_service &service, const std::string &host, const std::string &port_or_service, std::chrono::milliseconds reconnect_interval);
+      protected:
+        ErrorHandler error_handler_;
+    };
+
+    // Base class for inputs that connect to a dump978-fa output port and
+    // dispatch the messages read from it. Subclasses parse the stream. A
+    // compressed stream (--raw-gzip-port) is inflated into the same buffer
+    // that an uncompressed one is read into, so the parsers can't tell the
+    // difference.
+    class StreamInput : public SocketInput {
+      public:
+        void Start() override;
+        void Stop() override;
+
+      protected:
+        StreamInput(boost::asio::io_service &service, const std::string &host, const std::string &port_or_service, std::chrono::milliseconds reconnect_interval, bool compressed);
+
+        // Parse and dispatch whatever complete messages are in
+        // readbuf_[0 .. used_), moving any trailing partial message to the
+        // start of readbuf_ and updating used_. Returns false if the stream
+        // can't be parsed any further.
+        virtual bool ParseBuffer() = 0;
+
+        std::vector<char> readbuf_;
+        std::size_t used_;
 
+      private:
         void TryNextEndpoint(const boost::system::error_code &last_error);
         void ScheduleRead();
-        void ParseBuffer();
-        boost::optional<RawMessage> ParseLine(const std::string &line);
+        bool Inflate(std::size_t len);
         void HandleError(const boost::system::error_code &ec);
 
         boost::asio::io_service &service_;
@@ -48,10 +74,75 @@ namespace flightaware::uat {
         boost::asio::ip::tcp::resolver::iterator next_endpoint_;
         boost::asio::steady_timer reconnect_timer_;
 
-        ErrorHandler error_handler_;
+        std::unique_ptr<Inflater> inflater_;
+        std::vector<std::uint8_t> compressed_buf_;
+    };
 
-        std::vector<char> readbuf_;
-        std::size_t used_;
+    // Reads the raw text format of --raw-port, one hex-encoded message per line
+    class RawInput : public StreamInput {
+      public:
+        static Pointer Create(boost::asio::io_service &service, const std::string &host, const std::string &port_or_service, std::chrono::milliseconds reconnect_interval = std::chrono::milliseconds(0), bool compressed = false) { return Pointer(new RawInput(service, host, port_or_service, reconnect_interval, compressed)); }
+
+      protected:
+        bool ParseBuffer() override;
+
+      private:
+        RawInput(boost::asio::io_service &service, const std::string &host, const std::string &port_or_service, std::chrono::milliseconds reconnect_interval, bool compressed) : StreamInput(service, host, port_or_service, reconnect_interval, compressed) {}
+
+        boost::optional<RawMessage> ParseLine(const std::string &line);
+    };
+
+    // Reads the length-prefixed binary frames of --binary-port (see
+    // WriteBinaryFrame)
+    class BinaryInput : public StreamInput {
+      public:
+        static Pointer Create(boost::asio::io_service &service, const std::string &host, const std::string &port_or_service, std::chrono::milliseconds reconnect_interval = std::chrono::milliseconds(0), bool compressed = false) { return Pointer(new BinaryInput(service, host, port_or_service, reconnect_interval, compressed)); }
+
+      protected:
+        bool ParseBuffer() override;
+
+      private:
+        BinaryInput(boost::asio::io_service &service, const std::string &host, const std::string &port_or_service, std::chrono::milliseconds reconnect_interval, bool compressed) : StreamInput(service, host, port_or_service, reconnect_interval, compressed) {}
+    };
+
+    // Receives the datagrams of --udp-output (see UDP_DATAGRAM_HEADER_BYTES)
+    // on a local port, joining `group` first if it is a multicast address,
+    // IPv4 or IPv6; an empty `group` receives unicast datagrams sent to any
+    // local address, over IPv6 and IPv4 where the host allows it.
+    // Gaps in the sequence numbers are counted as lost datagrams and logged
+    // at most once a minute.
+    class UdpInput : public SocketInput {
+      public:
+        static Pointer Create(boost::asio::io_service &service, const std::string &group, const std::string &port) { return Pointer(new UdpInput(service, group, port)); }
+
+        void Start() override;
+        void Stop() override;
+
+      private:
+        UdpInput(boost::asio::io_service &service, const std::string &group, const std::string &port) : service_(service), group_(group), port_(port), socket_(service) { datagram_.resize(65536); }
+
+        void ScheduleRead();
+        void HandleDatagram(std::size_t size);
+        void CheckSequence(std::uint32_t session, std::uint32_t sequence);
+        void HandleError(const boost::system::error_code &ec);
+
+        boost::asio::io_service &service_;
+        std::string group_;
+        std::string port_;
+
+        boost::asio::ip::udp::socket socket_;
+        boost::asio::ip::udp::endpoint sender_;
+        std::vector<std::uint8_t> datagram_;
+
+        bool have_sequence_ = false;
+        std::uint32_t session_ = 0;
+        std::uint32_t next_sequence_ = 0;
+
+        std::uint64_t datagrams_ = 0;
+        std::uint64_t lost_ = 0;
+        std::uint64_t reordered_ = 0; // late or duplicated
+        std::uint64_t reported_lost_ = 0;
+        std::chrono::steady_clock::time_point last_report_;
     };
 }; // namespace flightaware::uat
 
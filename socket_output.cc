@@ -2,8 +2,10 @@
 // All rights reserved.
 // Licensed under the 2-clause BSD license; see the LICENSE file
 
+#include <array>
 #include <iomanip>
 #include <iostream>
+#include <random>
 
 #include <boost/asio.hpp>
 #include <boost/asio/ip/v6_only.hpp>
@@ -13,12 +15,76 @@
 
 namespace asio = boost::asio;
 using boost::asio::ip::tcp;
+using boost::asio::ip::udp;
 
 using namespace flightaware::uat;
 
-SocketOutput::SocketOutput(asio::io_service &service, tcp::socket &&socket) : service_(service), strand_(service), socket_(std::move(socket)), peer_(socket_.remote_endpoint()), flush_pending_(false) {}
+template <typename Endpoint> static std::string EndpointString(const Endpoint &endpoint) {
+    std::ostringstream os;
+    os << endpoint;
+    return os.str();
+}
+
+MessageEncoder::Buffer MessageEncoder::Encode(const MessageBatch &batch) {
+    return batch.Encode(format_, [this, &batch]() {
+        std::ostringstream os;
+        const auto count = EncodeMessages(batch.Messages(), os);
+        return std::make_shared<const Encoded>(Encoded{os.str(), count});
+    });
+}
+
+std::size_t RawEncoder::EncodeMessages(const MessageVector &messages, std::ostream &os) {
+    for (const auto &message : messages) {
+        os << message << '\n';
+    }
+    return messages.size();
+}
+
+std::size_t JsonEncoder::EncodeMessages(const MessageVector &messages, std::ostream &os) {
+    std::size_t count = 0;
+    for (const auto &message : messages) {
+        if (message.Type() == MessageType::DOWNLINK_SHORT || message.Type() == MessageType::DOWNLINK_LONG) {
+            os << AdsbMessage(message).ToJson() << '\n';
+            ++count;
+        }
+    }
+    return count;
+}
+
+std::size_t BinaryEncoder::EncodeMessages(const MessageVector &messages, std::ostream &os) {
+    for (const auto &message : messages) {
+        WriteBinaryFrame(os, message);
+    }
+    return messages.size();
+}
 
-void SocketOutput::Start() { ReadAndDiscard(); }
+//////////////
+
+SocketOutput::SocketOutput(asio::io_service &service, tcp::socket &&socket, const std::string &type, MessageEncoder::Pointer encoder, const OutputLimits &limits, const OutputCompression &compression) : service_(service), strand_(service), socket_(std::move(socket)), peer_(socket_.remote_endpoint()), encoder_(encoder), limits_(limits), compress_latency_(compression.latency), sync_timer_(service), stats_(Stats::Global().AddOutput(type, EndpointString(peer_))) {
+    if (compression.enabled) {
+        deflater_.reset(new Deflater());
+    }
+}
+
+void SocketOutput::Start() {
+    auto self(shared_from_this());
+    strand_.dispatch([this, self]() {
+        // a write may already have failed and closed the connection
+        if (IsOpen()) {
+            ReadAndDiscard();
+        }
+    });
+}
+
+void SocketOutput::SetCloseNotifier(std::function<void()> notifier) {
+    auto self(shared_from_this());
+    strand_.dispatch([this, self, notifier]() {
+        close_notifier_ = notifier;
+        if (!IsOpen()) {
+            close_notifier_();
+        }
+    });
+}
 
 void SocketOutput::ReadAndDiscard() {
     auto self(shared_from_this());
@@ -32,30 +98,90 @@ void SocketOutput::ReadAndDiscard() {
     }));
 }
 
-void SocketOutput::Write(SharedMessageVector messages) {
+void SocketOutput::Write(SharedMessageBatch batch) {
     auto self(shared_from_this());
-    strand_.dispatch([this, self, messages]() {
-        if (IsOpen()) {
-            InternalWrite(messages);
-            Flush();
+    strand_.dispatch([this, self, batch]() {
+        if (!IsOpen())
+            return;
+
+        auto encoded = encoder_->Encode(*batch);
+        if (encoded->data.empty())
+            return;
+
+        if (!MakeRoom(*encoded)) {
+            if (limits_.policy == OverflowPolicy::DISCONNECT) {
+                std::cerr << peer_ << ": client is not keeping up, disconnecting" << std::endl;
+                ++Stats::Global().outputs_overflow_disconnected;
+                InternalClose();
+            } else {
+                stats_->dropped_messages += encoded->messages;
+                Stats::Global().outputs_dropped_messages += encoded->messages;
+            }
+            return;
         }
+
+        stats_->messages += encoded->messages;
+        queued_bytes_ += encoded->data.size();
+        queued_messages_ += encoded->messages;
+        queue_.emplace_back(std::move(encoded));
+        stats_->backlog_bytes.Set(queued_bytes_);
+        Flush();
     });
 }
 
-void SocketOutput::Flush() {
-    if (flush_pending_)
-        return;
+// Return true if `encoded` can be queued within the limits, first discarding
+// older queued batches if the policy is DROP_OLDEST
+bool SocketOutput::MakeRoom(const MessageEncoder::Encoded &encoded) {
+    auto over_limit = [this, &encoded]() { return (limits_.max_backlog_bytes && queued_bytes_ + encoded.data.size() > limits_.max_backlog_bytes) || (limits_.max_backlog_messages && queued_messages_ + encoded.messages > limits_.max_backlog_messages); };
+
+    // batches already handed to async_write can't be withdrawn
+    if (limits_.policy == OverflowPolicy::DROP_OLDEST) {
+        while (queue_.size() > writing_ && over_limit()) {
+            auto oldest = queue_.begin() + writing_;
+            queued_bytes_ -= (*oldest)->data.size();
+            queued_messages_ -= (*oldest)->messages;
+            stats_->dropped_messages += (*oldest)->messages;
+            Stats::Global().outputs_dropped_messages += (*oldest)->messages;
+            queue_.erase(oldest);
+        }
+    }
 
-    auto writebuf = std::make_shared<std::string>(outbuf_.str());
-    if (writebuf->empty())
+    // if nothing is waiting behind the current write, always accept the
+    // batch, so that one bigger than the limits on its own can't wedge the
+    // client
+    return (queue_.size() == writing_ || !over_limit());
+}
+
+// asio hands at most this many buffers to a single writev
+static const std::size_t MAX_GATHER = 64;
+
+void SocketOutput::Flush() {
+    if (write_pending_ || (queue_.empty() && !sync_due_))
         return;
 
-    flush_pending_ = true;
-    outbuf_.str(std::string());
+    std::vector<asio::const_buffer> buffers;
+    writing_ = std::min(queue_.size(), MAX_GATHER);
+    if (deflater_) {
+        Compress(buffers);
+        if (buffers.empty()) {
+            // all held back in the compressor for now
+            ReleaseWritten();
+            return;
+        }
+    } else {
+        buffers.reserve(writing_);
+        for (std::size_t i = 0; i < writing_; ++i) {
+            buffers.emplace_back(asio::buffer(queue_[i]->data));
+        }
+    }
 
+    // the buffers stay alive in queue_ or compressed_ until the write completes
+    write_pending_ = true;
     auto self(shared_from_this());
-    async_write(socket_, boost::asio::buffer(*writebuf), strand_.wrap([this, self, writebuf](const boost::system::error_code &ec, size_t len) {
-        flush_pending_ = false;
+    async_write(socket_, buffers, strand_.wrap([this, self](const boost::system::error_code &ec, size_t len) {
+        write_pending_ = false;
+        ReleaseWritten();
+        stats_->bytes_written += len;
         if (ec) {
             HandleError(ec);
             return;
@@ -65,6 +191,47 @@ void SocketOutput::Flush() {
     }));
 }
 
+// Compress the first `writing_` queued batches into compressed_, once for
+// the whole write, and add it to `buffers` if there is anything to send.
+// The compressor is only flushed when the latency budget is used up, so
+// sync_timer_ is started when data is first held back in it.
+void SocketOutput::Compress(std::vector<asio::const_buffer> &buffers) {
+    compressed_.clear();
+    for (std::size_t i = 0; i < writing_; ++i) {
+        deflater_->Compress(queue_[i]->data.data(), queue_[i]->data.size(), false, compressed_);
+    }
+
+    if (sync_due_ || compress_latency_.count() == 0) {
+        deflater_->Compress(nullptr, 0, true, compressed_);
+        sync_due_ = false;
+    } else if (!sync_armed_ && writing_ > 0) {
+        sync_armed_ = true;
+        auto self(shared_from_this());
+        sync_timer_.expires_from_now(compress_latency_);
+        sync_timer_.async_wait(strand_.wrap([this, self](const boost::system::error_code &ec) {
+            sync_armed_ = false;
+            if (!ec && IsOpen()) {
+                sync_due_ = true;
+                Flush();
+            }
+        }));
+    }
+
+    if (!compressed_.empty()) {
+        buffers.emplace_back(asio::buffer(compressed_));
+    }
+}
+
+// Remove the batches that were written, or compressed, from the queue
+void SocketOutput::ReleaseWritten() {
+    for (; writing_ > 0; --writing_) {
+        queued_bytes_ -= queue_.front()->data.size();
+        queued_messages_ -= queue_.front()->messages;
+        queue_.pop_front();
+    }
+    stats_->backlog_bytes.Set(queued_bytes_);
+}
+
 void SocketOutput::HandleError(const boost::system::error_code &ec) {
     if (ec == boost::asio::error::eof) {
         std::cerr << peer_ << ": connection closed" << std::endl;
@@ -72,11 +239,17 @@ void SocketOutput::HandleError(const boost::system::error_code &ec) {
         std::cerr << peer_ << ": connection error: " << ec.message() << std::endl;
     }
 
-    Close();
+    InternalClose();
 }
 
 void SocketOutput::Close() {
+    auto self(shared_from_this());
+    strand_.dispatch([this, self]() { InternalClose(); });
+}
+
+void SocketOutput::InternalClose() {
     socket_.close();
+    sync_timer_.cancel();
     if (close_notifier_) {
         close_notifier_();
     }
@@ -84,25 +257,7 @@ void SocketOutput::Close() {
 
 //////////////
 
-void RawOutput::InternalWrite(SharedMessageVector messages) {
-    for (const auto &message : *messages) {
-        Buf() << message << '\n';
-    }
-}
-
-//////////////
-
-void JsonOutput::InternalWrite(SharedMessageVector messages) {
-    for (const auto &message : *messages) {
-        if (message.Type() == MessageType::DOWNLINK_SHORT || message.Type() == MessageType::DOWNLINK_LONG) {
-            Buf() << AdsbMessage(message).ToJson() << '\n';
-        }
-    }
-}
-
-//////////////
-
-SocketListener::SocketListener(asio::io_service &service, const tcp::endpoint &endpoint, MessageDispatch &dispatch, ConnectionFactory factory) : service_(service), acceptor_(service), endpoint_(endpoint), socket_(service), dispatch_(dispatch), factory_(factory) {}
+SocketListener::SocketListener(asio::io_service &service, const tcp::endpoint &endpoint, MessageDispatch &dispatch, ConnectionFactory factory) : service_(service), strand_(service), acceptor_(service), endpoint_(endpoint), socket_(service), dispatch_(dispatch), factory_(factory) {}
 
 void SocketListener::Start() {
     acceptor_.open(endpoint_.protocol());
@@ -119,14 +274,17 @@ void SocketListener::Start() {
 }
 
 void SocketListener::Close() {
-    acceptor_.cancel();
-    socket_.close();
+    auto self(shared_from_this());
+    strand_.dispatch([this, self]() {
+        acceptor_.cancel();
+        socket_.close();
+    });
 }
 
 void SocketListener::Accept() {
     auto self(shared_from_this());
 
-    acceptor_.async_accept(socket_, peer_, [this, self](const boost::system::error_code &ec) {
+    acceptor_.async_accept(socket_, peer_, strand_.wrap([this, self](const boost::system::error_code &ec) {
         if (!ec) {
             std::cerr << endpoint_ << ": accepted a connection from " << peer_ << std::endl;
             auto new_output = factory_(service_, std::move(socket_));
@@ -142,5 +300,88 @@ void SocketListener::Accept() {
         }
 
         Accept();
+    }));
+}
+
+//////////////
+
+UdpOutput::UdpOutput(asio::io_service &service, const udp::endpoint &endpoint, MessageEncoder::Pointer encoder, unsigned multicast_ttl, std::size_t max_pending_bytes) : strand_(service), socket_(service), endpoint_(endpoint), encoder_(encoder), multicast_ttl_(multicast_ttl), max_pending_bytes_(max_pending_bytes), session_(std::random_device()()), stats_(Stats::Global().AddOutput("udp", EndpointString(endpoint))) {}
+
+void UdpOutput::Start() {
+    socket_.open(endpoint_.protocol());
+    if (endpoint_.address().is_multicast()) {
+        socket_.set_option(asio::ip::multicast::hops(multicast_ttl_));
+        socket_.set_option(asio::ip::multicast::enable_loopback(true));
+    }
+}
+
+void UdpOutput::Close() {
+    auto self(shared_from_this());
+    strand_.dispatch([this, self]() { socket_.close(); });
+}
+
+void UdpOutput::Write(SharedMessageBatch batch) {
+    auto self(shared_from_this());
+    strand_.dispatch([this, self, batch]() {
+        if (!socket_.is_open())
+            return;
+
+        auto encoded = encoder_->Encode(*batch);
+        const auto data = reinterpret_cast<const std::uint8_t *>(encoded->data.data());
+        const auto size = encoded->data.size();
+
+        // fill each datagram with as many whole frames as fit
+        std::size_t begin = 0;
+        while (begin < size) {
+            std::size_t end = begin;
+            std::size_t frames = 0;
+            while (end < size) {
+                const std::size_t frame_size = 2 + ((data[end] << 8) | data[end + 1]);
+                if (frames > 0 && UDP_DATAGRAM_HEADER_BYTES + (end - begin) + frame_size > UDP_DATAGRAM_MAX_BYTES)
+                    break;
+                end += frame_size;
+                ++frames;
+            }
+
+            Send(encoded, begin, end, frames);
+            begin = end;
+        }
     });
 }
+
+void UdpOutput::Send(MessageEncoder::Buffer encoded, std::size_t begin, std::size_t end, std::size_t messages) {
+    const auto sequence = sequence_++;
+    const std::size_t size = UDP_DATAGRAM_HEADER_BYTES + (end - begin);
+
+    // as for SocketOutput, always send something if nothing is pending
+    if (max_pending_bytes_ && pending_bytes_ > 0 && pending_bytes_ + size > max_pending_bytes_) {
+        stats_->dropped_messages += messages;
+        Stats::Global().outputs_dropped_messages += messages;
+        return;
+    }
+
+    auto header = std::make_shared<std::array<std::uint8_t, UDP_DATAGRAM_HEADER_BYTES>>();
+    WriteDatagramHeader(header->data(), session_, sequence);
+
+    pending_bytes_ += size;
+    stats_->messages += messages;
+    stats_->backlog_bytes.Set(pending_bytes_);
+
+    // header and encoded stay alive in the handler until the send completes
+    std::array<asio::const_buffer, 2> buffers = {{asio::buffer(*header), asio::buffer(encoded->data.data() + begin, end - begin)}};
+    auto self(shared_from_this());
+    socket_.async_send_to(buffers, endpoint_, strand_.wrap([this, self, header, encoded, size](const boost::system::error_code &ec, std::size_t len) {
+        pending_bytes_ -= size;
+        stats_->backlog_bytes.Set(pending_bytes_);
+        if (ec) {
+            if (ec != boost::asio::error::operation_aborted && !send_failing_) {
+                std::cerr << endpoint_ << ": UDP send failed: " << ec.message() << std::endl;
+                send_failing_ = true;
+            }
+            return;
+        }
+
+        send_failing_ = false;
+        stats_->bytes_written += len;
+    }));
+}
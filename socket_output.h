@@ -7,38 +7,144 @@
 #ifndef SOCKET_OUTPUT_H
 #define SOCKET_OUTPUT_H
 
+#include <chrono>
+#include <deque>
 #include <memory>
 #include <sstream>
+#include <string>
 
 #include <boost/asio/io_service.hpp>
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/ip/udp.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include <boost/asio/strand.hpp>
 
+#include "compression.h"
 #include "message_dispatch.h"
+#include "stats.h"
 #include "uat_message.h"
 
 namespace flightaware::uat {
+    // Serialises batches of messages for one output format. The encoded
+    // form is kept in the batch itself (see MessageBatch), so a batch
+    // dispatched to many clients is encoded by the first of them, and the
+    // rest are handed the same immutable buffer.
+    class MessageEncoder {
+      public:
+        typedef std::shared_ptr<MessageEncoder> Pointer;
+        typedef MessageBatch::Encoded Encoded;
+        typedef MessageBatch::EncodedBuffer Buffer;
+
+        virtual ~MessageEncoder() {}
+
+        // Return the encoded form of `batch`. Thread-safe.
+        Buffer Encode(const MessageBatch &batch);
+
+      protected:
+        explicit MessageEncoder(MessageBatch::Format format) : format_(format) {}
+
+        // Write `messages` to `os`, returning how many were written
+        virtual std::size_t EncodeMessages(const MessageVector &messages, std::ostream &os) = 0;
+
+      private:
+        MessageBatch::Format format_;
+    };
+
+    // One line per message, as written by operator<<(std::ostream&, const RawMessage&)
+    class RawEncoder : public MessageEncoder {
+      public:
+        // factory method, this class must always be constructed via make_shared
+        static Pointer Create() { return Pointer(new RawEncoder()); }
+
+      protected:
+        std::size_t EncodeMessages(const MessageVector &messages, std::ostream &os) override;
+
+      private:
+        RawEncoder() : MessageEncoder(MessageBatch::Format::RAW) {}
+    };
+
+    // One line of JSON per decoded downlink message; uplink messages are skipped
+    class JsonEncoder : public MessageEncoder {
+      public:
+        // factory method, this class must always be constructed via make_shared
+        static Pointer Create() { return Pointer(new JsonEncoder()); }
+
+      protected:
+        std::size_t EncodeMessages(const MessageVector &messages, std::ostream &os) override;
+
+      private:
+        JsonEncoder() : MessageEncoder(MessageBatch::Format::JSON) {}
+    };
+
+    // One binary frame per message (see WriteBinaryFrame)
+    class BinaryEncoder : public MessageEncoder {
+      public:
+        // factory method, this class must always be constructed via make_shared
+        static Pointer Create() { return Pointer(new BinaryEncoder()); }
+
+      protected:
+        std::size_t EncodeMessages(const MessageVector &messages, std::ostream &os) override;
+
+      private:
+        BinaryEncoder() : MessageEncoder(MessageBatch::Format::BINARY) {}
+    };
+
+    // What to do with a client whose backlog would exceed its limits
+    enum class OverflowPolicy {
+        DROP_NEWEST, // leave new batches out of its output until it catches up
+        DROP_OLDEST, // discard the oldest queued batches to make room
+        DISCONNECT   // close the connection
+    };
+
+    // Bounds on the data queued for one slow client; 0 is unlimited
+    struct OutputLimits {
+        std::size_t max_backlog_bytes = 4 * 1024 * 1024;
+        std::size_t max_backlog_messages = 0;
+        OverflowPolicy policy = OverflowPolicy::DROP_NEWEST;
+    };
+
+    // Optional gzip compression of a connection's stream. Compressed data
+    // is flushed through to the client at most `latency` after the batch it
+    // belongs to was written, and no more often than that, so that
+    // consecutive batches compress together; 0 flushes every write.
+    struct OutputCompression {
+        bool enabled = false;
+        std::chrono::milliseconds latency{500};
+    };
+
+    // A connection to one output client. Encoded batches are queued as
+    // shared, immutable buffers (see MessageEncoder) and sent with gathered
+    // writes, so nothing is copied per client. If the client does not keep
+    // up, its backlog is bounded by OutputLimits: the data queued for it
+    // never exceeds the limits by more than the batch being written. With
+    // compression, everything queued is compressed in one go when it is
+    // written, into a buffer of the connection's own.
     class SocketOutput : public std::enable_shared_from_this<SocketOutput> {
       public:
         typedef std::shared_ptr<SocketOutput> Pointer;
 
+        // Start, Write, Close and SetCloseNotifier may be called from any
+        // thread; all work on the connection happens on its strand.
         virtual void Start();
-        void Write(SharedMessageVector messages);
+        void Write(SharedMessageBatch batch);
         virtual void Close();
 
-        void SetCloseNotifier(std::function<void()> notifier) { close_notifier_ = notifier; }
-
-        bool IsOpen() const { return socket_.is_open(); }
+        // Call `notifier` when the connection is closed, or at once if it
+        // already has been
+        void SetCloseNotifier(std::function<void()> notifier);
 
       protected:
-        SocketOutput(boost::asio::io_service &service_, boost::asio::ip::tcp::socket &&socket_);
-        std::ostringstream &Buf() { return outbuf_; }
-
-        virtual void InternalWrite(SharedMessageVector messages) = 0;
+        SocketOutput(boost::asio::io_service &service_, boost::asio::ip::tcp::socket &&socket_, const std::string &type, MessageEncoder::Pointer encoder, const OutputLimits &limits, const OutputCompression &compression = OutputCompression());
 
       private:
+        // these must be called on the strand
+        bool IsOpen() const { return socket_.is_open(); }
+        void InternalClose();
         void HandleError(const boost::system::error_code &ec);
+        bool MakeRoom(const MessageEncoder::Encoded &encoded);
         void Flush();
+        void Compress(std::vector<boost::asio::const_buffer> &buffers);
+        void ReleaseWritten();
         void ReadAndDiscard();
 
         boost::asio::io_service &service_;
@@ -46,8 +152,23 @@ namespace flightaware::uat {
         boost::asio::ip::tcp::socket socket_;
         boost::asio::ip::tcp::endpoint peer_;
 
-        std::ostringstream outbuf_;
-        bool flush_pending_;
+        MessageEncoder::Pointer encoder_;
+        OutputLimits limits_;
+
+        std::deque<MessageEncoder::Buffer> queue_; // the first `writing_` are being written now
+        std::size_t writing_ = 0;
+        bool write_pending_ = false;
+        std::size_t queued_bytes_ = 0;
+        std::size_t queued_messages_ = 0;
+
+        std::unique_ptr<Deflater> deflater_;
+        std::chrono::milliseconds compress_latency_;
+        boost::asio::steady_timer sync_timer_;
+        bool sync_armed_ = false; // sync_timer_ is running
+        bool sync_due_ = false;   // compressed data is being held back too long
+        std::string compressed_;  // being written now
+
+        std::shared_ptr<OutputStats> stats_;
 
         std::function<void()> close_notifier_;
     };
@@ -55,25 +176,28 @@ namespace flightaware::uat {
     class RawOutput : public SocketOutput {
       public:
         // factory method, this class must always be constructed via make_shared
-        static Pointer Create(boost::asio::io_service &service, boost::asio::ip::tcp::socket &&socket) { return Pointer(new RawOutput(service, std::move(socket))); }
-
-      protected:
-        void InternalWrite(SharedMessageVector messages) override;
+        static Pointer Create(boost::asio::io_service &service, boost::asio::ip::tcp::socket &&socket, MessageEncoder::Pointer encoder, const OutputLimits &limits, const OutputCompression &compression) { return Pointer(new RawOutput(service, std::move(socket), encoder, limits, compression)); }
 
       private:
-        RawOutput(boost::asio::io_service &service_, boost::asio::ip::tcp::socket &&socket_) : SocketOutput(service_, std::move(socket_)) {}
+        RawOutput(boost::asio::io_service &service_, boost::asio::ip::tcp::socket &&socket_, MessageEncoder::Pointer encoder, const OutputLimits &limits, const OutputCompression &compression) : SocketOutput(service_, std::move(socket_), compression.enabled ? "raw-gzip" : "raw", encoder, limits, compression) {}
     };
 
     class JsonOutput : public SocketOutput {
       public:
         // factory method, this class must always be constructed via make_shared
-        static Pointer Create(boost::asio::io_service &service, boost::asio::ip::tcp::socket &&socket) { return Pointer(new JsonOutput(service, std::move(socket))); }
+        static Pointer Create(boost::asio::io_service &service, boost::asio::ip::tcp::socket &&socket, MessageEncoder::Pointer encoder, const OutputLimits &limits, const OutputCompression &compression) { return Pointer(new JsonOutput(service, std::move(socket), encoder, limits, compression)); }
 
-      protected:
-        void InternalWrite(SharedMessageVector messages) override;
+      private:
+        JsonOutput(boost::asio::io_service &service_, boost::asio::ip::tcp::socket &&socket_, MessageEncoder::Pointer encoder, const OutputLimits &limits, const OutputCompression &compression) : SocketOutput(service_, std::move(socket_), compression.enabled ? "json-gzip" : "json", encoder, limits, compression) {}
+    };
+
+    class BinaryOutput : public SocketOutput {
+      public:
+        // factory method, this class must always be constructed via make_shared
+        static Pointer Create(boost::asio::io_service &service, boost::asio::ip::tcp::socket &&socket, MessageEncoder::Pointer encoder, const OutputLimits &limits) { return Pointer(new BinaryOutput(service, std::move(socket), encoder, limits)); }
 
       private:
-        JsonOutput(boost::asio::io_service &service_, boost::asio::ip::tcp::socket &&socket_) : SocketOutput(service_, std::move(socket_)) {}
+        BinaryOutput(boost::asio::io_service &service_, boost::asio::ip::tcp::socket &&socket_, MessageEncoder::Pointer encoder, const OutputLimits &limits) : SocketOutput(service_, std::move(socket_), "binary", encoder, limits) {}
     };
 
     class SocketListener : public std::enable_shared_from_this<SocketListener> {
@@ -84,6 +208,7 @@ namespace flightaware::uat {
         // factory method, this class must always be constructed via make_shared
         static Pointer Create(boost::asio::io_service &service, const boost::asio::ip::tcp::endpoint &endpoint, MessageDispatch &dispatch, ConnectionFactory factory) { return Pointer(new SocketListener(service, endpoint, dispatch, factory)); }
 
+        // Close may be called from any thread
         void Start();
         void Close();
 
@@ -93,6 +218,7 @@ namespace flightaware::uat {
         void Accept();
 
         boost::asio::io_service &service_;
+        boost::asio::io_service::strand strand_;
         boost::asio::ip::tcp::acceptor acceptor_;
         boost::asio::ip::tcp::endpoint endpoint_;
         boost::asio::ip::tcp::socket socket_;
@@ -100,6 +226,50 @@ namespace flightaware::uat {
         MessageDispatch &dispatch_;
         ConnectionFactory factory_;
     };
+
+    // Publishes every batch to a UDP address, unicast or multicast, as
+    // sequence-numbered datagrams of binary frames (see
+    // UDP_DATAGRAM_HEADER_BYTES), so a single send reaches every consumer
+    // in a multicast group. Nothing is retransmitted: a datagram that would
+    // take the data waiting to be sent past `max_pending_bytes` is dropped,
+    // but still uses up a sequence number, so receivers see the gap.
+    class UdpOutput : public std::enable_shared_from_this<UdpOutput> {
+      public:
+        typedef std::shared_ptr<UdpOutput> Pointer;
+
+        // factory method, this class must always be constructed via make_shared.
+        // `encoder` must be a BinaryEncoder; it may be shared with --binary-port.
+        static Pointer Create(boost::asio::io_service &service, const boost::asio::ip::udp::endpoint &endpoint, MessageEncoder::Pointer encoder, unsigned multicast_ttl, std::size_t max_pending_bytes) { return Pointer(new UdpOutput(service, endpoint, encoder, multicast_ttl, max_pending_bytes)); }
+
+        // Open the socket; throws boost::system::system_error on failure
+        void Start();
+
+        // Write and Close may be called from any thread
+        void Write(SharedMessageBatch batch);
+        void Close();
+
+      private:
+        UdpOutput(boost::asio::io_service &service, const boost::asio::ip::udp::endpoint &endpoint, MessageEncoder::Pointer encoder, unsigned multicast_ttl, std::size_t max_pending_bytes);
+
+        // Send the `messages` frames in encoded->data[begin .. end) as one
+        // datagram; must be called on the strand
+        void Send(MessageEncoder::Buffer encoded, std::size_t begin, std::size_t end, std::size_t messages);
+
+        boost::asio::io_service::strand strand_;
+        boost::asio::ip::udp::socket socket_;
+        boost::asio::ip::udp::endpoint endpoint_;
+
+        MessageEncoder::Pointer encoder_;
+        unsigned multicast_ttl_;
+        std::size_t max_pending_bytes_;
+
+        std::uint32_t session_;
+        std::uint32_t sequence_ = 0;
+        std::size_t pending_bytes_ = 0;
+        bool send_failing_ = false; // only log the first of a run of send errors
+
+        std::shared_ptr<OutputStats> stats_;
+    };
 }; // namespace flightaware::uat
 
 #endif
@@ -0,0 +1,78 @@
+// -*- c++ -*-
+
+// Copyright (c) 2019, FlightAware LLC.
+// All rights reserved.
+// Licensed under the 2-clause BSD license; see the LICENSE file
+
+#ifndef DUMP978_SPSC_RING_H
+#define DUMP978_SPSC_RING_H
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+namespace flightaware::uat {
+    // A fixed-capacity lock-free FIFO for exactly one producer thread and one
+    // consumer thread. Neither side ever blocks: Push fails when the ring is
+    // full and Pop fails when it is empty, leaving the caller to decide
+    // whether to drop, retry, or wait.
+    template <typename T> class SpscRing {
+      public:
+        // The capacity is rounded up to a power of two
+        explicit SpscRing(std::size_t capacity) : slots_(RoundUp(capacity)), mask_(slots_.size() - 1) {}
+
+        SpscRing(const SpscRing &) = delete;
+        SpscRing &operator=(const SpscRing &) = delete;
+
+        std::size_t Capacity() const { return slots_.size(); }
+
+        // Producer only: move `item` into the ring. Returns false (leaving
+        // `item` untouched) if the ring is full.
+        bool Push(T &item) {
+            const auto tail = tail_.load(std::memory_order_relaxed);
+            if (tail - head_.load(std::memory_order_acquire) == slots_.size())
+                return false;
+
+            slots_[tail & mask_] = std::move(item);
+            tail_.store(tail + 1, std::memory_order_release);
+            return true;
+        }
+
+        // Consumer only: move the oldest item into `item`. Returns false if
+        // the ring is empty.
+        bool Pop(T &item) {
+            const auto head = head_.load(std::memory_order_relaxed);
+            if (head == tail_.load(std::memory_order_acquire))
+                return false;
+
+            item = std::move(slots_[head & mask_]);
+            slots_[head & mask_] = T();
+            head_.store(head + 1, std::memory_order_release);
+            return true;
+        }
+
+        // Approximate number of queued items; exact when called by either
+        // the producer or the consumer while the other side is idle
+        std::size_t Size() const { return tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_acquire); }
+
+      private:
+        static std::size_t RoundUp(std::size_t n) {
+            std::size_t size = 1;
+            while (size < n)
+                size <<= 1;
+            return size;
+        }
+
+        std::vector<T> slots_;
+        const std::size_t mask_;
+
+        // head_ is written only by the consumer and tail_ only by the
+        // producer; pad them onto separate cache lines
+        char pad0_[64];
+        std::atomic<std::size_t> head_{0};
+        char pad1_[64];
+        std::atomic<std::size_t> tail_{0};
+    };
+}; // namespace flightaware::uat
+
+#endif
@@ -0,0 +1,112 @@
+// Copyright (c) 2019, FlightAware LLC.
+// All rights reserved.
+// Licensed under the 2-clause BSD license; see the LICENSE file
+
+#include "squelch.h"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace flightaware::uat;
+
+// 64 samples is about 31us, a tenth of the shortest (downlink) message
+static const std::size_t WINDOW_SAMPLES = 64;
+
+// Noise floor tracking: each window moves the estimate up by UP_STEP if it
+// is above it, or down by DOWN_STEP if below, which settles where a quarter
+// of windows are below the floor
+static const double FLOOR_QUANTILE = 0.25;
+static const double UP_STEP = 0.01 * FLOOR_QUANTILE;
+static const double DOWN_STEP = 0.01 * (1 - FLOOR_QUANTILE);
+
+// Convert a mean power, in units where full scale is `full_scale`, to dBFS
+static inline double PowerDb(double mean_power, double full_scale) { return 10 * std::log10(std::max(mean_power, 1e-20) / (full_scale * full_scale)); }
+
+// Append the power of each window of `n` samples of an integer format to
+// `out`. Accum must hold a whole window's sum of squares.
+template <typename T, typename Accum, int SCALE, int OFFSET> static void IntegerWindows(const std::uint8_t *begin, std::size_t n, double full_scale, std::vector<double> &out) {
+    const T *in = reinterpret_cast<const T *>(begin);
+    std::size_t i = 0;
+    for (; i + WINDOW_SAMPLES <= n; i += WINDOW_SAMPLES) {
+        out.push_back(PowerDb((double)SumSquares<T, Accum, SCALE, OFFSET>(in + 2 * i, 2 * WINDOW_SAMPLES) / WINDOW_SAMPLES, full_scale));
+    }
+    if (i < n) {
+        out.push_back(PowerDb((double)SumSquares<T, Accum, SCALE, OFFSET>(in + 2 * i, 2 * (n - i)) / (n - i), full_scale));
+    }
+}
+
+void Squelch::MeasureWindows(const std::uint8_t *begin, std::size_t n) {
+    power_db_.clear();
+
+    switch (format_) {
+    case SampleFormat::CU8:
+        // 2c - 255 keeps the 127.5 midpoint in integers
+        IntegerWindows<std::uint8_t, std::uint32_t, 2, 255>(begin, n, 255, power_db_);
+        break;
+
+    case SampleFormat::CS8:
+        IntegerWindows<std::int8_t, std::uint32_t, 1, 0>(begin, n, 128, power_db_);
+        break;
+
+    case SampleFormat::CS16H:
+        IntegerWindows<std::int16_t, std::uint64_t, 1, 0>(begin, n, 32768, power_db_);
+        break;
+
+    case SampleFormat::CF32H: {
+        const float *in = reinterpret_cast<const float *>(begin);
+        for (std::size_t i = 0; i < n; i += WINDOW_SAMPLES) {
+            const std::size_t count = std::min(WINDOW_SAMPLES, n - i);
+            double sum = 0;
+            for (std::size_t j = 0; j < count * 2; ++j) {
+                sum += (double)in[2 * i + j] * in[2 * i + j];
+            }
+            power_db_.push_back(PowerDb(sum / count, 1.0));
+        }
+        break;
+    }
+
+    default:
+        break;
+    }
+}
+
+void Squelch::FindActive(const std::uint8_t *begin, const std::uint8_t *end, std::size_t margin, std::vector<Span> &spans) {
+    spans.clear();
+
+    const std::size_t n = std::distance(begin, end) / BytesPerSample(format_);
+    MeasureWindows(begin, n);
+    if (power_db_.empty()) {
+        return;
+    }
+
+    if (!have_floor_) {
+        // start from the first block's quantile rather than converging from
+        // an arbitrary value
+        sorted_db_ = power_db_;
+        auto quantile = sorted_db_.begin() + (std::size_t)(sorted_db_.size() * FLOOR_QUANTILE);
+        std::nth_element(sorted_db_.begin(), quantile, sorted_db_.end());
+        floor_db_ = *quantile;
+        have_floor_ = true;
+    }
+
+    for (std::size_t w = 0; w < power_db_.size(); ++w) {
+        const double power = power_db_[w];
+        const bool active = (power >= floor_db_ + threshold_db_);
+        floor_db_ += (power > floor_db_ ? UP_STEP : -DOWN_STEP);
+
+        if (!active) {
+            continue;
+        }
+
+        const std::size_t window_begin = w * WINDOW_SAMPLES;
+        const std::size_t window_end = std::min(n, window_begin + WINDOW_SAMPLES);
+        const std::size_t span_begin = (window_begin > margin ? window_begin - margin : 0);
+        const std::size_t span_end = std::min(n, window_end + margin);
+
+        if (!spans.empty() && span_begin <= spans.back().end) {
+            spans.back().end = span_end;
+        } else {
+            spans.push_back({span_begin, span_end});
+        }
+    }
+}
@@ -0,0 +1,64 @@
+// -*- c++ -*-
+
+// Copyright (c) 2019, FlightAware LLC.
+// All rights reserved.
+// Licensed under the 2-clause BSD license; see the LICENSE file
+
+#ifndef DUMP978_SQUELCH_H
+#define DUMP978_SQUELCH_H
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "convert.h"
+
+namespace flightaware::uat {
+    // An energy gate in front of the demodulator. The mean power of each
+    // short window of samples is measured with integer arithmetic and
+    // compared against an adaptive noise floor; only windows that rise a
+    // threshold above the floor, widened by a margin on each side, are worth
+    // converting to phase and searching for sync words. Away from busy
+    // airspace that is a small fraction of the samples.
+    //
+    // The noise floor tracks the 25th percentile of window power, so it
+    // follows gain and noise changes within a second or so but is barely
+    // moved by bursts of messages. Not thread-safe: each receiver owns one.
+    class Squelch {
+      public:
+        typedef std::unique_ptr<Squelch> Pointer;
+
+        // A range of sample indexes, [begin, end)
+        struct Span {
+            std::size_t begin;
+            std::size_t end;
+        };
+
+        // Pass windows at least `threshold_db` above the noise floor
+        static Pointer Create(SampleFormat format, double threshold_db) { return Pointer(new Squelch(format, threshold_db)); }
+
+        // Replace `spans` with the parts of the samples `begin` .. `end` that
+        // should be demodulated: every active window plus `margin` samples
+        // either side, merged, in order and clipped to the block.
+        void FindActive(const std::uint8_t *begin, const std::uint8_t *end, std::size_t margin, std::vector<Span> &spans);
+
+        // The current noise floor estimate, dB relative to full scale
+        double NoiseFloor() const { return floor_db_; }
+
+      private:
+        Squelch(SampleFormat format, double threshold_db) : format_(format), threshold_db_(threshold_db) {}
+
+        // Fill power_db_ with the mean power of each window of `n` samples
+        void MeasureWindows(const std::uint8_t *begin, std::size_t n);
+
+        SampleFormat format_;
+        double threshold_db_;
+        bool have_floor_ = false;
+        double floor_db_ = 0;
+
+        std::vector<double> power_db_;
+        std::vector<double> sorted_db_;
+    };
+}; // namespace flightaware::uat
+
+#endif
@@ -0,0 +1,153 @@
+// Copyright (c) 2019, FlightAware LLC.
+// All rights reserved.
+// Licensed under the 2-clause BSD license; see the LICENSE file
+
+#include "stats.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+
+#include "common.h"
+
+using namespace flightaware::uat;
+
+void Histogram::Add(std::uint64_t value) {
+    unsigned bucket;
+    if (scale_ == Scale::LINEAR)
+        bucket = (value < BUCKETS ? value : BUCKETS - 1);
+    else
+        bucket = (value == 0 ? 0 : std::min<unsigned>(BUCKETS - 1, 64 - __builtin_clzll(value)));
+
+    buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(value, std::memory_order_relaxed);
+}
+
+nlohmann::json Histogram::ToJson() const {
+    auto buckets = nlohmann::json::array();
+    for (unsigned i = 0; i < BUCKETS; ++i) {
+        auto n = buckets_[i].load(std::memory_order_relaxed);
+        if (!n)
+            continue;
+
+        std::uint64_t lower;
+        if (scale_ == Scale::LINEAR)
+            lower = i;
+        else
+            lower = (i == 0 ? 0 : (std::uint64_t)1 << (i - 1));
+        buckets.push_back({lower, n});
+    }
+
+    return {{"count", count_.load(std::memory_order_relaxed)}, {"sum", sum_.load(std::memory_order_relaxed)}, {"buckets", buckets}};
+}
+
+void Gauge::Set(std::uint64_t value) {
+    current_.store(value, std::memory_order_relaxed);
+
+    auto peak = peak_.load(std::memory_order_relaxed);
+    while (value > peak && !peak_.compare_exchange_weak(peak, value, std::memory_order_relaxed))
+        ;
+}
+
+nlohmann::json Gauge::ToJson() const { return {{"current", current_.load(std::memory_order_relaxed)}, {"peak", peak_.load(std::memory_order_relaxed)}}; }
+
+Stats::Stats() : start_(std::chrono::steady_clock::now()) {}
+
+Stats &Stats::Global() {
+    static Stats stats;
+    return stats;
+}
+
+std::shared_ptr<OutputStats> Stats::AddOutput(const std::string &type, const std::string &peer) {
+    // not make_shared: a stale weak_ptr should only pin the control block, not the stats
+    std::shared_ptr<OutputStats> output(new OutputStats(type, peer));
+
+    std::unique_lock<std::mutex> lock(outputs_mutex_);
+    // ToJson may never run (no --stats-file), so drop disconnected clients here too
+    outputs_.erase(std::remove_if(outputs_.begin(), outputs_.end(), [](const std::weak_ptr<OutputStats> &o) { return o.expired(); }), outputs_.end());
+    outputs_.emplace_back(output);
+    return output;
+}
+
+nlohmann::json Stats::ToJson() const {
+    using json = nlohmann::json;
+
+    const auto uptime = std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::steady_clock::now() - start_).count();
+    const auto samples = samples_received.load(std::memory_order_relaxed);
+
+    json stats;
+    stats["version"] = "dump978-fa " VERSION;
+    stats["uptime"] = uptime;
+
+    stats["input"] = {{"samples", samples}, {"blocks", sample_blocks.load(std::memory_order_relaxed)}, {"dropped_blocks", blocks_dropped.load(std::memory_order_relaxed)}, {"queue_dropped_blocks", blocks_queue_dropped.load(std::memory_order_relaxed)}, {"record_dropped_blocks", blocks_record_dropped.load(std::memory_order_relaxed)}, {"samples_per_second", uptime > 0 ? samples / uptime : 0.0}};
+
+    // Wall-clock processing time as a fraction of the time the samples span;
+    // approaching 1.0 (per receive thread) means the receiver is CPU-bound
+    auto convert = convert_us.ToJson();
+    auto demod = demod_us.ToJson();
+    const double sample_us = samples / 2.083333;
+    const double busy_us = convert["sum"].get<double>() + demod["sum"].get<double>();
+    stats["processing"] = {{"convert_us", convert}, {"demod_us", demod}, {"load", sample_us > 0 ? busy_us / sample_us : 0.0}, {"squelched_samples", squelched_samples.load(std::memory_order_relaxed)}};
+
+    stats["queues"] = {{"samples", sample_queue.ToJson()}, {"convert", convert_queue.ToJson()}, {"sync", sync_queue.ToJson()}, {"fec", fec_queue.ToJson()}};
+
+    stats["fec"] = {{"downlink", {{"attempts", downlink_attempts.load(std::memory_order_relaxed)}, {"decoded", downlink_decoded.load(std::memory_order_relaxed)}, {"corrected_errors", downlink_corrected.ToJson()}}}, {"uplink", {{"attempts", uplink_attempts.load(std::memory_order_relaxed)}, {"decoded", uplink_decoded.load(std::memory_order_relaxed)}, {"corrected_errors", uplink_corrected.ToJson()}}}};
+
+    stats["outputs_overflow_disconnected"] = outputs_overflow_disconnected.load(std::memory_order_relaxed);
+    stats["outputs_dropped_messages"] = outputs_dropped_messages.load(std::memory_order_relaxed);
+
+    auto &outputs = stats["outputs"] = json::array();
+    std::unique_lock<std::mutex> lock(outputs_mutex_);
+    for (auto i = outputs_.begin(); i != outputs_.end();) {
+        auto output = i->lock();
+        if (!output) {
+            // client has gone away
+            i = outputs_.erase(i);
+            continue;
+        }
+
+        outputs.push_back({{"type", output->type}, {"peer", output->peer}, {"messages", output->messages.load(std::memory_order_relaxed)}, {"bytes_written", output->bytes_written.load(std::memory_order_relaxed)}, {"backlog_bytes", output->backlog_bytes.ToJson()}, {"dropped_messages", output->dropped_messages.load(std::memory_order_relaxed)}});
+        ++i;
+    }
+
+    return stats;
+}
+
+void StatsWriter::Start() { PeriodicWrite(); }
+
+void StatsWriter::Stop() {
+    timer_.cancel();
+    Write();
+}
+
+void StatsWriter::Write() {
+    auto temp_path = path_;
+    temp_path += ".new";
+
+    std::ofstream stats_file(temp_path.native());
+    stats_file << Stats::Global().ToJson() << std::endl;
+    stats_file.close();
+
+    if (stats_file) {
+        boost::system::error_code ec;
+        boost::filesystem::rename(temp_path, path_, ec);
+        if (ec) {
+            std::cerr << path_.native() << ": could not write stats: " << ec.message() << std::endl;
+        }
+    } else {
+        std::cerr << temp_path.native() << ": could not write stats" << std::endl;
+    }
+}
+
+void StatsWriter::PeriodicWrite() {
+    Write();
+
+    auto self(shared_from_this());
+    timer_.expires_from_now(interval_);
+    timer_.async_wait([this, self](const boost::system::error_code &ec) {
+        if (!ec) {
+            PeriodicWrite();
+        }
+    });
+}
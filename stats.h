@@ -0,0 +1,178 @@
+// -*- c++ -*-
+
+// Copyright (c) 2019, FlightAware LLC.
+// All rights reserved.
+// Licensed under the 2-clause BSD license; see the LICENSE file
+
+#ifndef DUMP978_STATS_H
+#define DUMP978_STATS_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/filesystem.hpp>
+
+#include <json.hpp>
+
+namespace flightaware::uat {
+    // A histogram of unsigned values. With a linear scale, bucket N counts
+    // values equal to N; with a log2 scale, bucket 0 counts zero and bucket N
+    // counts values in [2^(N-1), 2^N). Values past the last bucket are counted
+    // in the last bucket. Add is lock-free and may be called from any thread.
+    class Histogram {
+      public:
+        enum class Scale { LINEAR, LOG2 };
+
+        static const unsigned BUCKETS = 48;
+
+        explicit Histogram(Scale scale) : scale_(scale) {}
+
+        Histogram(const Histogram &) = delete;
+        Histogram &operator=(const Histogram &) = delete;
+
+        void Add(std::uint64_t value);
+
+        // {"count": .., "sum": .., "buckets": [[lower bound, count], ...]},
+        // listing only the non-empty buckets
+        nlohmann::json ToJson() const;
+
+      private:
+        Scale scale_;
+        std::atomic<std::uint64_t> count_{0};
+        std::atomic<std::uint64_t> sum_{0};
+        std::array<std::atomic<std::uint64_t>, BUCKETS> buckets_{};
+    };
+
+    // The current and peak value of something that goes up and down, such as
+    // a queue depth
+    class Gauge {
+      public:
+        void Set(std::uint64_t value);
+        nlohmann::json ToJson() const;
+
+      private:
+        std::atomic<std::uint64_t> current_{0};
+        std::atomic<std::uint64_t> peak_{0};
+    };
+
+    // Counters for one connected output client. The client owns this and
+    // updates it; Stats holds a weak reference for reporting.
+    struct OutputStats {
+        OutputStats(const std::string &type_, const std::string &peer_) : type(type_), peer(peer_) {}
+
+        const std::string type;
+        const std::string peer;
+        std::atomic<std::uint64_t> messages{0};
+        std::atomic<std::uint64_t> bytes_written{0};
+        Gauge backlog_bytes; // encoded but not yet written to the socket
+        std::atomic<std::uint64_t> dropped_messages{0}; // left out because the backlog was full
+    };
+
+    // Process-wide counters for the receive chain, from sample input through
+    // to the output clients. All updates are lock-free and cheap enough to
+    // make once per block or once per message.
+    class Stats {
+      public:
+        Stats();
+
+        Stats(const Stats &) = delete;
+        Stats &operator=(const Stats &) = delete;
+
+        // The instance that the receive chain updates
+        static Stats &Global();
+
+        // Register a new output client, returning the counters it should update
+        std::shared_ptr<OutputStats> AddOutput(const std::string &type, const std::string &peer);
+
+        nlohmann::json ToJson() const;
+
+        // sample input
+        std::atomic<std::uint64_t> samples_received{0};
+        std::atomic<std::uint64_t> sample_blocks{0};
+        std::atomic<std::uint64_t> blocks_dropped{0};       // reported by the SDR driver as overruns
+        std::atomic<std::uint64_t> blocks_queue_dropped{0}; // dropped by QueuedReceiver because demodulation fell behind
+        std::atomic<std::uint64_t> blocks_record_dropped{0}; // left out of --record-iq because the disk fell behind
+
+        // samples that the squelch kept from the demodulator
+        std::atomic<std::uint64_t> squelched_samples{0};
+
+        // per-block processing time, in microseconds
+        Histogram convert_us{Histogram::Scale::LOG2};
+        Histogram demod_us{Histogram::Scale::LOG2};
+
+        // QueuedReceiver and PipelinedReceiver queue depths, in blocks
+        Gauge sample_queue;
+        Gauge convert_queue;
+        Gauge sync_queue;
+        Gauge fec_queue;
+
+        // sync words found and messages that passed error correction
+        std::atomic<std::uint64_t> downlink_attempts{0};
+        std::atomic<std::uint64_t> downlink_decoded{0};
+        std::atomic<std::uint64_t> uplink_attempts{0};
+        std::atomic<std::uint64_t> uplink_decoded{0};
+
+        // corrected errors per decoded message
+        Histogram downlink_corrected{Histogram::Scale::LINEAR};
+        Histogram uplink_corrected{Histogram::Scale::LINEAR};
+
+        // output clients closed, and messages left out of their output,
+        // because their backlog was full
+        std::atomic<std::uint64_t> outputs_overflow_disconnected{0};
+        std::atomic<std::uint64_t> outputs_dropped_messages{0};
+
+      private:
+        std::chrono::steady_clock::time_point start_;
+
+        mutable std::mutex outputs_mutex_;
+        mutable std::vector<std::weak_ptr<OutputStats>> outputs_;
+    };
+
+    // Measures the wall-clock time of a piece of work and adds it, in
+    // microseconds, to a histogram when destroyed
+    class ScopedTimer {
+      public:
+        explicit ScopedTimer(Histogram &histogram) : histogram_(histogram), start_(std::chrono::steady_clock::now()) {}
+        ~ScopedTimer() { histogram_.Add(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start_).count()); }
+
+        ScopedTimer(const ScopedTimer &) = delete;
+        ScopedTimer &operator=(const ScopedTimer &) = delete;
+
+      private:
+        Histogram &histogram_;
+        std::chrono::steady_clock::time_point start_;
+    };
+
+    // Periodically writes Stats::Global() as JSON to a file. Each write goes
+    // to a temporary file that is then renamed over the target, so readers
+    // never see a partial file. Stop writes a final copy.
+    class StatsWriter : public std::enable_shared_from_this<StatsWriter> {
+      public:
+        typedef std::shared_ptr<StatsWriter> Pointer;
+
+        static Pointer Create(boost::asio::io_service &service, const boost::filesystem::path &path, std::chrono::milliseconds interval) { return Pointer(new StatsWriter(service, path, interval)); }
+
+        void Start();
+        void Stop();
+
+      private:
+        StatsWriter(boost::asio::io_service &service, const boost::filesystem::path &path, std::chrono::milliseconds interval) : timer_(service), path_(path), interval_(interval) {}
+
+        void Write();
+        void PeriodicWrite();
+
+        boost::asio::steady_timer timer_;
+        boost::filesystem::path path_;
+        std::chrono::milliseconds interval_;
+    };
+}; // namespace flightaware::uat
+
+#endif
@@ -4,6 +4,7 @@
 
 #include "uat_message.h"
 
+#include <algorithm>
 #include <cmath>
 #include <iomanip>
 #include <iostream>
@@ -50,6 +51,74 @@ std::ostream &flightaware::uat::operator<<(std::ostream &os, const RawMessage &m
     return os;
 }
 
+//
+// binary framing
+//
+
+template <typename T> static void WriteBigEndian(std::ostream &os, T value) {
+    for (int shift = 8 * (sizeof(T) - 1); shift >= 0; shift -= 8) {
+        os.put((char)(std::uint8_t)(value >> shift));
+    }
+}
+
+template <typename T> static T ReadBigEndian(const std::uint8_t *p) {
+    T value = 0;
+    for (std::size_t i = 0; i < sizeof(T); ++i) {
+        value = (T)((value << 8) | p[i]);
+    }
+    return value;
+}
+
+void flightaware::uat::WriteBinaryFrame(std::ostream &os, const RawMessage &message) {
+    const auto &payload = message.Payload();
+    const long rssi = std::lround(message.Rssi() * 10);
+
+    WriteBigEndian<std::uint16_t>(os, BINARY_FRAME_HEADER_BYTES - 2 + payload.size());
+    os.put((char)static_cast<std::uint8_t>(message.Type()));
+    os.put((char)std::min(message.Errors(), 255U));
+    WriteBigEndian<std::uint64_t>(os, message.ReceivedAt());
+    WriteBigEndian<std::uint16_t>(os, (std::uint16_t)(std::int16_t)std::max(-32768L, std::min(32767L, rssi)));
+    os.write(reinterpret_cast<const char *>(payload.data()), payload.size());
+}
+
+RawMessage flightaware::uat::ParseBinaryFrame(const std::uint8_t *frame, std::size_t size) {
+    if (size < BINARY_FRAME_HEADER_BYTES) {
+        return RawMessage();
+    }
+
+    const unsigned type = frame[2];
+    const unsigned errors = frame[3];
+    const auto received_at = ReadBigEndian<std::uint64_t>(frame + 4);
+    const auto rssi = (std::int16_t)ReadBigEndian<std::uint16_t>(frame + 12);
+
+    RawMessage message(Bytes(frame + BINARY_FRAME_HEADER_BYTES, frame + size), received_at, errors, rssi / 10.0f);
+    if (static_cast<unsigned>(message.Type()) != type) {
+        return RawMessage();
+    }
+
+    return message;
+}
+
+static const std::uint8_t DATAGRAM_MAGIC[4] = {'U', '9', '7', '8'};
+
+void flightaware::uat::WriteDatagramHeader(std::uint8_t *out, std::uint32_t session, std::uint32_t sequence) {
+    std::copy(DATAGRAM_MAGIC, DATAGRAM_MAGIC + 4, out);
+    for (int i = 0; i < 4; ++i) {
+        out[4 + i] = (std::uint8_t)(session >> (24 - 8 * i));
+        out[8 + i] = (std::uint8_t)(sequence >> (24 - 8 * i));
+    }
+}
+
+bool flightaware::uat::ParseDatagramHeader(const std::uint8_t *datagram, std::size_t size, std::uint32_t &session, std::uint32_t &sequence) {
+    if (size < UDP_DATAGRAM_HEADER_BYTES || !std::equal(DATAGRAM_MAGIC, DATAGRAM_MAGIC + 4, datagram)) {
+        return false;
+    }
+
+    session = ReadBigEndian<std::uint32_t>(datagram + 4);
+    sequence = ReadBigEndian<std::uint32_t>(datagram + 8);
+    return true;
+}
+
 //
 // decoding messages
 //
@@ -7,6 +7,7 @@
 #ifndef UAT_MESSAGE_H
 #define UAT_MESSAGE_H
 
+#include <cmath>
 #include <cstdint>
 #include <vector>
 
@@ -20,6 +21,13 @@
 namespace flightaware::uat {
     class RawMessage {
       public:
+        // Mean power of the samples a message was demodulated from, linear,
+        // relative to full scale. The demodulator passes this rather than a
+        // RSSI so that the logarithm is only taken if the RSSI is used.
+        struct SignalPower {
+            double mean;
+        };
+
         RawMessage() : type_(MessageType::INVALID), received_at_(0), errors_(0), rssi_(0) {}
 
         RawMessage(const Bytes &payload, std::uint64_t received_at, unsigned errors, float rssi) : payload_(payload), received_at_(received_at), errors_(errors), rssi_(rssi) {
@@ -56,6 +64,8 @@ namespace flightaware::uat {
             }
         }
 
+        RawMessage(Bytes &&payload, std::uint64_t received_at, unsigned errors, SignalPower power) : RawMessage(std::move(payload), received_at, errors, 0.0f) { power_ = power.mean; }
+
         MessageType Type() const { return type_; }
 
         Bytes &Payload() { return payload_; }
@@ -66,7 +76,12 @@ namespace flightaware::uat {
 
         unsigned Errors() const { return errors_; }
 
-        float Rssi() const { return rssi_; }
+        // RSSI in dBFS, or 0 if unknown
+        float Rssi() const {
+            if (power_ < 0)
+                return rssi_;
+            return (power_ == 0 ? -1000 : 10 * std::log10(power_));
+        }
 
         // Number of raw bits in the message, excluding the sync bits
         unsigned BitLength() const {
@@ -146,10 +161,56 @@ namespace flightaware::uat {
         std::uint64_t received_at_;
         unsigned errors_;
         float rssi_;
+        double power_ = -1; // if not negative, overrides rssi_
     };
 
     std::ostream &operator<<(std::ostream &os, const RawMessage &message);
 
+    // Compact binary framing of raw messages, as served by --binary-port.
+    // Each message is one frame; integers are big-endian.
+    //
+    //   0   2  frame length: the number of bytes after this field
+    //   2   1  message type: 0 = downlink short, 1 = downlink long, 2 = uplink
+    //   3   1  number of errors corrected
+    //   4   8  receive time, milliseconds since the Unix epoch, or 0 if unknown
+    //   12  2  RSSI in tenths of a dB, signed, or 0 if unknown
+    //   14     payload: 18, 34 or 432 bytes, according to the message type
+    //
+    // Readers skip frames of a type they do not know, using the frame
+    // length, so that other frame types can be added later.
+    const std::size_t BINARY_FRAME_HEADER_BYTES = 14;
+
+    // Write `message` as one binary frame
+    void WriteBinaryFrame(std::ostream &os, const RawMessage &message);
+
+    // Parse the binary frame in `frame` .. `frame + size`, including its
+    // length field; returns an invalid RawMessage if the frame's type is
+    // unknown or its payload is the wrong size for its type.
+    RawMessage ParseBinaryFrame(const std::uint8_t *frame, std::size_t size);
+
+    // Datagrams sent by --udp-output carry one or more whole binary frames
+    // after a header that lets receivers detect loss; integers are
+    // big-endian.
+    //
+    //   0   4  magic "U978"
+    //   4   4  session: chosen at random each time the sender starts
+    //   8   4  sequence number: one more than the sender's previous
+    //          datagram in the same session
+    //   12     binary frames
+    //
+    // No datagram is larger than UDP_DATAGRAM_MAX_BYTES, so none is
+    // fragmented on an Ethernet path; a batch that does not fit in one is
+    // split between several.
+    const std::size_t UDP_DATAGRAM_HEADER_BYTES = 12;
+    const std::size_t UDP_DATAGRAM_MAX_BYTES = 1472;
+
+    // Fill the UDP_DATAGRAM_HEADER_BYTES at `out`
+    void WriteDatagramHeader(std::uint8_t *out, std::uint32_t session, std::uint32_t sequence);
+
+    // Parse the header of the datagram `datagram` .. `datagram + size`;
+    // returns false if it is too short or has the wrong magic.
+    bool ParseDatagramHeader(const std::uint8_t *datagram, std::size_t size, std::uint32_t &session, std::uint32_t &sequence);
+
     typedef std::vector<RawMessage> MessageVector;
     typedef std::shared_ptr<MessageVector> SharedMessageVector;
 
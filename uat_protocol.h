@@ -41,6 +41,10 @@ namespace flightaware::uat {
         const unsigned DOWNLINK_LONG_POLY = 0x187;
         const unsigned UPLINK_BLOCK_POLY = 0x187;
 
+        // All codes use generator roots alpha^(FCR + i*PRIM), i = 0 .. roots-1
+        const unsigned FCR = 120;
+        const unsigned PRIM = 1;
+
         const int DOWNLINK_SHORT_ROOTS = 12;
         const int DOWNLINK_LONG_ROOTS = 14;
         const int UPLINK_BLOCK_ROOTS = 20;